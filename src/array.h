@@ -167,4 +167,230 @@ struct Array
 	{
 		return sizeof( Type ) * count;
 	}
-};
\ No newline at end of file
+};
+
+// DYNAMIC ARRAY ////////////////////////////////////////////////////////////////
+// Array whose storage grows in an allocator rather than sitting inline with a fixed capacity.
+// Capacity doubles through Allocator::reallocate, which extends the block in place while it's the
+// allocator's last allocation and only copies it otherwise. Anything that grows returns false or
+// nullptr once the allocator is out of room, leaving the array as it was. Growing can move data,
+// so pointers into it don't survive an add. Type must be safe to copy with memcpy.
+
+#define DYNAMIC_ARRAY_MIN_CAPACITY		8
+
+template <typename Type>
+struct DynamicArray
+{
+	Allocator *allocator = nullptr;
+	Type *data = nullptr;
+	u64 count = 0;
+	u64 allocated = 0;
+
+	// Capacity is allocated up front, 0 leaves it to the first add
+	[[nodiscard]] bool init( Allocator *arrayAllocator, u64 capacity = 0 )
+	{
+		allocator = arrayAllocator;
+		data = nullptr;
+		count = 0;
+		allocated = 0;
+
+		return capacity == 0 || reserve( capacity );
+	}
+
+	// Only gives the memory back if nothing was allocated after it
+	void free()
+	{
+		if ( data )
+			allocator->free( data );
+
+		data = nullptr;
+		count = 0;
+		allocated = 0;
+	}
+
+	// Room for at least capacity items, doubling so a run of adds stays linear
+	[[nodiscard]] bool reserve( u64 capacity )
+	{
+		if ( capacity <= allocated )
+			return true;
+
+		assert( allocator );
+
+		u64 grown = allocated * 2 > DYNAMIC_ARRAY_MIN_CAPACITY ? allocated * 2 : DYNAMIC_ARRAY_MIN_CAPACITY;
+		grown = grown > capacity ? grown : capacity;
+
+		Type *grownData = data ? allocator->reallocate<Type>( data, grown * sizeof( Type ) ) : allocator->allocate<Type>( grown );
+
+		// Near the end of the allocator settle for exactly what was asked
+		if ( !grownData && grown > capacity )
+		{
+			grown = capacity;
+			grownData = data ? allocator->reallocate<Type>( data, grown * sizeof( Type ) ) : allocator->allocate<Type>( grown );
+		}
+
+		if ( !grownData )
+			return false;
+
+		data = grownData;
+		allocated = grown;
+
+		return true;
+	}
+
+	[[nodiscard]] inline bool add( const Type &t )
+	{
+		if ( count == allocated && !reserve( count + 1 ) )
+			return false;
+
+		data[ count++ ] = t;
+		return true;
+	}
+
+	// Needs the room to have been reserved
+	inline void add_no_bounds_check( const Type &t )
+	{
+		assert( count < allocated );
+		data[ count++ ] = t;
+	}
+
+	template <typename ...Args>
+	inline void add_no_bounds_check( const Type &t, Args&&... args )
+	{
+		add_no_bounds_check( t );
+		add_no_bounds_check( args... );
+	}
+
+	template <typename ...Args>
+	[[nodiscard]] bool add( const Type &t, Args&&... args )
+	{
+		if ( !reserve( count + 1 + sizeof...( Args ) ) )
+			return false;
+
+		add_no_bounds_check( t, args... );
+		return true;
+	}
+
+	[[nodiscard]] inline bool append( const Type *t, u64 appendCount )
+	{
+		if ( !reserve( count + appendCount ) )
+			return false;
+
+		Type *p = &data[ count ];
+
+		for ( u64 i = 0; i < appendCount; ++i )
+			*p++ = *t++;
+
+		count += appendCount;
+		return true;
+	}
+
+	inline void set( u64 idx, const Type &t )
+	{
+		assert( idx < count );
+		data[ idx ] = t;
+	}
+
+	void set_all( const Type &value, bool totalCapacity )
+	{
+		if ( totalCapacity )
+			count = allocated;
+
+		for ( u64 i = 0; i < count; ++i )
+			data[ i ] = value;
+	}
+
+	inline void set_full()
+	{
+		count = allocated;
+	}
+
+	// Growing leaves the new items uninitialised
+	[[nodiscard]] inline bool resize( u64 size )
+	{
+		if ( !reserve( size ) )
+			return false;
+
+		count = size;
+		return true;
+	}
+
+	inline void clear()
+	{
+		count = 0;
+	}
+
+	inline void swap_and_remove( u64 idx )
+	{
+		assert( idx < count );
+		data[ idx ] = data[ --count ];
+	}
+
+	[[nodiscard]] inline Type & operator[] ( u64 idx )
+	{
+		assert( idx < count );
+		return data[ idx ];
+	}
+
+	[[nodiscard]] inline const Type & operator[] ( u64 idx ) const
+	{
+		assert( idx < count );
+		return data[ idx ];
+	}
+
+	[[nodiscard]] inline Type &top()
+	{
+		assert( count > 0 );
+		return data[ count - 1 ];
+	}
+
+	// The new item, uninitialised, or nullptr if the array couldn't grow
+	[[nodiscard]] inline Type *push()
+	{
+		if ( count == allocated && !reserve( count + 1 ) )
+			return nullptr;
+
+		return &data[ count++ ];
+	}
+
+	inline Type &pop()
+	{
+		assert( count > 0 );
+		return data[ --count ];
+	}
+
+	inline void pop_back()
+	{
+		assert( count > 0 );
+		--count;
+	}
+
+	[[nodiscard]] inline bool has_value( const Type &t ) const
+	{
+		const Type *p = data;
+		for ( u64 i = 0; i < count; ++i )
+			if ( *p++ == t )
+				return true;
+		return false;
+	}
+
+	[[nodiscard]] inline bool empty() const
+	{
+		return count == 0;
+	}
+
+	// Full only means the next add has to grow
+	[[nodiscard]] inline bool full() const
+	{
+		return count == allocated;
+	}
+
+	[[nodiscard]] inline u64 capacity() const
+	{
+		return allocated;
+	}
+
+	[[nodiscard]] inline u64 bytes() const
+	{
+		return sizeof( Type ) * count;
+	}
+};
@@ -0,0 +1,555 @@
+
+// Benchmark build of grey_merger. Synthetic grey inputs are generated and written out as png files
+// once, then each phase of a merge is timed on its own over a number of runs. Each run of a phase
+// gets a fresh arena sized by the same planning the tool uses, so first touch page faults are
+// counted like they are in a real merge. Results go to stdout as csv, one line per pattern, size
+// and phase, for comparing builds. MB/s is the decoded or merged pixel data over the median time.
+
+// The tool's own entry point is kept, renamed, so everything it uses is still referenced
+#define main grey_merger_main
+#include "main.cpp"
+#undef main
+
+#define BENCH_MAX_RUNS		1000
+#define BENCH_MAX_SIZES		16
+#define BENCH_INPUTS		3			// red, green and blue
+
+enum BENCH_PATTERN : u32
+{
+	BENCH_PATTERN_NOISE,
+	BENCH_PATTERN_GRADIENT,
+	BENCH_PATTERN_FLAT,
+	BENCH_PATTERN_COUNT,
+};
+
+static const char *benchPatternNames[ BENCH_PATTERN_COUNT ] = { "noise", "gradient", "flat" };
+
+enum BENCH_PHASE : u32
+{
+	BENCH_PHASE_READ_IMAGE,				// whole image stb_image decode, the fallback for inputs the png reader can't stream
+	BENCH_PHASE_PNG_READER,				// every row through the streaming png reader, what png inputs use
+	BENCH_PHASE_MERGE,
+	BENCH_PHASE_ENCODE,
+	BENCH_PHASE_COUNT,
+};
+
+static const char *benchPhaseNames[ BENCH_PHASE_COUNT ] = { "read_image", "png_reader", "merge", "encode" };
+
+struct BenchOptions
+{
+	u32 sizes[ BENCH_MAX_SIZES ] = { 1024, 2048, 4096 };
+	u32 sizeCount = 3;
+	bool patterns[ BENCH_PATTERN_COUNT ] = { true, true, true };
+	u32 runs = 5;
+	u32 jobs = 1;
+	bool verbose = false;				// progress goes to stderr, stdout only ever holds results
+	const char *directory = "grey_merger_bench/";
+} bench;
+
+// One size of one pattern. The planes and the merged output live in a setup arena for every run.
+struct BenchCase
+{
+	u32 size;
+	char paths[ BENCH_INPUTS ][ 4096 ];
+	char outputPath[ 4096 ];
+	u8 *planes[ BENCH_INPUTS ];
+	u8 *output;
+	u64 memory[ BENCH_PHASE_COUNT ];	// transient memory for one run of each phase
+};
+
+static int bench_usage_message( RESULT_CODE code )
+{
+	log( "\nERROR_CODE: %s\n", error_code_string( code ) );
+	log( ":: USAGE ::" );
+	log( "Expects grey_merger_bench <commands>" );
+	log( "Writes \"pattern,size,phase,runs,bytes,median_ms,p95_ms,mb_per_s\" lines to stdout\n" );
+	log( "COMMANDS" );
+	log( "[-v]                         EG. -v                                             (report progress on stderr)" );
+	log( "[-sizes] <list>              EG. -sizes 1K,4K,16K                               (square input sizes in pixels, K multiplies by 1024. Defaults to 1K,2K,4K)" );
+	log( "[-patterns] <list>           EG. -patterns noise,flat                           (inputs to generate, noise, gradient or flat. Defaults to all of them)" );
+	log( "[-runs] <count>              EG. -runs 20                                       (timed runs of each phase. Defaults to 5)" );
+	log( "[-jobs] <count>              EG. -jobs 8                                        (worker threads the encoder uses, 0 uses every core. Defaults to 1)" );
+	log( "[-dir] <path>                EG. -dir /tmp/bench/                               (where the generated inputs and outputs are written. Defaults to grey_merger_bench/)" );
+
+	return code;
+}
+
+// Deterministic, so every build measures the same bytes
+static void bench_fill( u8 *plane, u32 size, BENCH_PATTERN pattern, u32 input )
+{
+	u64 pixels = static_cast<u64>( size ) * size;
+
+	switch ( pattern )
+	{
+		case BENCH_PATTERN_NOISE:
+		{
+			u32 state = 0x9E3779B9u * ( input + 1 );
+
+			for ( u64 i = 0; i < pixels; ++i )
+			{
+				state ^= state << 13;
+				state ^= state >> 17;
+				state ^= state << 5;
+				plane[ i ] = static_cast<u8>( state >> 24 );
+			}
+		}
+		break;
+
+		case BENCH_PATTERN_GRADIENT:
+		{
+			// Horizontal, vertical and diagonal ramps
+			u64 span = size > 1 ? size - 1 : 1;
+
+			for ( u32 y = 0; y < size; ++y )
+			{
+				u8 *row = plane + static_cast<u64>( y ) * size;
+
+				for ( u32 x = 0; x < size; ++x )
+				{
+					u64 t = input == 0 ? x * 255ull : ( input == 1 ? y * 255ull : ( x + y ) * 255ull / 2 );
+					row[ x ] = static_cast<u8>( t / span );
+				}
+			}
+		}
+		break;
+
+		case BENCH_PATTERN_FLAT:
+		case BENCH_PATTERN_COUNT:
+		{
+			memset( plane, 64 * ( input + 1 ), pixels );
+		}
+		break;
+	}
+}
+
+// Parses "1024,4K,16K", K, M and G multiply by 1024 as they do for memory sizes
+[[nodiscard]] static bool bench_parse_sizes( const char *text )
+{
+	char list[ 256 ];
+	const char *token;
+
+	if ( !text || string_copy( list, sizeof( list ), text ) >= sizeof( list ) - 1 )
+		return false;
+
+	bench.sizeCount = 0;
+	char *next = string_tokenise( list, ",", &token, nullptr );
+
+	while ( token )
+	{
+		u64 size;
+
+		if ( bench.sizeCount == BENCH_MAX_SIZES || !parse_memory_size( token, &size ) || size == 0 || size > 65535 )
+			return false;
+
+		bench.sizes[ bench.sizeCount++ ] = static_cast<u32>( size );
+		next = string_tokenise( next, ",", &token, nullptr );
+	}
+
+	return bench.sizeCount > 0;
+}
+
+[[nodiscard]] static bool bench_parse_patterns( const char *text )
+{
+	char list[ 256 ];
+	const char *token;
+
+	if ( !text || string_copy( list, sizeof( list ), text ) >= sizeof( list ) - 1 )
+		return false;
+
+	for ( bool &pattern : bench.patterns )
+		pattern = false;
+
+	char *next = string_tokenise( list, ",", &token, nullptr );
+	bool any = false;
+
+	while ( token )
+	{
+		u32 p = 0;
+
+		while ( p < BENCH_PATTERN_COUNT && strcmp( token, benchPatternNames[ p ] ) != 0 )
+			++p;
+
+		if ( p == BENCH_PATTERN_COUNT )
+			return false;
+
+		bench.patterns[ p ] = true;
+		any = true;
+		next = string_tokenise( next, ",", &token, nullptr );
+	}
+
+	return any;
+}
+
+// Every run of a phase starts from a new job arena, as a merge does
+[[nodiscard]] static bool bench_begin_run( u64 memory )
+{
+	app.jobMemory = create_memory_arena( "job" );
+
+	if ( !app.jobMemory.init_virtual( 0, memory, 0 ) )
+	{
+		log_error( "Failed to initialise %llu bytes of bench memory", memory );
+		return false;
+	}
+
+	threadMemory = &app.jobMemory;
+
+	return true;
+}
+
+static void bench_end_run()
+{
+	threadMemory = &app.memory;
+	app.jobMemory.free();
+}
+
+static RESULT_CODE bench_read_image( BenchCase *c )
+{
+	for ( u32 i = 0; i < BENCH_INPUTS; ++i )
+	{
+		u32 w = 0;
+		u32 h = 0;
+		u32 channels = 1;
+
+		if ( !read_image( &threadMemory->transient, c->paths[ i ], &w, &h, &channels ) )
+		{
+			log_warning( "Failed to open file: %s", c->paths[ i ] );
+			return RESULT_CODE_FAILED_TO_OPEN_INPUT_FILE;
+		}
+	}
+
+	return RESULT_CODE_SUCCESS;
+}
+
+static RESULT_CODE bench_png_reader( BenchCase *c )
+{
+	for ( u32 i = 0; i < BENCH_INPUTS; ++i )
+	{
+		ChannelInput input;
+		RESULT_CODE code = decode_channel_input( &input, &threadMemory->transient, c->paths[ i ] );
+
+		for ( u32 y = 0; code == RESULT_CODE_SUCCESS && y < input.image.h; ++y )
+		{
+			if ( !channel_input_row( &input, y ) )
+			{
+				log_warning( "Failed to decode row %u of file: %s", y, c->paths[ i ] );
+				code = RESULT_CODE_FAILED_TO_DECODE_INPUT_FILE;
+			}
+		}
+
+		png_reader_close( &input.png );
+
+		if ( code != RESULT_CODE_SUCCESS )
+			return code;
+	}
+
+	return RESULT_CODE_SUCCESS;
+}
+
+static RESULT_CODE bench_merge( BenchCase *c )
+{
+	const char *paths[ 4 ] = { c->paths[ 0 ], c->paths[ 1 ], c->paths[ 2 ], nullptr };
+	ChannelInput inputs[ 4 ];
+
+	for ( u32 i = 0; i < BENCH_INPUTS; ++i )
+		inputs[ i ].image = { c->planes[ i ], c->size, c->size, 1, static_cast<u64>( c->size ) * c->size };
+
+	return merge_channel_rows( paths, inputs, c->size, c->size, c->output, nullptr, nullptr );
+}
+
+static RESULT_CODE bench_encode( BenchCase *c )
+{
+	if ( !png_write( &app.pool, &threadMemory->transient, c->outputPath, c->output, c->size, c->size, app.merge.layout, { options.compression, options.pngFilter } ) )
+	{
+		log_warning( "Failed to create output image: %s", c->outputPath );
+		return RESULT_CODE_FAILED_TO_CREATE_OUTPUT_FILE;
+	}
+
+	return RESULT_CODE_SUCCESS;
+}
+
+static RESULT_CODE bench_run_phase( BenchCase *c, BENCH_PHASE phase )
+{
+	switch ( phase )
+	{
+		case BENCH_PHASE_READ_IMAGE:	return bench_read_image( c );
+		case BENCH_PHASE_PNG_READER:	return bench_png_reader( c );
+		case BENCH_PHASE_MERGE:			return bench_merge( c );
+		case BENCH_PHASE_ENCODE:		return bench_encode( c );
+		case BENCH_PHASE_COUNT:			break;
+	}
+
+	return RESULT_CODE_SUCCESS;
+}
+
+// Writes the inputs and works out each phase's memory. The inputs are encoded with the tool's
+// own writer at its default settings, the output is merged once so encode has something to read.
+static RESULT_CODE bench_setup( BenchCase *c, MemoryArena *setup, BENCH_PATTERN pattern, u32 size )
+{
+	u64 planeBytes = static_cast<u64>( size ) * size;
+	u64 outputBytes = planeBytes * app.merge.layout;
+
+	c->size = size;
+
+	for ( u32 i = 0; i < BENCH_INPUTS; ++i )
+	{
+		snprintf( c->paths[ i ], sizeof( c->paths[ i ] ), "%s%s_%u_%c.png", bench.directory, benchPatternNames[ pattern ], size, "rgb"[ i ] );
+
+		c->planes[ i ] = setup->transient.allocate<u8>( planeBytes );
+
+		if ( !c->planes[ i ] )
+			return RESULT_CODE_FAILED_TO_ALLOCATE_MEMORY_FOR_OUTPUT_IMAGE;
+
+		bench_fill( c->planes[ i ], size, pattern, i );
+
+		if ( !bench_begin_run( png_write_memory( size, size, 1, bench.jobs ) + MEMORY_ALLOCATION_OVERHEAD ) )
+			return RESULT_CODE_FAILED_MEMORY_ARENA_INITIALISATION;
+
+		bool written = png_write( &app.pool, &threadMemory->transient, c->paths[ i ], c->planes[ i ], size, size, 1, { options.compression, options.pngFilter } );
+
+		bench_end_run();
+
+		if ( !written )
+		{
+			log_warning( "Failed to create input image: %s", c->paths[ i ] );
+			return RESULT_CODE_FAILED_TO_CREATE_OUTPUT_FILE;
+		}
+	}
+
+	snprintf( c->outputPath, sizeof( c->outputPath ), "%s%s_%u_out.png", bench.directory, benchPatternNames[ pattern ], size );
+
+	c->output = setup->transient.allocate<u8>( outputBytes );
+
+	if ( !c->output )
+		return RESULT_CODE_FAILED_TO_ALLOCATE_MEMORY_FOR_OUTPUT_IMAGE;
+
+	c->memory[ BENCH_PHASE_READ_IMAGE ] = 0;
+	c->memory[ BENCH_PHASE_PNG_READER ] = 0;
+
+	for ( u32 i = 0; i < BENCH_INPUTS; ++i )
+	{
+		u32 w, h, stride;
+		u64 fileBytes, memory;
+
+		if ( !file_size( c->paths[ i ], &fileBytes ) )
+			return RESULT_CODE_FAILED_TO_OPEN_INPUT_FILE;
+
+		RESULT_CODE code = plan_channel_input( c->paths[ i ], &w, &h, &stride, &memory );
+
+		if ( code != RESULT_CODE_SUCCESS )
+			return code;
+
+		c->memory[ BENCH_PHASE_READ_IMAGE ] += stb_decode_memory( fileBytes, w, h, 1 ) + MEMORY_ALLOCATION_OVERHEAD;
+		c->memory[ BENCH_PHASE_PNG_READER ] += memory;
+	}
+
+	c->memory[ BENCH_PHASE_MERGE ] = KB( 64 );
+	c->memory[ BENCH_PHASE_ENCODE ] = png_write_memory( size, size, app.merge.layout, bench.jobs ) + MEMORY_ALLOCATION_OVERHEAD;
+
+	if ( !bench_begin_run( c->memory[ BENCH_PHASE_MERGE ] ) )
+		return RESULT_CODE_FAILED_MEMORY_ARENA_INITIALISATION;
+
+	RESULT_CODE code = bench_merge( c );
+
+	bench_end_run();
+
+	return code;
+}
+
+static int bench_compare( const void *a, const void *b )
+{
+	f64 lhs = *static_cast<const f64 *>( a );
+	f64 rhs = *static_cast<const f64 *>( b );
+
+	return ( lhs > rhs ) - ( lhs < rhs );
+}
+
+// Times every phase of one case, runs of different phases are interleaved so a
+// slow spell on the machine is spread over all of them rather than landing on one
+static RESULT_CODE bench_case( BenchCase *c, BENCH_PATTERN pattern )
+{
+	static f64 times[ BENCH_PHASE_COUNT ][ BENCH_MAX_RUNS ];
+
+	for ( u32 run = 0; run < bench.runs; ++run )
+	{
+		for ( u32 phase = 0; phase < BENCH_PHASE_COUNT; ++phase )
+		{
+			if ( !bench_begin_run( c->memory[ phase ] ) )
+				return RESULT_CODE_FAILED_MEMORY_ARENA_INITIALISATION;
+
+			auto start = std::chrono::steady_clock::now();
+			RESULT_CODE code = bench_run_phase( c, static_cast<BENCH_PHASE>( phase ) );
+			times[ phase ][ run ] = std::chrono::duration<f64, std::milli>( std::chrono::steady_clock::now() - start ).count();
+
+			bench_end_run();
+
+			if ( code != RESULT_CODE_SUCCESS )
+				return code;
+		}
+	}
+
+	u64 planeBytes = static_cast<u64>( c->size ) * c->size;
+	u64 outputBytes = planeBytes * app.merge.layout;
+	u64 phaseBytes[ BENCH_PHASE_COUNT ] = { planeBytes * BENCH_INPUTS, planeBytes * BENCH_INPUTS, outputBytes, outputBytes };
+
+	for ( u32 phase = 0; phase < BENCH_PHASE_COUNT; ++phase )
+	{
+		f64 *sorted = times[ phase ];
+		u32 n = bench.runs;
+
+		qsort( sorted, n, sizeof( f64 ), bench_compare );
+
+		// Nearest rank p95, with few runs it's the slowest one
+		f64 median = n % 2 ? sorted[ n / 2 ] : ( sorted[ n / 2 - 1 ] + sorted[ n / 2 ] ) * 0.5;
+		f64 p95 = sorted[ ( n * 95 + 99 ) / 100 - 1 ];
+		f64 mbPerSecond = median > 0.0 ? ( static_cast<f64>( phaseBytes[ phase ] ) / MB( 1 ) ) / ( median / 1000.0 ) : 0.0;
+
+		log( "%s,%u,%s,%u,%llu,%.3f,%.3f,%.1f", benchPatternNames[ pattern ], c->size, benchPhaseNames[ phase ], n, phaseBytes[ phase ], median, p95, mbPerSecond );
+	}
+
+	fflush( stdout );
+
+	return RESULT_CODE_SUCCESS;
+}
+
+static constexpr auto benchCommands = frozen_map<CommandFunc>( {
+	{ "-v", [] ( int &index, int argc, const char *argv[] )
+		{
+			bench.verbose = true;
+
+			return RESULT_CODE_SUCCESS;
+		} },
+
+	{ "-sizes", [] ( int &index, int argc, const char *argv[] )
+		{
+			if ( !bench_parse_sizes( argv[ ++index ] ) )
+				return RESULT_CODE_INVALID_BENCH_OPTION;
+
+			return RESULT_CODE_SUCCESS;
+		} },
+
+	{ "-patterns", [] ( int &index, int argc, const char *argv[] )
+		{
+			if ( !bench_parse_patterns( argv[ ++index ] ) )
+				return RESULT_CODE_INVALID_BENCH_OPTION;
+
+			return RESULT_CODE_SUCCESS;
+		} },
+
+	{ "-runs", [] ( int &index, int argc, const char *argv[] )
+		{
+			const char *text = argv[ ++index ];
+			int runs = text ? atoi( text ) : 0;
+
+			if ( runs <= 0 || runs > BENCH_MAX_RUNS )
+				return RESULT_CODE_INVALID_BENCH_OPTION;
+
+			bench.runs = static_cast<u32>( runs );
+
+			return RESULT_CODE_SUCCESS;
+		} },
+
+	{ "-jobs", [] ( int &index, int argc, const char *argv[] )
+		{
+			int jobs = atoi( argv[ ++index ] );
+
+			if ( jobs <= 0 )
+				jobs = static_cast<int>( std::thread::hardware_concurrency() );
+
+			bench.jobs = jobs < 1 ? 1 : ( jobs > THREAD_POOL_MAX_THREADS ? THREAD_POOL_MAX_THREADS : jobs );
+
+			return RESULT_CODE_SUCCESS;
+		} },
+
+	{ "-dir", [] ( int &index, int argc, const char *argv[] )
+		{
+			bench.directory = argv[ ++index ];
+
+			return bench.directory ? RESULT_CODE_SUCCESS : RESULT_CODE_INVALID_BENCH_OPTION;
+		} },
+} );
+
+int main( int argc, const char *argv[] )
+{
+	for ( int i = 1; i < argc; ++i )
+	{
+		auto f = benchCommands.find( argv[ i ] );
+
+		if ( f )
+		{
+			RESULT_CODE code = f->value( i, argc, &argv[ 0 ] );
+			if ( code != RESULT_CODE_SUCCESS )
+				return bench_usage_message( code );
+		}
+		else
+		{
+			log_warning( "Unknown command: %s", argv[ i ] );
+			return bench_usage_message( RESULT_CODE_UNKNOWN_OPTIONAL_COMMAND );
+		}
+	}
+
+	merge_build_table( &app.merge, cpu_features(), options.layout );
+
+	app.memory = create_memory_arena( "app" );
+
+	if ( !app.memory.init( bench.jobs * sizeof( MemoryArena ) + MEMORY_ALLOCATION_OVERHEAD, PLAN_MEMORY, 0, true ) )
+	{
+		log_error( "Failed to initialise memory app.memory" );
+		return bench_usage_message( RESULT_CODE_FAILED_MEMORY_ARENA_INITIALISATION );
+	}
+
+	if ( !start_workers( bench.jobs - 1, 0 ) )
+		return bench_usage_message( RESULT_CODE_FAILED_MEMORY_ARENA_INITIALISATION );
+
+	// Bench files always go in a directory of their own
+	u64 directoryLength = strlen( bench.directory );
+
+	if ( directoryLength == 0 || ( bench.directory[ directoryLength - 1 ] != '/' && bench.directory[ directoryLength - 1 ] != '\\' ) )
+	{
+		log_warning( "-dir must end in a separator: %s", bench.directory );
+		return bench_usage_message( RESULT_CODE_INVALID_BENCH_OPTION );
+	}
+
+	make_directory( bench.directory );
+
+	log( "pattern,size,phase,runs,bytes,median_ms,p95_ms,mb_per_s" );
+
+	RESULT_CODE code = RESULT_CODE_SUCCESS;
+
+	for ( u32 s = 0; s < bench.sizeCount && code == RESULT_CODE_SUCCESS; ++s )
+	{
+		for ( u32 p = 0; p < BENCH_PATTERN_COUNT && code == RESULT_CODE_SUCCESS; ++p )
+		{
+			if ( !bench.patterns[ p ] )
+				continue;
+
+			u32 size = bench.sizes[ s ];
+			u64 setupBytes = static_cast<u64>( size ) * size * ( BENCH_INPUTS + app.merge.layout ) + MEMORY_ALLOCATION_OVERHEAD * ( BENCH_INPUTS + 1 );
+			MemoryArena setup = create_memory_arena( "setup" );
+
+			if ( !setup.init_virtual( 0, setupBytes, 0 ) )
+			{
+				log_error( "Failed to initialise %llu bytes of bench memory", setupBytes );
+				code = RESULT_CODE_FAILED_MEMORY_ARENA_INITIALISATION;
+				break;
+			}
+
+			if ( bench.verbose )
+				log_warning( "Benchmarking %s inputs at %u x %u", benchPatternNames[ p ], size, size );
+
+			BenchCase c;
+			code = bench_setup( &c, &setup, static_cast<BENCH_PATTERN>( p ), size );
+
+			if ( code == RESULT_CODE_SUCCESS )
+				code = bench_case( &c, static_cast<BENCH_PATTERN>( p ) );
+
+			setup.free();
+		}
+	}
+
+	app.pool.free();
+
+	if ( code != RESULT_CODE_SUCCESS )
+		return bench_usage_message( code );
+
+	return code;
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#if defined( __x86_64__ ) || defined( _M_X64 )
+	#define CPU_X64
+#endif
+
+// Functions using instructions above the compile baseline need tagging on gcc/clang,
+// msvc allows any intrinsic anywhere
+#if defined( CPU_X64 ) && !defined( _MSC_VER )
+	#define TARGET_SSSE3				__attribute__(( target( "ssse3" ) ))
+	#define TARGET_SSE41				__attribute__(( target( "sse4.1" ) ))
+	#define TARGET_AVX2					__attribute__(( target( "avx2" ) ))
+#else
+	#define TARGET_SSSE3
+	#define TARGET_SSE41
+	#define TARGET_AVX2
+#endif
+
+using CpuFeatures = u32;
+enum CPU_FEATURES : CpuFeatures
+{
+	CPU_FEATURE_SSE2	= BIT( 0 ),
+	CPU_FEATURE_SSSE3	= BIT( 1 ),
+	CPU_FEATURE_SSE41	= BIT( 2 ),
+	CPU_FEATURE_AVX2	= BIT( 3 ),
+};
+
+[[nodiscard]] static CpuFeatures cpu_detect_features()
+{
+	CpuFeatures features = 0;
+
+	#if defined( CPU_X64 ) && defined( _MSC_VER )
+		int info[ 4 ];
+		__cpuid( info, 1 );
+
+		// SSE2 is part of x64
+		features |= CPU_FEATURE_SSE2;
+
+		if ( info[ 2 ] & BIT( 9 ) )
+			features |= CPU_FEATURE_SSSE3;
+
+		if ( info[ 2 ] & BIT( 19 ) )
+			features |= CPU_FEATURE_SSE41;
+
+		// AVX2 also needs the OS to save the ymm registers
+		bool osxsave = ( info[ 2 ] & BIT( 27 ) ) != 0;
+
+		if ( osxsave && ( _xgetbv( 0 ) & 0x6 ) == 0x6 )
+		{
+			__cpuidex( info, 7, 0 );
+
+			if ( info[ 1 ] & BIT( 5 ) )
+				features |= CPU_FEATURE_AVX2;
+		}
+	#elif defined( CPU_X64 )
+		__builtin_cpu_init();
+
+		features |= CPU_FEATURE_SSE2;
+
+		if ( __builtin_cpu_supports( "ssse3" ) )
+			features |= CPU_FEATURE_SSSE3;
+
+		if ( __builtin_cpu_supports( "sse4.1" ) )
+			features |= CPU_FEATURE_SSE41;
+
+		if ( __builtin_cpu_supports( "avx2" ) )
+			features |= CPU_FEATURE_AVX2;
+	#endif
+
+	return features;
+}
+
+[[nodiscard]] static CpuFeatures cpu_features()
+{
+	static const CpuFeatures features = cpu_detect_features();
+	return features;
+}
@@ -0,0 +1,938 @@
+#pragma once
+
+// Deflate compressor working on independent slices of one stream. A slice may reference the
+// 32KB in front of it as a dictionary and ends byte aligned, either on a sync flush or on the
+// final block, so slices compressed on different threads concatenate into one valid stream.
+// Shares the code tables with inflate.h.
+
+#define DEFLATE_WINDOW_SIZE			32768
+#define DEFLATE_WINDOW_MASK			( DEFLATE_WINDOW_SIZE - 1 )
+#define DEFLATE_MIN_MATCH			3
+#define DEFLATE_MAX_MATCH			258
+#define DEFLATE_TOO_FAR				4096
+#define DEFLATE_MAX_HASH_BITS		16
+#define DEFLATE_DEFAULT_LEVEL		5
+#define DEFLATE_BLOCK_SYMBOLS		16384
+#define DEFLATE_BLOCK_BYTES			( 65535 - DEFLATE_MAX_MATCH )		// keeps every block storable
+#define DEFLATE_LIT_LEN_CODES		286
+#define DEFLATE_DIST_CODES			30
+#define DEFLATE_CODE_LENGTH_CODES	19
+
+enum DEFLATE_STRATEGY : u8
+{
+	DEFLATE_STRATEGY_STORE,					// stored blocks, no compression
+	DEFLATE_STRATEGY_HUFFMAN,				// literals only
+	DEFLATE_STRATEGY_RLE,					// runs of one byte, matches at distance 1 only
+	DEFLATE_STRATEGY_GREEDY,				// take the first match found at each position
+	DEFLATE_STRATEGY_LAZY,					// hold a match back while the next position can do better
+};
+
+struct DeflateLevel
+{
+	DEFLATE_STRATEGY strategy;
+	u8 hashBits;
+	u8 zlibLevel;							// compression level hint written in the zlib header
+	u16 goodLength;							// cut the chain short once a match this long is in hand
+	u16 lazyLength;							// lazy: stop looking for a better match past this length
+											// greedy: longest match whose positions are all hashed
+	u16 niceLength;							// stop searching once a match is this long
+	u16 maxChain;							// most hash chain entries tried per position
+};
+
+// Smaller hash tables on the fast levels stay in cache, the slow levels walk longer chains
+static const DeflateLevel deflateLevels[ 10 ] =
+{
+	{ DEFLATE_STRATEGY_STORE,	0,	0,	0,	0,		0,		0 },
+	{ DEFLATE_STRATEGY_GREEDY,	14,	0,	4,	4,		8,		4 },
+	{ DEFLATE_STRATEGY_GREEDY,	14,	1,	4,	5,		16,		8 },
+	{ DEFLATE_STRATEGY_GREEDY,	15,	1,	4,	6,		32,		16 },
+	{ DEFLATE_STRATEGY_LAZY,	15,	1,	4,	4,		16,		16 },
+	{ DEFLATE_STRATEGY_LAZY,	15,	2,	8,	16,		32,		32 },
+	{ DEFLATE_STRATEGY_LAZY,	15,	2,	8,	16,		128,	128 },
+	{ DEFLATE_STRATEGY_LAZY,	15,	3,	8,	32,		128,	256 },
+	{ DEFLATE_STRATEGY_LAZY,	16,	3,	32,	128,	258,	1024 },
+	{ DEFLATE_STRATEGY_LAZY,	16,	3,	32,	258,	258,	4096 },
+};
+
+static const DeflateLevel deflateHuffmanOnly = { DEFLATE_STRATEGY_HUFFMAN, 0, 0, 0, 0, 0, 0 };
+static const DeflateLevel deflateRle = { DEFLATE_STRATEGY_RLE, 0, 0, 0, 0, 0, 0 };
+
+struct DeflateBits
+{
+	u8 *out;
+	u64 pos;
+	u64 capacity;
+	u64 buffer;
+	u32 count;
+};
+
+struct DeflateHuffman
+{
+	u16 codes[ 288 ];						// bit reversed, ready to be written out
+	u8 lengths[ 288 ];
+};
+
+// Scratch for compressing a slice, one per thread
+struct Deflater
+{
+	u32 head[ 1 << DEFLATE_MAX_HASH_BITS ];	// newest position + 1 for each hash, 0 if none
+	u32 prev[ DEFLATE_WINDOW_SIZE ];		// older position + 1 with the same hash
+
+	u16 symbolLength[ DEFLATE_BLOCK_SYMBOLS ];	// literal byte, or match length when symbolDist != 0
+	u16 symbolDist[ DEFLATE_BLOCK_SYMBOLS ];
+	u32 symbolCount;
+
+	u32 litLenFreq[ DEFLATE_LIT_LEN_CODES ];
+	u32 distFreq[ DEFLATE_DIST_CODES ];
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+[[nodiscard]] static inline u32 deflate_count_trailing_zeros( u64 value )
+{
+	#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward64( &index, value );
+		return static_cast<u32>( index );
+	#else
+		return static_cast<u32>( __builtin_ctzll( value ) );
+	#endif
+}
+
+[[nodiscard]] static inline u32 deflate_highest_bit( u32 value )
+{
+	#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanReverse( &index, value );
+		return static_cast<u32>( index );
+	#else
+		return 31 - static_cast<u32>( __builtin_clz( value ) );
+	#endif
+}
+
+// Length 3..258 to its code 0..28, 257 is added when writing
+[[nodiscard]] static inline u32 deflate_length_code( u32 length )
+{
+	u32 l = length - DEFLATE_MIN_MATCH;
+
+	if ( l < 8 )
+		return l;
+
+	if ( length == DEFLATE_MAX_MATCH )
+		return 28;
+
+	u32 bit = deflate_highest_bit( l );
+	return 4 * ( bit - 1 ) + ( ( l >> ( bit - 2 ) ) & 3 );
+}
+
+// Distance 1..32768 to its code 0..29
+[[nodiscard]] static inline u32 deflate_dist_code( u32 dist )
+{
+	u32 d = dist - 1;
+
+	if ( d < 4 )
+		return d;
+
+	u32 bit = deflate_highest_bit( d );
+	return 2 * bit + ( ( d >> ( bit - 1 ) ) & 1 );
+}
+
+// Worst case output for size bytes, every block falling back to stored plus the closing flush
+[[nodiscard]] static u64 deflate_bound( u64 size )
+{
+	return size + ( size / DEFLATE_BLOCK_SYMBOLS + 2 ) * 6 + 16;
+}
+
+// BIT WRITER ////////////////////////////////////////////////////////////////////////////////////////////////////////
+static inline void deflate_put_bits( DeflateBits *bits, u32 value, u32 count )
+{
+	bits->buffer |= static_cast<u64>( value ) << bits->count;
+	bits->count += count;
+
+	if ( bits->count >= 32 )
+	{
+		assert( bits->pos + 4 <= bits->capacity );
+
+		u8 *out = bits->out + bits->pos;
+		out[ 0 ] = static_cast<u8>( bits->buffer );
+		out[ 1 ] = static_cast<u8>( bits->buffer >> 8 );
+		out[ 2 ] = static_cast<u8>( bits->buffer >> 16 );
+		out[ 3 ] = static_cast<u8>( bits->buffer >> 24 );
+
+		bits->pos += 4;
+		bits->buffer >>= 32;
+		bits->count -= 32;
+	}
+}
+
+// Pad to a byte boundary and write out everything pending
+static void deflate_align_bits( DeflateBits *bits )
+{
+	while ( bits->count > 0 )
+	{
+		assert( bits->pos < bits->capacity );
+
+		bits->out[ bits->pos++ ] = static_cast<u8>( bits->buffer );
+		bits->buffer >>= 8;
+		bits->count = bits->count > 8 ? bits->count - 8 : 0;
+	}
+
+	bits->buffer = 0;
+}
+
+// HUFFMAN CODES /////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// In place minimum redundancy code lengths (Moffat & Katajainen). Weights must be sorted
+// ascending and are replaced by the code length of each.
+static void deflate_minimum_redundancy( u32 *a, i32 n )
+{
+	if ( n == 1 )
+	{
+		a[ 0 ] = 1;
+		return;
+	}
+
+	a[ 0 ] += a[ 1 ];
+
+	i32 root = 0;
+	i32 leaf = 2;
+
+	for ( i32 next = 1; next < n - 1; ++next )
+	{
+		if ( leaf >= n || a[ root ] < a[ leaf ] )
+		{
+			a[ next ] = a[ root ];
+			a[ root++ ] = next;
+		}
+		else
+			a[ next ] = a[ leaf++ ];
+
+		if ( leaf >= n || ( root < next && a[ root ] < a[ leaf ] ) )
+		{
+			a[ next ] += a[ root ];
+			a[ root++ ] = next;
+		}
+		else
+			a[ next ] += a[ leaf++ ];
+	}
+
+	a[ n - 2 ] = 0;
+
+	for ( i32 next = n - 3; next >= 0; --next )
+		a[ next ] = a[ a[ next ] ] + 1;
+
+	i32 available = 1;
+	i32 used = 0;
+	u32 depth = 0;
+	root = n - 2;
+	i32 next = n - 1;
+
+	while ( available > 0 )
+	{
+		while ( root >= 0 && a[ root ] == depth )
+		{
+			used += 1;
+			root -= 1;
+		}
+
+		while ( available > used )
+		{
+			a[ next-- ] = depth;
+			available -= 1;
+		}
+
+		available = 2 * used;
+		depth += 1;
+		used = 0;
+	}
+}
+
+// Length limited huffman code lengths for count symbols
+static void deflate_build_lengths( const u32 *freq, u32 count, u32 maxLength, u8 *lengths )
+{
+	u16 symbols[ 288 ];
+	u32 weights[ 288 ];
+	i32 n = 0;
+
+	memset( lengths, 0, count );
+
+	// Insertion sort the used symbols by frequency, the alphabets are tiny
+	for ( u32 s = 0; s < count; ++s )
+	{
+		if ( freq[ s ] == 0 )
+			continue;
+
+		i32 i = n++;
+
+		for ( ; i > 0 && weights[ i - 1 ] > freq[ s ]; --i )
+		{
+			weights[ i ] = weights[ i - 1 ];
+			symbols[ i ] = symbols[ i - 1 ];
+		}
+
+		weights[ i ] = freq[ s ];
+		symbols[ i ] = static_cast<u16>( s );
+	}
+
+	// Some decoders reject a code with a single symbol, give it a partner
+	if ( n < 2 )
+	{
+		u16 used = n == 1 ? symbols[ 0 ] : 0;
+		lengths[ used ] = 1;
+		lengths[ used == 0 ? 1 : 0 ] = 1;
+		return;
+	}
+
+	deflate_minimum_redundancy( weights, n );
+
+	// Push anything too long up to the limit then split shorter codes until the code is complete again
+	u32 lengthCounts[ 32 ] = {};
+
+	for ( i32 i = 0; i < n; ++i )
+		lengthCounts[ weights[ i ] < maxLength ? weights[ i ] : maxLength ] += 1;
+
+	u32 total = 0;
+
+	for ( u32 l = maxLength; l > 0; --l )
+		total += lengthCounts[ l ] << ( maxLength - l );
+
+	while ( total != ( 1u << maxLength ) )
+	{
+		lengthCounts[ maxLength ] -= 1;
+
+		for ( u32 l = maxLength - 1; l > 0; --l )
+		{
+			if ( lengthCounts[ l ] )
+			{
+				lengthCounts[ l ] -= 1;
+				lengthCounts[ l + 1 ] += 2;
+				break;
+			}
+		}
+
+		total -= 1;
+	}
+
+	// The rarest symbols get the longest codes
+	i32 i = 0;
+
+	for ( u32 l = maxLength; l > 0; --l )
+		for ( u32 c = lengthCounts[ l ]; c > 0; --c )
+			lengths[ symbols[ i++ ] ] = static_cast<u8>( l );
+}
+
+static void deflate_build_codes( DeflateHuffman *huffman, u32 count )
+{
+	u32 lengthCounts[ 16 ] = {};
+
+	for ( u32 s = 0; s < count; ++s )
+		lengthCounts[ huffman->lengths[ s ] ] += 1;
+
+	lengthCounts[ 0 ] = 0;
+
+	u32 nextCode[ 16 ];
+	u32 code = 0;
+
+	for ( u32 l = 1; l < 16; ++l )
+	{
+		code = ( code + lengthCounts[ l - 1 ] ) << 1;
+		nextCode[ l ] = code;
+	}
+
+	for ( u32 s = 0; s < count; ++s )
+	{
+		u32 length = huffman->lengths[ s ];
+		huffman->codes[ s ] = length ? static_cast<u16>( inflate_reverse_bits( nextCode[ length ]++, length ) ) : 0;
+	}
+}
+
+static void deflate_fixed_huffman( DeflateHuffman *litLen, DeflateHuffman *dist )
+{
+	for ( u32 s = 0; s < 288; ++s )
+		litLen->lengths[ s ] = s < 144 ? 8 : ( s < 256 ? 9 : ( s < 280 ? 7 : 8 ) );
+
+	for ( u32 s = 0; s < DEFLATE_DIST_CODES; ++s )
+		dist->lengths[ s ] = 5;
+
+	deflate_build_codes( litLen, 288 );
+	deflate_build_codes( dist, DEFLATE_DIST_CODES );
+}
+
+// Bits taken by the symbols of a block, extra bits included
+[[nodiscard]] static u64 deflate_data_bits( const Deflater *deflater, const u8 *litLenLengths, const u8 *distLengths )
+{
+	u64 bits = 0;
+
+	for ( u32 s = 0; s < DEFLATE_LIT_LEN_CODES; ++s )
+		bits += static_cast<u64>( deflater->litLenFreq[ s ] ) * ( litLenLengths[ s ] + ( s >= 257 ? inflateLengthExtra[ s - 257 ] : 0 ) );
+
+	for ( u32 s = 0; s < DEFLATE_DIST_CODES; ++s )
+		bits += static_cast<u64>( deflater->distFreq[ s ] ) * ( distLengths[ s ] + inflateDistExtra[ s ] );
+
+	return bits;
+}
+
+// BLOCKS ////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct DeflateCodeLengths
+{
+	u8 symbols[ DEFLATE_LIT_LEN_CODES + DEFLATE_DIST_CODES ];		// run length coded code lengths
+	u8 extra[ DEFLATE_LIT_LEN_CODES + DEFLATE_DIST_CODES ];
+	u32 count;
+	u32 freq[ DEFLATE_CODE_LENGTH_CODES ];
+	DeflateHuffman huffman;
+	u32 litLenCount;
+	u32 distCount;
+	u32 orderCount;
+	u64 headerBits;
+};
+
+static void deflate_push_code_length( DeflateCodeLengths *header, u32 symbol, u32 extra )
+{
+	header->symbols[ header->count ] = static_cast<u8>( symbol );
+	header->extra[ header->count ] = static_cast<u8>( extra );
+	header->count += 1;
+	header->freq[ symbol ] += 1;
+}
+
+// Run length code the lengths of both alphabets and size up the dynamic block header
+static void deflate_build_header( DeflateCodeLengths *header, const DeflateHuffman *litLen, const DeflateHuffman *dist )
+{
+	header->litLenCount = DEFLATE_LIT_LEN_CODES;
+	while ( header->litLenCount > 257 && litLen->lengths[ header->litLenCount - 1 ] == 0 )
+		header->litLenCount -= 1;
+
+	header->distCount = DEFLATE_DIST_CODES;
+	while ( header->distCount > 1 && dist->lengths[ header->distCount - 1 ] == 0 )
+		header->distCount -= 1;
+
+	u8 lengths[ DEFLATE_LIT_LEN_CODES + DEFLATE_DIST_CODES ];
+	u32 total = header->litLenCount + header->distCount;
+	memcpy( lengths, litLen->lengths, header->litLenCount );
+	memcpy( lengths + header->litLenCount, dist->lengths, header->distCount );
+
+	header->count = 0;
+	memset( header->freq, 0, sizeof( header->freq ) );
+
+	for ( u32 i = 0; i < total; )
+	{
+		u32 length = lengths[ i ];
+		u32 run = 1;
+
+		while ( i + run < total && lengths[ i + run ] == length )
+			run += 1;
+
+		i += run;
+
+		if ( length == 0 )
+		{
+			while ( run >= 11 )
+			{
+				u32 n = run < 138 ? run : 138;
+				deflate_push_code_length( header, 18, n - 11 );
+				run -= n;
+			}
+
+			if ( run >= 3 )
+			{
+				deflate_push_code_length( header, 17, run - 3 );
+				run = 0;
+			}
+		}
+		else
+		{
+			deflate_push_code_length( header, length, 0 );
+			run -= 1;
+
+			while ( run >= 3 )
+			{
+				u32 n = run < 6 ? run : 6;
+				deflate_push_code_length( header, 16, n - 3 );
+				run -= n;
+			}
+		}
+
+		for ( ; run > 0; --run )
+			deflate_push_code_length( header, length, 0 );
+	}
+
+	deflate_build_lengths( header->freq, DEFLATE_CODE_LENGTH_CODES, 7, header->huffman.lengths );
+	deflate_build_codes( &header->huffman, DEFLATE_CODE_LENGTH_CODES );
+
+	header->orderCount = DEFLATE_CODE_LENGTH_CODES;
+	while ( header->orderCount > 4 && header->huffman.lengths[ inflateCodeLengthOrder[ header->orderCount - 1 ] ] == 0 )
+		header->orderCount -= 1;
+
+	header->headerBits = 5 + 5 + 4 + 3 * header->orderCount;
+
+	for ( u32 s = 0; s < DEFLATE_CODE_LENGTH_CODES; ++s )
+		header->headerBits += header->freq[ s ] * ( header->huffman.lengths[ s ] + ( s == 16 ? 2 : ( s == 17 ? 3 : ( s == 18 ? 7 : 0 ) ) ) );
+}
+
+static void deflate_write_symbols( DeflateBits *bits, const Deflater *deflater, const DeflateHuffman *litLen, const DeflateHuffman *dist )
+{
+	for ( u32 i = 0; i < deflater->symbolCount; ++i )
+	{
+		u32 length = deflater->symbolLength[ i ];
+		u32 distance = deflater->symbolDist[ i ];
+
+		if ( distance == 0 )
+		{
+			deflate_put_bits( bits, litLen->codes[ length ], litLen->lengths[ length ] );
+			continue;
+		}
+
+		u32 lengthCode = deflate_length_code( length );
+		deflate_put_bits( bits, litLen->codes[ 257 + lengthCode ], litLen->lengths[ 257 + lengthCode ] );
+		deflate_put_bits( bits, length - inflateLengthBase[ lengthCode ], inflateLengthExtra[ lengthCode ] );
+
+		u32 distCode = deflate_dist_code( distance );
+		deflate_put_bits( bits, dist->codes[ distCode ], dist->lengths[ distCode ] );
+		deflate_put_bits( bits, distance - inflateDistBase[ distCode ], inflateDistExtra[ distCode ] );
+	}
+
+	deflate_put_bits( bits, litLen->codes[ 256 ], litLen->lengths[ 256 ] );
+}
+
+static void deflate_write_stored( DeflateBits *bits, const u8 *data, u64 size, bool final )
+{
+	deflate_put_bits( bits, final ? 1 : 0, 3 );
+	deflate_align_bits( bits );
+
+	assert( size <= 65535 && bits->pos + 4 + size <= bits->capacity );
+
+	u8 *out = bits->out + bits->pos;
+	out[ 0 ] = static_cast<u8>( size );
+	out[ 1 ] = static_cast<u8>( size >> 8 );
+	out[ 2 ] = static_cast<u8>( ~size );
+	out[ 3 ] = static_cast<u8>( ~size >> 8 );
+	if ( size > 0 )
+		memcpy( out + 4, data, size );
+
+	bits->pos += 4 + size;
+}
+
+// Write the pending symbols as whichever of a stored, fixed or dynamic block is smallest.
+// Data holds the bytes the symbols cover for the stored case.
+static void deflate_flush_block( Deflater *deflater, DeflateBits *bits, const u8 *data, u64 size, bool final )
+{
+	deflater->litLenFreq[ 256 ] = 1;
+
+	DeflateHuffman litLen;
+	DeflateHuffman dist;
+	deflate_build_lengths( deflater->litLenFreq, DEFLATE_LIT_LEN_CODES, 15, litLen.lengths );
+	deflate_build_lengths( deflater->distFreq, DEFLATE_DIST_CODES, 15, dist.lengths );
+	deflate_build_codes( &litLen, DEFLATE_LIT_LEN_CODES );
+	deflate_build_codes( &dist, DEFLATE_DIST_CODES );
+
+	DeflateCodeLengths header;
+	deflate_build_header( &header, &litLen, &dist );
+
+	DeflateHuffman fixedLitLen;
+	DeflateHuffman fixedDist;
+	deflate_fixed_huffman( &fixedLitLen, &fixedDist );
+
+	u64 dynamicBits = header.headerBits + deflate_data_bits( deflater, litLen.lengths, dist.lengths );
+	u64 fixedBits = deflate_data_bits( deflater, fixedLitLen.lengths, fixedDist.lengths );
+	u64 storedBits = 7 + 32 + size * 8;
+
+	// Block header is the final flag then the 2 bit block type
+	u32 finalBit = final ? 1 : 0;
+
+	if ( storedBits <= dynamicBits && storedBits <= fixedBits )
+	{
+		deflate_write_stored( bits, data, size, final );
+	}
+	else if ( fixedBits <= dynamicBits )
+	{
+		deflate_put_bits( bits, finalBit | ( 1 << 1 ), 3 );
+		deflate_write_symbols( bits, deflater, &fixedLitLen, &fixedDist );
+	}
+	else
+	{
+		deflate_put_bits( bits, finalBit | ( 2 << 1 ), 3 );
+		deflate_put_bits( bits, header.litLenCount - 257, 5 );
+		deflate_put_bits( bits, header.distCount - 1, 5 );
+		deflate_put_bits( bits, header.orderCount - 4, 4 );
+
+		for ( u32 i = 0; i < header.orderCount; ++i )
+			deflate_put_bits( bits, header.huffman.lengths[ inflateCodeLengthOrder[ i ] ], 3 );
+
+		for ( u32 i = 0; i < header.count; ++i )
+		{
+			u32 symbol = header.symbols[ i ];
+			deflate_put_bits( bits, header.huffman.codes[ symbol ], header.huffman.lengths[ symbol ] );
+
+			if ( symbol >= 16 )
+				deflate_put_bits( bits, header.extra[ i ], symbol == 16 ? 2 : ( symbol == 17 ? 3 : 7 ) );
+		}
+
+		deflate_write_symbols( bits, deflater, &litLen, &dist );
+	}
+
+	deflater->symbolCount = 0;
+	memset( deflater->litLenFreq, 0, sizeof( deflater->litLenFreq ) );
+	memset( deflater->distFreq, 0, sizeof( deflater->distFreq ) );
+}
+
+// MATCHING //////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+[[nodiscard]] static inline u32 deflate_hash( const u8 *p, u32 hashBits )
+{
+	u32 value = p[ 0 ] | ( static_cast<u32>( p[ 1 ] ) << 8 ) | ( static_cast<u32>( p[ 2 ] ) << 16 );
+	return ( value * 0x9E3779B1u ) >> ( 32 - hashBits );
+}
+
+// Positions are relative to the start of the dictionary, the caller makes sure 3 bytes are readable
+static inline void deflate_insert( Deflater *deflater, const u8 *base, u32 pos, u32 hashBits )
+{
+	u32 hash = deflate_hash( base + pos, hashBits );
+	deflater->prev[ pos & DEFLATE_WINDOW_MASK ] = deflater->head[ hash ];
+	deflater->head[ hash ] = pos + 1;
+}
+
+[[nodiscard]] static inline u32 deflate_match_length( const u8 *a, const u8 *b, u32 maxLength )
+{
+	u32 length = 0;
+
+	while ( length + 8 <= maxLength )
+	{
+		u64 x, y;
+		memcpy( &x, a + length, sizeof( x ) );
+		memcpy( &y, b + length, sizeof( y ) );
+
+		if ( x != y )
+			return length + deflate_count_trailing_zeros( x ^ y ) / 8;
+
+		length += 8;
+	}
+
+	while ( length < maxLength && a[ length ] == b[ length ] )
+		length += 1;
+
+	return length;
+}
+
+[[nodiscard]] static inline u16 deflate_load_u16( const u8 *p )
+{
+	u16 value;
+	memcpy( &value, p, sizeof( value ) );
+	return value;
+}
+
+// Longest earlier match for pos inside the window that beats prevLength, returns the length
+// and fills in the distance
+[[nodiscard]] static u32 deflate_find_match( const Deflater *deflater, const DeflateLevel &level, const u8 *base, u32 pos, u32 end, u32 prevLength, u32 *dist )
+{
+	u32 maxLength = end - pos < DEFLATE_MAX_MATCH ? end - pos : DEFLATE_MAX_MATCH;
+	u32 bestLength = prevLength > DEFLATE_MIN_MATCH - 1 ? prevLength : DEFLATE_MIN_MATCH - 1;
+
+	if ( maxLength < DEFLATE_MIN_MATCH || bestLength >= maxLength )
+		return 0;
+
+	const u8 *current = base + pos;
+	u32 chain = prevLength >= level.goodLength ? level.maxChain / 4 : level.maxChain;
+	u32 candidate = deflater->head[ deflate_hash( current, level.hashBits ) ];
+
+	// A candidate can only beat the best so far if the bytes around the end of it match too
+	u16 currentStart = deflate_load_u16( current );
+	u16 currentEnd = deflate_load_u16( current + bestLength - 1 );
+
+	for ( ; candidate != 0 && chain > 0; --chain )
+	{
+		u32 candidatePos = candidate - 1;
+		u32 distance = pos - candidatePos;
+
+		if ( distance > DEFLATE_WINDOW_SIZE )
+			break;
+
+		const u8 *match = base + candidatePos;
+
+		if ( deflate_load_u16( match + bestLength - 1 ) == currentEnd && deflate_load_u16( match ) == currentStart )
+		{
+			u32 length = deflate_match_length( match, current, maxLength );
+
+			if ( length > bestLength )
+			{
+				bestLength = length;
+				*dist = distance;
+
+				if ( length >= level.niceLength || length == maxLength )
+					break;
+
+				currentEnd = deflate_load_u16( current + bestLength - 1 );
+			}
+		}
+
+		candidate = deflater->prev[ candidatePos & DEFLATE_WINDOW_MASK ];
+	}
+
+	// A far away 3 byte match costs more bits than the literals it replaces
+	if ( bestLength == DEFLATE_MIN_MATCH && *dist > DEFLATE_TOO_FAR )
+		return 0;
+
+	return bestLength > prevLength && bestLength >= DEFLATE_MIN_MATCH ? bestLength : 0;
+}
+
+// Add a symbol, flushing the pending block first if it is full. The block covers data from blockStart.
+static inline void deflate_push_symbol( Deflater *deflater, DeflateBits *bits, const u8 *base, u32 *blockStart, u32 pos, u32 length, u32 dist )
+{
+	if ( deflater->symbolCount == DEFLATE_BLOCK_SYMBOLS || pos - *blockStart > DEFLATE_BLOCK_BYTES )
+	{
+		deflate_flush_block( deflater, bits, base + *blockStart, pos - *blockStart, false );
+		*blockStart = pos;
+	}
+
+	deflater->symbolLength[ deflater->symbolCount ] = static_cast<u16>( length );
+	deflater->symbolDist[ deflater->symbolCount ] = static_cast<u16>( dist );
+	deflater->symbolCount += 1;
+
+	if ( dist == 0 )
+	{
+		deflater->litLenFreq[ length ] += 1;
+	}
+	else
+	{
+		deflater->litLenFreq[ 257 + deflate_length_code( length ) ] += 1;
+		deflater->distFreq[ deflate_dist_code( dist ) ] += 1;
+	}
+}
+
+// Each strategy turns the bytes from start to end into symbols, the block in progress begins at blockStart
+static void deflate_slice_huffman( Deflater *deflater, DeflateBits *bits, const u8 *base, u32 start, u32 end, u32 *blockStart )
+{
+	for ( u32 pos = start; pos < end; ++pos )
+		deflate_push_symbol( deflater, bits, base, blockStart, pos, base[ pos ], 0 );
+}
+
+static void deflate_slice_rle( Deflater *deflater, DeflateBits *bits, const u8 *base, u32 start, u32 end, u32 *blockStart )
+{
+	u32 pos = start;
+
+	while ( pos < end )
+	{
+		u32 maxLength = end - pos < DEFLATE_MAX_MATCH ? end - pos : DEFLATE_MAX_MATCH;
+		u32 length = pos > 0 ? deflate_match_length( base + pos - 1, base + pos, maxLength ) : 0;
+
+		if ( length >= DEFLATE_MIN_MATCH )
+		{
+			deflate_push_symbol( deflater, bits, base, blockStart, pos, length, 1 );
+			pos += length;
+		}
+		else
+		{
+			deflate_push_symbol( deflater, bits, base, blockStart, pos, base[ pos ], 0 );
+			pos += 1;
+		}
+	}
+}
+
+static void deflate_slice_greedy( Deflater *deflater, const DeflateLevel &level, DeflateBits *bits, const u8 *base, u32 start, u32 end, u32 *blockStart )
+{
+	u32 pos = start;
+
+	while ( pos < end )
+	{
+		u32 dist = 0;
+		u32 length = deflate_find_match( deflater, level, base, pos, end, 0, &dist );
+
+		if ( pos + 2 < end )
+			deflate_insert( deflater, base, pos, level.hashBits );
+
+		if ( length == 0 )
+		{
+			deflate_push_symbol( deflater, bits, base, blockStart, pos, base[ pos ], 0 );
+			pos += 1;
+			continue;
+		}
+
+		deflate_push_symbol( deflater, bits, base, blockStart, pos, length, dist );
+
+		// Hashing every position of a long match costs more than it finds
+		if ( length <= level.lazyLength )
+		{
+			for ( u32 p = pos + 1; p < pos + length; ++p )
+				if ( p + 2 < end )
+					deflate_insert( deflater, base, p, level.hashBits );
+		}
+
+		pos += length;
+	}
+}
+
+// A match is only taken once the next position can't do better
+static void deflate_slice_lazy( Deflater *deflater, const DeflateLevel &level, DeflateBits *bits, const u8 *base, u32 start, u32 end, u32 *blockStart )
+{
+	u32 pos = start;
+	u32 prevLength = 0;
+	u32 prevDist = 0;
+	bool havePrev = false;
+
+	while ( pos < end )
+	{
+		u32 length = 0;
+		u32 dist = 0;
+
+		if ( prevLength < level.lazyLength )
+			length = deflate_find_match( deflater, level, base, pos, end, prevLength, &dist );
+
+		if ( pos + 2 < end )
+			deflate_insert( deflater, base, pos, level.hashBits );
+
+		if ( havePrev && prevLength >= DEFLATE_MIN_MATCH && length <= prevLength )
+		{
+			deflate_push_symbol( deflater, bits, base, blockStart, pos - 1, prevLength, prevDist );
+
+			u32 matchEnd = pos - 1 + prevLength;
+
+			for ( u32 p = pos + 1; p < matchEnd; ++p )
+				if ( p + 2 < end )
+					deflate_insert( deflater, base, p, level.hashBits );
+
+			pos = matchEnd;
+			prevLength = 0;
+			havePrev = false;
+			continue;
+		}
+
+		if ( havePrev )
+			deflate_push_symbol( deflater, bits, base, blockStart, pos - 1, base[ pos - 1 ], 0 );
+
+		prevLength = length;
+		prevDist = dist;
+		havePrev = true;
+		pos += 1;
+	}
+
+	if ( havePrev )
+	{
+		if ( prevLength >= DEFLATE_MIN_MATCH )
+			deflate_push_symbol( deflater, bits, base, blockStart, end - 1, prevLength, prevDist );
+		else
+			deflate_push_symbol( deflater, bits, base, blockStart, end - 1, base[ end - 1 ], 0 );
+	}
+}
+
+// Compress size bytes at data, the dictSize bytes in front of data (up to 32KB) can be
+// referenced. The slice ends byte aligned on a sync flush, or on the final block when last
+// is set. Returns the number of bytes written to out, which needs deflate_bound( size ).
+[[nodiscard]] static u64 deflate_compress( Deflater *deflater, const DeflateLevel &level, const u8 *data, u64 dictSize, u64 size, bool last, u8 *out, u64 capacity )
+{
+	assert( dictSize <= DEFLATE_WINDOW_SIZE && size > 0 && size <= 0x7FFFFFFF );
+	assert( capacity >= deflate_bound( size ) );
+	assert( level.hashBits <= DEFLATE_MAX_HASH_BITS );
+
+	DeflateBits bits = { .out = out, .pos = 0, .capacity = capacity, .buffer = 0, .count = 0 };
+
+	const u8 *base = data - dictSize;
+	u32 start = static_cast<u32>( dictSize );
+	u32 end = static_cast<u32>( dictSize + size );
+
+	if ( level.strategy == DEFLATE_STRATEGY_STORE )
+	{
+		for ( u32 pos = start; pos < end; pos += 65535 )
+		{
+			u32 count = end - pos < 65535 ? end - pos : 65535;
+			deflate_write_stored( &bits, base + pos, count, last && pos + count == end );
+		}
+	}
+	else
+	{
+		memset( deflater->litLenFreq, 0, sizeof( deflater->litLenFreq ) );
+		memset( deflater->distFreq, 0, sizeof( deflater->distFreq ) );
+		deflater->symbolCount = 0;
+
+		u32 blockStart = start;
+
+		if ( level.strategy == DEFLATE_STRATEGY_HUFFMAN )
+		{
+			deflate_slice_huffman( deflater, &bits, base, start, end, &blockStart );
+		}
+		else if ( level.strategy == DEFLATE_STRATEGY_RLE )
+		{
+			deflate_slice_rle( deflater, &bits, base, start, end, &blockStart );
+		}
+		else
+		{
+			memset( deflater->head, 0, sizeof( u32 ) << level.hashBits );
+
+			for ( u32 pos = 0; pos < start && pos + 2 < end; ++pos )
+				deflate_insert( deflater, base, pos, level.hashBits );
+
+			if ( level.strategy == DEFLATE_STRATEGY_GREEDY )
+				deflate_slice_greedy( deflater, level, &bits, base, start, end, &blockStart );
+			else
+				deflate_slice_lazy( deflater, level, &bits, base, start, end, &blockStart );
+		}
+
+		deflate_flush_block( deflater, &bits, base + blockStart, end - blockStart, last );
+	}
+
+	if ( !last )
+	{
+		// Sync flush, an empty stored block leaves the stream byte aligned
+		deflate_write_stored( &bits, nullptr, 0, false );
+	}
+	else
+	{
+		deflate_align_bits( &bits );
+	}
+
+	return bits.pos;
+}
+
+// The 2 byte zlib stream header for a 32KB window
+static void deflate_zlib_header( const DeflateLevel &level, u8 header[ 2 ] )
+{
+	u32 cmf = 0x78;
+	u32 flg = static_cast<u32>( level.zlibLevel ) << 6;
+	flg += 31 - ( ( cmf << 8 ) | flg ) % 31;
+
+	header[ 0 ] = static_cast<u8>( cmf );
+	header[ 1 ] = static_cast<u8>( flg );
+}
+
+// ADLER32 ///////////////////////////////////////////////////////////////////////////////////////////////////////////
+#define ADLER32_BASE		65521
+#define ADLER32_NMAX		5552		// most bytes before the sums could overflow
+
+[[nodiscard]] static u32 adler32( u32 adler, const u8 *data, u64 size )
+{
+	u32 a = adler & 0xFFFF;
+	u32 b = adler >> 16;
+
+	while ( size > 0 )
+	{
+		u64 count = size < ADLER32_NMAX ? size : ADLER32_NMAX;
+		size -= count;
+
+		for ( ; count > 0; --count )
+		{
+			a += *data++;
+			b += a;
+		}
+
+		a %= ADLER32_BASE;
+		b %= ADLER32_BASE;
+	}
+
+	return ( b << 16 ) | a;
+}
+
+// Checksum of two buffers back to back from each one's own checksum and the second's size
+[[nodiscard]] static u32 adler32_combine( u32 adler1, u32 adler2, u64 size2 )
+{
+	u32 remainder = static_cast<u32>( size2 % ADLER32_BASE );
+	u32 a = adler1 & 0xFFFF;
+	u32 b = static_cast<u32>( ( static_cast<u64>( remainder ) * a ) % ADLER32_BASE );
+
+	a += ( adler2 & 0xFFFF ) + ADLER32_BASE - 1;
+	b += ( adler1 >> 16 ) + ( adler2 >> 16 ) + ADLER32_BASE - remainder;
+
+	if ( a >= ADLER32_BASE ) a -= ADLER32_BASE;
+	if ( a >= ADLER32_BASE ) a -= ADLER32_BASE;
+	if ( b >= ( ADLER32_BASE << 1 ) ) b -= ( ADLER32_BASE << 1 );
+	if ( b >= ADLER32_BASE ) b -= ADLER32_BASE;
+
+	return ( b << 16 ) | a;
+}
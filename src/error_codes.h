@@ -11,6 +11,21 @@ enum RESULT_CODE : u32
 	RESULT_CODE_INPUT_FILE_SIZES_DONT_MATCH,
 	RESULT_CODE_FAILED_TO_ALLOCATE_MEMORY_FOR_OUTPUT_IMAGE,
 	RESULT_CODE_FAILED_TO_CREATE_OUTPUT_FILE,
+	RESULT_CODE_FAILED_TO_OPEN_BATCH_FILE,
+	RESULT_CODE_INVALID_BATCH_JOB,
+	RESULT_CODE_BATCH_JOB_FAILED,
+	RESULT_CODE_FAILED_TO_SCAN_DIRECTORY,
+	RESULT_CODE_FAILED_TO_DECODE_INPUT_FILE,
+	RESULT_CODE_INVALID_COMPRESSION_LEVEL,
+	RESULT_CODE_INVALID_PNG_FILTER,
+	RESULT_CODE_INVALID_LAYOUT,
+	RESULT_CODE_LAYOUT_DROPS_INPUT,
+	RESULT_CODE_INVALID_MEMORY_SIZE,
+	RESULT_CODE_MEMORY_BUDGET_TOO_SMALL,
+	RESULT_CODE_FAILED_TO_START_SERVER,
+	RESULT_CODE_INVALID_SERVE_REQUEST,
+	RESULT_CODE_INVALID_BENCH_OPTION,
+	RESULT_CODE_INVALID_TESTS_OPTION,
 };
 
 static const char *error_code_string( RESULT_CODE code )
@@ -25,6 +40,21 @@ static const char *error_code_string( RESULT_CODE code )
 	case RESULT_CODE_INPUT_FILE_SIZES_DONT_MATCH: return "RESULT_CODE_INPUT_FILE_SIZES_DONT_MATCH";
 	case RESULT_CODE_FAILED_TO_ALLOCATE_MEMORY_FOR_OUTPUT_IMAGE: return "RESULT_CODE_FAILED_TO_ALLOCATE_MEMORY_FOR_OUTPUT_IMAGE";
 	case RESULT_CODE_FAILED_TO_CREATE_OUTPUT_FILE: return "RESULT_CODE_FAILED_TO_CREATE_OUTPUT_FILE";
+	case RESULT_CODE_FAILED_TO_OPEN_BATCH_FILE: return "RESULT_CODE_FAILED_TO_OPEN_BATCH_FILE";
+	case RESULT_CODE_INVALID_BATCH_JOB: return "RESULT_CODE_INVALID_BATCH_JOB";
+	case RESULT_CODE_BATCH_JOB_FAILED: return "RESULT_CODE_BATCH_JOB_FAILED";
+	case RESULT_CODE_FAILED_TO_SCAN_DIRECTORY: return "RESULT_CODE_FAILED_TO_SCAN_DIRECTORY";
+	case RESULT_CODE_FAILED_TO_DECODE_INPUT_FILE: return "RESULT_CODE_FAILED_TO_DECODE_INPUT_FILE";
+	case RESULT_CODE_INVALID_COMPRESSION_LEVEL: return "RESULT_CODE_INVALID_COMPRESSION_LEVEL";
+	case RESULT_CODE_INVALID_PNG_FILTER: return "RESULT_CODE_INVALID_PNG_FILTER";
+	case RESULT_CODE_INVALID_LAYOUT: return "RESULT_CODE_INVALID_LAYOUT";
+	case RESULT_CODE_LAYOUT_DROPS_INPUT: return "RESULT_CODE_LAYOUT_DROPS_INPUT";
+	case RESULT_CODE_INVALID_MEMORY_SIZE: return "RESULT_CODE_INVALID_MEMORY_SIZE";
+	case RESULT_CODE_MEMORY_BUDGET_TOO_SMALL: return "RESULT_CODE_MEMORY_BUDGET_TOO_SMALL";
+	case RESULT_CODE_FAILED_TO_START_SERVER: return "RESULT_CODE_FAILED_TO_START_SERVER";
+	case RESULT_CODE_INVALID_SERVE_REQUEST: return "RESULT_CODE_INVALID_SERVE_REQUEST";
+	case RESULT_CODE_INVALID_BENCH_OPTION: return "RESULT_CODE_INVALID_BENCH_OPTION";
+	case RESULT_CODE_INVALID_TESTS_OPTION: return "RESULT_CODE_INVALID_TESTS_OPTION";
 	}
 
 	return "UNKNOWN ERROR CODE";
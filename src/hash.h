@@ -0,0 +1,183 @@
+#pragma once
+
+// 64 bit content hash (xxHash64). Fast enough to run over whole input files, it's
+// for spotting changed data and isn't meant to stand up to anyone forging collisions.
+
+#define HASH64_PRIME_1		0x9E3779B185EBCA87ull
+#define HASH64_PRIME_2		0xC2B2AE3D27D4EB4Full
+#define HASH64_PRIME_3		0x165667B19E3779F9ull
+#define HASH64_PRIME_4		0x85EBCA77C2B2AE63ull
+#define HASH64_PRIME_5		0x27D4EB2F165667C5ull
+
+[[nodiscard]] static inline u64 hash64_rotl( u64 x, u32 r )
+{
+	return ( x << r ) | ( x >> ( 64 - r ) );
+}
+
+[[nodiscard]] static inline u64 hash64_read_u64( const u8 *p )
+{
+	u64 value;
+	memcpy( &value, p, sizeof( value ) );
+	return value;
+}
+
+[[nodiscard]] static inline u32 hash64_read_u32( const u8 *p )
+{
+	u32 value;
+	memcpy( &value, p, sizeof( value ) );
+	return value;
+}
+
+[[nodiscard]] static inline u64 hash64_round( u64 acc, u64 input )
+{
+	acc += input * HASH64_PRIME_2;
+	acc = hash64_rotl( acc, 31 );
+	return acc * HASH64_PRIME_1;
+}
+
+[[nodiscard]] static inline u64 hash64_merge( u64 acc, u64 lane )
+{
+	acc ^= hash64_round( 0, lane );
+	return acc * HASH64_PRIME_1 + HASH64_PRIME_4;
+}
+
+// Streaming form of hash64 for input that arrives in pieces, e.g. a file read in chunks. Any split
+// of the same bytes gives the same hash as a single hash64 call over all of them.
+struct Hash64State
+{
+	u64 lanes[ 4 ];
+	u64 seed;
+	u64 size;								// total bytes so far
+	u8 buffer[ 32 ];						// partial stripe waiting for the next update
+	u32 buffered;
+};
+
+static void hash64_begin( Hash64State *state, u64 seed )
+{
+	state->lanes[ 0 ] = seed + HASH64_PRIME_1 + HASH64_PRIME_2;
+	state->lanes[ 1 ] = seed + HASH64_PRIME_2;
+	state->lanes[ 2 ] = seed;
+	state->lanes[ 3 ] = seed - HASH64_PRIME_1;
+	state->seed = seed;
+	state->size = 0;
+	state->buffered = 0;
+}
+
+static inline void hash64_stripe( u64 lanes[ 4 ], const u8 *p )
+{
+	lanes[ 0 ] = hash64_round( lanes[ 0 ], hash64_read_u64( p ) );
+	lanes[ 1 ] = hash64_round( lanes[ 1 ], hash64_read_u64( p + 8 ) );
+	lanes[ 2 ] = hash64_round( lanes[ 2 ], hash64_read_u64( p + 16 ) );
+	lanes[ 3 ] = hash64_round( lanes[ 3 ], hash64_read_u64( p + 24 ) );
+}
+
+// Reads little endian words, which every target here is
+static void hash64_update( Hash64State *state, const void *data, u64 size )
+{
+	const u8 *p = static_cast<const u8 *>( data );
+	const u8 *end = p + size;
+
+	state->size += size;
+
+	if ( state->buffered )
+	{
+		u64 fill = 32 - state->buffered < size ? 32 - state->buffered : size;
+		memcpy( state->buffer + state->buffered, p, fill );
+		state->buffered += static_cast<u32>( fill );
+		p += fill;
+
+		if ( state->buffered < 32 )
+			return;
+
+		hash64_stripe( state->lanes, state->buffer );
+		state->buffered = 0;
+	}
+
+	if ( end - p >= 32 )
+	{
+		// Four independent lanes keep the multiplies in flight
+		u64 v1 = state->lanes[ 0 ];
+		u64 v2 = state->lanes[ 1 ];
+		u64 v3 = state->lanes[ 2 ];
+		u64 v4 = state->lanes[ 3 ];
+
+		do
+		{
+			v1 = hash64_round( v1, hash64_read_u64( p ) );
+			v2 = hash64_round( v2, hash64_read_u64( p + 8 ) );
+			v3 = hash64_round( v3, hash64_read_u64( p + 16 ) );
+			v4 = hash64_round( v4, hash64_read_u64( p + 24 ) );
+			p += 32;
+		}
+		while ( end - p >= 32 );
+
+		state->lanes[ 0 ] = v1;
+		state->lanes[ 1 ] = v2;
+		state->lanes[ 2 ] = v3;
+		state->lanes[ 3 ] = v4;
+	}
+
+	memcpy( state->buffer, p, end - p );
+	state->buffered = static_cast<u32>( end - p );
+}
+
+[[nodiscard]] static u64 hash64_end( const Hash64State *state )
+{
+	const u64 *v = state->lanes;
+	u64 hash;
+
+	if ( state->size >= 32 )
+	{
+		hash = hash64_rotl( v[ 0 ], 1 ) + hash64_rotl( v[ 1 ], 7 ) + hash64_rotl( v[ 2 ], 12 ) + hash64_rotl( v[ 3 ], 18 );
+		hash = hash64_merge( hash, v[ 0 ] );
+		hash = hash64_merge( hash, v[ 1 ] );
+		hash = hash64_merge( hash, v[ 2 ] );
+		hash = hash64_merge( hash, v[ 3 ] );
+	}
+	else
+	{
+		hash = state->seed + HASH64_PRIME_5;
+	}
+
+	hash += state->size;
+
+	const u8 *p = state->buffer;
+	const u8 *end = p + state->buffered;
+
+	while ( end - p >= 8 )
+	{
+		hash ^= hash64_round( 0, hash64_read_u64( p ) );
+		hash = hash64_rotl( hash, 27 ) * HASH64_PRIME_1 + HASH64_PRIME_4;
+		p += 8;
+	}
+
+	if ( end - p >= 4 )
+	{
+		hash ^= static_cast<u64>( hash64_read_u32( p ) ) * HASH64_PRIME_1;
+		hash = hash64_rotl( hash, 23 ) * HASH64_PRIME_2 + HASH64_PRIME_3;
+		p += 4;
+	}
+
+	while ( p < end )
+	{
+		hash ^= *p * HASH64_PRIME_5;
+		hash = hash64_rotl( hash, 11 ) * HASH64_PRIME_1;
+		p += 1;
+	}
+
+	hash ^= hash >> 33;
+	hash *= HASH64_PRIME_2;
+	hash ^= hash >> 29;
+	hash *= HASH64_PRIME_3;
+	hash ^= hash >> 32;
+
+	return hash;
+}
+
+[[nodiscard]] static u64 hash64( const void *data, u64 size, u64 seed )
+{
+	Hash64State state;
+	hash64_begin( &state, seed );
+	hash64_update( &state, data, size );
+	return hash64_end( &state );
+}
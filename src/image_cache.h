@@ -0,0 +1,191 @@
+#pragma once
+
+// Decoded single channel planes shared between the jobs of one process. An input used by several
+// merges is decoded once, later jobs find it by path, file size, modification time and file id. Each plane
+// lives in an arena of its own so it can be dropped alone, the least recently used unreferenced
+// planes go first once the memory cap is reached. Thread safe, every call takes the lock.
+
+#define IMAGE_CACHE_MAX_ENTRIES		256
+
+// Enough to tell a file has been rewritten since it was decoded
+struct FileStamp
+{
+	u64 size;
+	i64 time;								// modification time, nanoseconds where the platform has them
+	u64 id;									// inode, 0 where there isn't one
+};
+
+[[nodiscard]] inline bool operator == ( const FileStamp &lhs, const FileStamp &rhs )
+{
+	return lhs.size == rhs.size && lhs.time == rhs.time && lhs.id == rhs.id;
+}
+
+struct ImageCacheEntry
+{
+	MemoryArena memory;
+	const char *path;						// owned, in memory. nullptr marks a free slot
+	FileStamp stamp;
+	u8 *plane;								// w * h bytes, the first channel of every pixel
+	u32 w;
+	u32 h;
+	u64 bytes;								// counted against the cap
+	u64 lastUsed;
+	u32 refs;
+	bool ready;								// false while the reserving job is still decoding
+};
+
+struct ImageCache
+{
+	std::mutex mutex;
+	u64 capacity = 0;
+	u64 used = 0;
+	u64 tick = 0;
+	u64 hits = 0;
+	u64 misses = 0;
+	ImageCacheEntry entries[ IMAGE_CACHE_MAX_ENTRIES ] = {};	// jobs hold pointers, so entries never move
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void image_cache_remove( ImageCache *cache, ImageCacheEntry *entry )
+{
+	cache->used -= entry->bytes;
+	entry->memory.free();
+	*entry = {};
+}
+
+// Drop unreferenced planes, oldest first, until bytes more fit and a slot is free.
+// Returns the free slot, or nullptr. The lock must be held.
+[[nodiscard]] static ImageCacheEntry *image_cache_make_room( ImageCache *cache, u64 bytes )
+{
+	while ( true )
+	{
+		ImageCacheEntry *free = nullptr;
+		ImageCacheEntry *oldest = nullptr;
+
+		for ( ImageCacheEntry &entry : cache->entries )
+		{
+			if ( !entry.path )
+				free = &entry;
+			else if ( entry.refs == 0 && ( !oldest || entry.lastUsed < oldest->lastUsed ) )
+				oldest = &entry;
+		}
+
+		if ( free && cache->used + bytes <= cache->capacity )
+			return free;
+
+		if ( !oldest )
+			return nullptr;
+
+		image_cache_remove( cache, oldest );
+	}
+}
+
+// A ready plane for the file, referenced until image_cache_release, or nullptr
+[[nodiscard]] static ImageCacheEntry *image_cache_find( ImageCache *cache, const char *path, const FileStamp &stamp )
+{
+	std::lock_guard<std::mutex> lock( cache->mutex );
+
+	for ( ImageCacheEntry &slot : cache->entries )
+	{
+		ImageCacheEntry *entry = &slot;
+
+		if ( entry->path && entry->ready && entry->stamp == stamp && strcmp( entry->path, path ) == 0 )
+		{
+			entry->refs += 1;
+			entry->lastUsed = ++cache->tick;
+			cache->hits += 1;
+
+			return entry;
+		}
+	}
+
+	cache->misses += 1;
+
+	return nullptr;
+}
+
+// Room for a w x h plane of the file, for the caller to decode into and then publish.
+// nullptr if it's bigger than the cap, another job is already decoding it, or every plane is in use.
+// Arena is a blank one from create_memory_arena for the plane to live in.
+[[nodiscard]] static ImageCacheEntry *image_cache_reserve( ImageCache *cache, MemoryArena arena, const char *path, const FileStamp &stamp, u32 w, u32 h )
+{
+	u64 pathLength = strlen( path );
+	u64 planeBytes = static_cast<u64>( w ) * h;
+	u64 bytes = pathLength + 1 + planeBytes + MEMORY_ALLOCATION_OVERHEAD * 2;
+
+	std::lock_guard<std::mutex> lock( cache->mutex );
+
+	for ( const ImageCacheEntry &entry : cache->entries )
+	{
+		if ( entry.path && !entry.ready && strcmp( entry.path, path ) == 0 )
+			return nullptr;
+	}
+
+	ImageCacheEntry *entry = bytes <= cache->capacity ? image_cache_make_room( cache, bytes ) : nullptr;
+
+	if ( !entry )
+		return nullptr;
+
+	entry->memory = arena;
+
+	if ( !entry->memory.init_virtual( 0, bytes, 0 ) )
+		return nullptr;
+
+	char *ownedPath = entry->memory.transient.allocate<char>( pathLength + 1 );
+	entry->plane = entry->memory.transient.allocate<u8>( planeBytes );
+
+	if ( !ownedPath || !entry->plane )
+	{
+		entry->memory.free();
+		*entry = {};
+		return nullptr;
+	}
+
+	memcpy( ownedPath, path, pathLength + 1 );
+	entry->path = ownedPath;
+	entry->stamp = stamp;
+	entry->w = w;
+	entry->h = h;
+	entry->bytes = bytes;
+	entry->lastUsed = ++cache->tick;
+	entry->refs = 1;
+	entry->ready = false;
+
+	cache->used += bytes;
+
+	return entry;
+}
+
+// Makes a reserved plane visible to other jobs. If decoding failed it's dropped, along with the caller's reference.
+static void image_cache_publish( ImageCache *cache, ImageCacheEntry *entry, bool decoded )
+{
+	std::lock_guard<std::mutex> lock( cache->mutex );
+
+	if ( decoded )
+	{
+		entry->ready = true;
+		return;
+	}
+
+	image_cache_remove( cache, entry );
+}
+
+static void image_cache_release( ImageCache *cache, ImageCacheEntry *entry )
+{
+	std::lock_guard<std::mutex> lock( cache->mutex );
+
+	assert( entry->refs > 0 );
+	entry->refs -= 1;
+}
+
+static void image_cache_free( ImageCache *cache )
+{
+	std::lock_guard<std::mutex> lock( cache->mutex );
+
+	for ( ImageCacheEntry &entry : cache->entries )
+	{
+		if ( entry.path )
+			image_cache_remove( cache, &entry );
+	}
+}
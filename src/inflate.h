@@ -0,0 +1,647 @@
+#pragma once
+
+// Streaming zlib decoder. Input is pulled on demand through a refill callback and output is
+// produced in contiguous runs inside a buffer that also keeps the last 32KB as history, so
+// the caller can ask for exactly one PNG scanline at a time.
+
+#define INFLATE_WINDOW_SIZE		32768
+#define INFLATE_FAST_BITS		10
+#define INFLATE_MAX_MATCH		258
+#define INFLATE_COPY_OVERRUN	8			// matches are copied in 8 byte blocks and may write this far past their end
+
+enum INFLATE_STATE : u32
+{
+	INFLATE_STATE_HEADER,
+	INFLATE_STATE_BLOCK,
+	INFLATE_STATE_STORED,
+	INFLATE_STATE_HUFFMAN,
+	INFLATE_STATE_DONE,
+	INFLATE_STATE_ERROR,
+};
+
+// What a decoded symbol means, so the decode loop never goes back to the length and distance tables
+enum INFLATE_SYMBOL : u32
+{
+	INFLATE_SYMBOL_LITERAL,					// a literal byte, or the symbol itself for code length codes
+	INFLATE_SYMBOL_BASE,					// a match length or distance, value plus the extra bits
+	INFLATE_SYMBOL_END,						// end of block
+	INFLATE_SYMBOL_INVALID,					// a symbol the format doesn't allow
+};
+
+enum INFLATE_TABLE : u32
+{
+	INFLATE_TABLE_CODE_LENGTHS,
+	INFLATE_TABLE_LIT_LEN,
+	INFLATE_TABLE_DIST,
+};
+
+// Table entries are ( value << 16 ) | ( kind << 12 ) | ( extra bits << 8 ) | code length
+#define INFLATE_ENTRY( value, kind, extra )	( ( static_cast<u32>( value ) << 16 ) | ( static_cast<u32>( kind ) << 12 ) | ( static_cast<u32>( extra ) << 8 ) )
+#define INFLATE_ENTRY_LENGTH( entry )		( ( entry ) & 0xFF )
+#define INFLATE_ENTRY_EXTRA( entry )		( ( ( entry ) >> 8 ) & 0xF )
+#define INFLATE_ENTRY_KIND( entry )			( ( ( entry ) >> 12 ) & 0xF )
+#define INFLATE_ENTRY_VALUE( entry )		( ( entry ) >> 16 )
+
+struct InflateHuffman
+{
+	u32 fast[ 1 << INFLATE_FAST_BITS ];		// entry of the code in the low bits, 0 if the code is longer
+	u32 maxCode[ 17 ];						// first code past each length, left aligned to 16 bits
+	u16 firstCode[ 16 ];
+	u16 firstSymbol[ 16 ];
+	u32 value[ 288 ];						// entries sorted by code, without the code length
+};
+
+struct Inflater
+{
+	// Returns the next span of compressed input, false when there is no more
+	bool ( *refill )( void *user, const u8 **in, const u8 **inEnd );
+	void *user;
+
+	const u8 *in;
+	const u8 *inEnd;
+	u64 bits;
+	u32 bitCount;
+	u32 overrun;							// zero bytes padded in after the input ran out
+
+	u8 *buffer;
+	u64 capacity;
+	u64 readPos;							// next byte handed to the caller
+	u64 writePos;							// next byte decoded
+
+	INFLATE_STATE state;
+	bool finalBlock;
+	u32 storedRemaining;
+
+	InflateHuffman litLen;
+	InflateHuffman dist;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static const u16 inflateLengthBase[ 29 ] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+static const u8 inflateLengthExtra[ 29 ] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const u16 inflateDistBase[ 30 ] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+static const u8 inflateDistExtra[ 30 ] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+static const u8 inflateCodeLengthOrder[ 19 ] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+[[nodiscard]] static inline u64 inflate_read_u64( const u8 *p )
+{
+	u64 value;
+	memcpy( &value, p, sizeof( value ) );
+	return value;
+}
+
+[[nodiscard]] static inline u32 inflate_reverse_bits( u32 code, u32 length )
+{
+	u32 result = 0;
+
+	for ( u32 i = 0; i < length; ++i )
+	{
+		result = ( result << 1 ) | ( code & 1 );
+		code >>= 1;
+	}
+
+	return result;
+}
+
+static void inflate_fill_bits( Inflater *inflater )
+{
+	while ( inflater->bitCount <= 56 )
+	{
+		if ( inflater->in == inflater->inEnd && !inflater->refill( inflater->user, &inflater->in, &inflater->inEnd ) )
+		{
+			// Out of input, pad with zeros and let the caller notice through overrun
+			inflater->overrun += 1;
+			inflater->bitCount += 8;
+			continue;
+		}
+
+		inflater->bits |= static_cast<u64>( *inflater->in++ ) << inflater->bitCount;
+		inflater->bitCount += 8;
+	}
+}
+
+[[nodiscard]] static inline u32 inflate_bits( Inflater *inflater, u32 count )
+{
+	if ( inflater->bitCount < count )
+		inflate_fill_bits( inflater );
+
+	u32 value = static_cast<u32>( inflater->bits & ( ( 1ull << count ) - 1 ) );
+	inflater->bits >>= count;
+	inflater->bitCount -= count;
+
+	return value;
+}
+
+[[nodiscard]] static u32 inflate_symbol_entry( INFLATE_TABLE table, u32 symbol )
+{
+	if ( table == INFLATE_TABLE_CODE_LENGTHS || ( table == INFLATE_TABLE_LIT_LEN && symbol < 256 ) )
+		return INFLATE_ENTRY( symbol, INFLATE_SYMBOL_LITERAL, 0 );
+
+	if ( table == INFLATE_TABLE_DIST )
+		return symbol < 30 ? INFLATE_ENTRY( inflateDistBase[ symbol ], INFLATE_SYMBOL_BASE, inflateDistExtra[ symbol ] ) : INFLATE_ENTRY( 0, INFLATE_SYMBOL_INVALID, 0 );
+
+	if ( symbol == 256 )
+		return INFLATE_ENTRY( 0, INFLATE_SYMBOL_END, 0 );
+
+	symbol -= 257;
+
+	return symbol < 29 ? INFLATE_ENTRY( inflateLengthBase[ symbol ], INFLATE_SYMBOL_BASE, inflateLengthExtra[ symbol ] ) : INFLATE_ENTRY( 0, INFLATE_SYMBOL_INVALID, 0 );
+}
+
+// Refill for the decode loop, which keeps the bit buffer in locals. Leaves at least 56 bits,
+// reading 8 bytes at once while that many are left in the current span.
+static inline void inflate_refill( Inflater *inflater, u64 &bits, u32 &bitCount, const u8 *&in, const u8 *&inEnd )
+{
+	if ( inEnd - in >= 8 )
+	{
+		bits |= inflate_read_u64( in ) << bitCount;
+		in += ( 63 - bitCount ) >> 3;
+		bitCount |= 56;
+		return;
+	}
+
+	inflater->bits = bits;
+	inflater->bitCount = bitCount;
+	inflater->in = in;
+	inflater->inEnd = inEnd;
+
+	inflate_fill_bits( inflater );
+
+	bits = inflater->bits;
+	bitCount = inflater->bitCount;
+	in = inflater->in;
+	inEnd = inflater->inEnd;
+}
+
+[[nodiscard]] static bool inflate_build_huffman( InflateHuffman *huffman, const u8 *lengths, u32 count, INFLATE_TABLE table )
+{
+	u32 lengthCount[ 16 ] = {};
+	u32 nextCode[ 16 ];
+
+	memset( huffman->fast, 0, sizeof( huffman->fast ) );
+
+	for ( u32 i = 0; i < count; ++i )
+		lengthCount[ lengths[ i ] ] += 1;
+
+	lengthCount[ 0 ] = 0;
+
+	u32 code = 0;
+	u32 symbols = 0;
+
+	for ( u32 s = 1; s < 16; ++s )
+	{
+		nextCode[ s ] = code;
+		huffman->firstCode[ s ] = static_cast<u16>( code );
+		huffman->firstSymbol[ s ] = static_cast<u16>( symbols );
+		code += lengthCount[ s ];
+
+		// Over subscribed
+		if ( code > ( 1u << s ) )
+			return false;
+
+		huffman->maxCode[ s ] = code << ( 16 - s );
+		code <<= 1;
+		symbols += lengthCount[ s ];
+	}
+
+	huffman->maxCode[ 16 ] = 0x10000;
+
+	for ( u32 i = 0; i < count; ++i )
+	{
+		u32 s = lengths[ i ];
+
+		if ( s == 0 )
+			continue;
+
+		u32 index = huffman->firstSymbol[ s ] + ( nextCode[ s ] - huffman->firstCode[ s ] );
+		huffman->value[ index ] = inflate_symbol_entry( table, i );
+
+		if ( s <= INFLATE_FAST_BITS )
+		{
+			u32 entry = huffman->value[ index ] | s;
+
+			for ( u32 j = inflate_reverse_bits( nextCode[ s ], s ); j < ( 1u << INFLATE_FAST_BITS ); j += ( 1u << s ) )
+				huffman->fast[ j ] = entry;
+		}
+
+		nextCode[ s ] += 1;
+	}
+
+	return true;
+}
+
+// Entry of a code longer than the fast table covers, compared against the canonical code ranges.
+// Needs 15 bits in bits, returns 0 for an invalid code.
+[[nodiscard]] static u32 inflate_decode_long( const InflateHuffman *huffman, u64 bits )
+{
+	u32 k = inflate_reverse_bits( static_cast<u32>( bits & 0xFFFF ), 16 );
+	u32 s;
+
+	for ( s = INFLATE_FAST_BITS + 1; s < 16; ++s )
+		if ( k < huffman->maxCode[ s ] )
+			break;
+
+	if ( s >= 16 )
+		return 0;
+
+	u32 index = ( k >> ( 16 - s ) ) - huffman->firstCode[ s ] + huffman->firstSymbol[ s ];
+
+	if ( index >= 288 )
+		return 0;
+
+	return huffman->value[ index ] | s;
+}
+
+// Returns the entry of the decoded symbol, 0 for an invalid code
+[[nodiscard]] static inline u32 inflate_decode( Inflater *inflater, const InflateHuffman *huffman )
+{
+	if ( inflater->bitCount < 16 )
+		inflate_fill_bits( inflater );
+
+	u32 entry = huffman->fast[ inflater->bits & ( ( 1u << INFLATE_FAST_BITS ) - 1 ) ];
+
+	if ( !entry )
+		entry = inflate_decode_long( huffman, inflater->bits );
+
+	u32 length = INFLATE_ENTRY_LENGTH( entry );
+	inflater->bits >>= length;
+	inflater->bitCount -= length;
+
+	return entry;
+}
+
+[[nodiscard]] static bool inflate_fixed_tables( Inflater *inflater )
+{
+	u8 lengths[ 288 ];
+	u32 i = 0;
+
+	for ( ; i < 144; ++i ) lengths[ i ] = 8;
+	for ( ; i < 256; ++i ) lengths[ i ] = 9;
+	for ( ; i < 280; ++i ) lengths[ i ] = 7;
+	for ( ; i < 288; ++i ) lengths[ i ] = 8;
+
+	if ( !inflate_build_huffman( &inflater->litLen, lengths, 288, INFLATE_TABLE_LIT_LEN ) )
+		return false;
+
+	for ( i = 0; i < 32; ++i ) lengths[ i ] = 5;
+
+	return inflate_build_huffman( &inflater->dist, lengths, 32, INFLATE_TABLE_DIST );
+}
+
+[[nodiscard]] static bool inflate_dynamic_tables( Inflater *inflater )
+{
+	u32 litCount = inflate_bits( inflater, 5 ) + 257;
+	u32 distCount = inflate_bits( inflater, 5 ) + 1;
+	u32 codeLengthCount = inflate_bits( inflater, 4 ) + 4;
+
+	// The header can claim up to 288 + 32, more than the format allows or lengths can hold
+	if ( litCount > 286 || distCount > 30 )
+		return false;
+
+	u8 codeLengths[ 19 ] = {};
+
+	for ( u32 i = 0; i < codeLengthCount; ++i )
+		codeLengths[ inflateCodeLengthOrder[ i ] ] = static_cast<u8>( inflate_bits( inflater, 3 ) );
+
+	InflateHuffman codeLengthHuffman;
+
+	if ( !inflate_build_huffman( &codeLengthHuffman, codeLengths, 19, INFLATE_TABLE_CODE_LENGTHS ) )
+		return false;
+
+	u8 lengths[ 286 + 32 ];
+	u32 total = litCount + distCount;
+	u32 n = 0;
+
+	while ( n < total )
+	{
+		u32 entry = inflate_decode( inflater, &codeLengthHuffman );
+
+		if ( !entry )
+			return false;
+
+		u32 symbol = INFLATE_ENTRY_VALUE( entry );
+
+		if ( symbol < 16 )
+		{
+			lengths[ n++ ] = static_cast<u8>( symbol );
+			continue;
+		}
+
+		u8 fill = 0;
+		u32 repeat;
+
+		if ( symbol == 16 )
+		{
+			if ( n == 0 )
+				return false;
+
+			fill = lengths[ n - 1 ];
+			repeat = inflate_bits( inflater, 2 ) + 3;
+		}
+		else if ( symbol == 17 )
+		{
+			repeat = inflate_bits( inflater, 3 ) + 3;
+		}
+		else
+		{
+			repeat = inflate_bits( inflater, 7 ) + 11;
+		}
+
+		if ( n + repeat > total )
+			return false;
+
+		memset( lengths + n, fill, repeat );
+		n += repeat;
+	}
+
+	return inflate_build_huffman( &inflater->litLen, lengths, litCount, INFLATE_TABLE_LIT_LEN ) &&
+		inflate_build_huffman( &inflater->dist, lengths + litCount, distCount, INFLATE_TABLE_DIST );
+}
+
+// Make room for size more bytes, keeping the unread bytes and the history window
+static void inflate_make_room( Inflater *inflater, u64 size )
+{
+	if ( inflater->writePos + size + INFLATE_MAX_MATCH + INFLATE_COPY_OVERRUN <= inflater->capacity )
+		return;
+
+	u64 keep = inflater->writePos > INFLATE_WINDOW_SIZE ? inflater->writePos - INFLATE_WINDOW_SIZE : 0;
+
+	if ( inflater->readPos < keep )
+		keep = inflater->readPos;
+
+	memmove( inflater->buffer, inflater->buffer + keep, inflater->writePos - keep );
+	inflater->readPos -= keep;
+	inflater->writePos -= keep;
+}
+
+// Decode until at least target bytes have been written
+static void inflate_run( Inflater *inflater, u64 target )
+{
+	u8 *buffer = inflater->buffer;
+
+	while ( inflater->writePos < target )
+	{
+		switch ( inflater->state )
+		{
+		case INFLATE_STATE_HEADER:
+		{
+			u32 cmf = inflate_bits( inflater, 8 );
+			u32 flg = inflate_bits( inflater, 8 );
+
+			// Deflate only, no preset dictionary
+			if ( ( cmf & 15 ) != 8 || ( ( cmf << 8 ) | flg ) % 31 != 0 || ( flg & 32 ) )
+			{
+				inflater->state = INFLATE_STATE_ERROR;
+				return;
+			}
+
+			inflater->state = INFLATE_STATE_BLOCK;
+			break;
+		}
+
+		case INFLATE_STATE_BLOCK:
+		{
+			if ( inflater->finalBlock )
+			{
+				inflater->state = INFLATE_STATE_DONE;
+				break;
+			}
+
+			inflater->finalBlock = inflate_bits( inflater, 1 ) != 0;
+			u32 type = inflate_bits( inflater, 2 );
+
+			if ( type == 0 )
+			{
+				// Stored blocks start on a byte boundary
+				u32 skip = inflater->bitCount & 7;
+				inflater->bits >>= skip;
+				inflater->bitCount -= skip;
+
+				u32 length = inflate_bits( inflater, 16 );
+				u32 check = inflate_bits( inflater, 16 );
+
+				if ( ( length ^ 0xFFFF ) != check )
+				{
+					inflater->state = INFLATE_STATE_ERROR;
+					return;
+				}
+
+				inflater->storedRemaining = length;
+				inflater->state = INFLATE_STATE_STORED;
+			}
+			else if ( type == 1 && inflate_fixed_tables( inflater ) )
+			{
+				inflater->state = INFLATE_STATE_HUFFMAN;
+			}
+			else if ( type == 2 && inflate_dynamic_tables( inflater ) )
+			{
+				inflater->state = INFLATE_STATE_HUFFMAN;
+			}
+			else
+			{
+				inflater->state = INFLATE_STATE_ERROR;
+				return;
+			}
+			break;
+		}
+
+		case INFLATE_STATE_STORED:
+		{
+			// Bytes still in the bit buffer first, stored blocks keep it byte aligned
+			while ( inflater->storedRemaining > 0 && inflater->writePos < target && inflater->bitCount >= 8 )
+			{
+				buffer[ inflater->writePos++ ] = static_cast<u8>( inflater->bits );
+				inflater->bits >>= 8;
+				inflater->bitCount -= 8;
+				inflater->storedRemaining -= 1;
+			}
+
+			// Then straight from the input spans
+			while ( inflater->storedRemaining > 0 && inflater->writePos < target && inflater->bitCount == 0 )
+			{
+				if ( inflater->in == inflater->inEnd && !inflater->refill( inflater->user, &inflater->in, &inflater->inEnd ) )
+					break;
+
+				u64 count = static_cast<u64>( inflater->inEnd - inflater->in );
+				count = count < inflater->storedRemaining ? count : inflater->storedRemaining;
+				count = count < target - inflater->writePos ? count : target - inflater->writePos;
+
+				memcpy( buffer + inflater->writePos, inflater->in, count );
+				inflater->in += count;
+				inflater->writePos += count;
+				inflater->storedRemaining -= static_cast<u32>( count );
+			}
+
+			// Out of input, the bit reader pads with zeros and counts the overrun
+			while ( inflater->storedRemaining > 0 && inflater->writePos < target )
+			{
+				buffer[ inflater->writePos++ ] = static_cast<u8>( inflate_bits( inflater, 8 ) );
+				inflater->storedRemaining -= 1;
+			}
+
+			if ( inflater->storedRemaining == 0 )
+				inflater->state = INFLATE_STATE_BLOCK;
+			break;
+		}
+
+		case INFLATE_STATE_HUFFMAN:
+		{
+			// The bit buffer is kept in locals, byte stores to the output could alias the inflater
+			// and would otherwise write it back on every symbol
+			u64 pos = inflater->writePos;
+			u64 bits = inflater->bits;
+			u32 bitCount = inflater->bitCount;
+			const u8 *in = inflater->in;
+			const u8 *inEnd = inflater->inEnd;
+			const InflateHuffman *litLen = &inflater->litLen;
+			const InflateHuffman *dist = &inflater->dist;
+			INFLATE_STATE next = INFLATE_STATE_HUFFMAN;
+
+			while ( pos < target )
+			{
+				// A refill lasts several literals
+				if ( bitCount < 15 )
+					inflate_refill( inflater, bits, bitCount, in, inEnd );
+
+				u32 entry = litLen->fast[ bits & ( ( 1u << INFLATE_FAST_BITS ) - 1 ) ];
+
+				if ( !entry )
+					entry = inflate_decode_long( litLen, bits );
+
+				bits >>= INFLATE_ENTRY_LENGTH( entry );
+				bitCount -= INFLATE_ENTRY_LENGTH( entry );
+
+				u32 kind = INFLATE_ENTRY_KIND( entry );
+
+				if ( kind == INFLATE_SYMBOL_LITERAL && entry )
+				{
+					buffer[ pos++ ] = static_cast<u8>( INFLATE_ENTRY_VALUE( entry ) );
+					continue;
+				}
+
+				if ( kind != INFLATE_SYMBOL_BASE )
+				{
+					next = kind == INFLATE_SYMBOL_END ? INFLATE_STATE_BLOCK : INFLATE_STATE_ERROR;
+					break;
+				}
+
+				// Length extra bits, the distance code and its extra bits take at most 33 bits
+				if ( bitCount < 33 )
+					inflate_refill( inflater, bits, bitCount, in, inEnd );
+
+				u32 extra = INFLATE_ENTRY_EXTRA( entry );
+				u32 length = INFLATE_ENTRY_VALUE( entry ) + static_cast<u32>( bits & ( ( 1ull << extra ) - 1 ) );
+				bits >>= extra;
+				bitCount -= extra;
+
+				entry = dist->fast[ bits & ( ( 1u << INFLATE_FAST_BITS ) - 1 ) ];
+
+				if ( !entry )
+					entry = inflate_decode_long( dist, bits );
+
+				if ( INFLATE_ENTRY_KIND( entry ) != INFLATE_SYMBOL_BASE )
+				{
+					next = INFLATE_STATE_ERROR;
+					break;
+				}
+
+				bits >>= INFLATE_ENTRY_LENGTH( entry );
+				bitCount -= INFLATE_ENTRY_LENGTH( entry );
+
+				extra = INFLATE_ENTRY_EXTRA( entry );
+				u32 distance = INFLATE_ENTRY_VALUE( entry ) + static_cast<u32>( bits & ( ( 1ull << extra ) - 1 ) );
+				bits >>= extra;
+				bitCount -= extra;
+
+				if ( distance > pos )
+				{
+					next = INFLATE_STATE_ERROR;
+					break;
+				}
+
+				u8 *dst = buffer + pos;
+				const u8 *src = dst - distance;
+
+				if ( distance >= 8 )
+				{
+					// Each block only reads bytes written before it, the last may run past the match
+					u8 *end = dst + length;
+
+					do
+					{
+						memcpy( dst, src, 8 );
+						dst += 8;
+						src += 8;
+					}
+					while ( dst < end );
+				}
+				else if ( distance == 1 )
+				{
+					memset( dst, *src, length );
+				}
+				else
+				{
+					// Overlapping copies repeat the pattern, so copy forwards a byte at a time
+					for ( u32 i = 0; i < length; ++i )
+						dst[ i ] = src[ i ];
+				}
+
+				pos += length;
+			}
+
+			inflater->writePos = pos;
+			inflater->bits = bits;
+			inflater->bitCount = bitCount;
+			inflater->in = in;
+			inflater->inEnd = inEnd;
+			inflater->state = next;
+			break;
+		}
+
+		case INFLATE_STATE_DONE:
+		case INFLATE_STATE_ERROR:
+			return;
+		}
+	}
+}
+
+// Buffer size for reads of up to maxRead bytes. Room for the history window, several reads
+// and one match overshooting the end.
+[[nodiscard]] static u64 inflate_memory( u64 maxRead )
+{
+	u64 capacity = INFLATE_WINDOW_SIZE + maxRead * 4 + INFLATE_MAX_MATCH + INFLATE_COPY_OVERRUN;
+
+	return capacity > KB( 256 ) ? capacity : KB( 256 );
+}
+
+[[nodiscard]] static bool inflate_init( Inflater *inflater, Allocator *allocator, u64 maxRead, bool ( *refill )( void *user, const u8 **in, const u8 **inEnd ), void *user )
+{
+	*inflater = {};
+	inflater->refill = refill;
+	inflater->user = user;
+	inflater->state = INFLATE_STATE_HEADER;
+	inflater->capacity = inflate_memory( maxRead );
+	inflater->buffer = allocator->allocate<u8>( inflater->capacity );
+
+	return inflater->buffer != nullptr;
+}
+
+// Returns the next size decompressed bytes, valid until the next call. nullptr on a corrupt or short stream.
+[[nodiscard]] static const u8 *inflate_read( Inflater *inflater, u64 size )
+{
+	if ( inflater->writePos - inflater->readPos < size )
+	{
+		inflate_make_room( inflater, size );
+		inflate_run( inflater, inflater->readPos + size );
+	}
+
+	// Reading past the real input means the stream was cut short
+	if ( inflater->writePos - inflater->readPos < size || inflater->overrun * 8 > inflater->bitCount )
+		return nullptr;
+
+	const u8 *data = inflater->buffer + inflater->readPos;
+	inflater->readPos += size;
+
+	return data;
+}
@@ -2,40 +2,77 @@
 // System Includes
 #include <stdint.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <errno.h>
 #include <string.h>
 #include <cmath>
 #include <cfloat>
 #include <cstdio>
 #include <assert.h>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+#if defined( __x86_64__ ) || defined( _M_X64 )
+	#include <immintrin.h>
+#endif
 
 // Platform Specific Includes
 #ifdef PLATFORM_WINDOWS
 	#include <direct.h>
 	#include "dirent/dirent.h"
+	#include <intrin.h>
 #else
 	#include <sys/stat.h>
+	#include <sys/mman.h>
+	#include <fcntl.h>
 	#include <unistd.h>
 	#include <dirent.h>
+	#include <sys/socket.h>
+	#include <sys/un.h>
 #endif
 
 // Third Party Includes
 #include "stb_image.h"
-#include "stb_image_write.h"
 
 // Includes
 #include "defines.h"
+#include "memory_arena.h"
 #include "array.h"
 #include "map.h"
-#include "memory_arena.h"
+#include "trace.h"
+#include "thread_pool.h"
+#include "mapped_file.h"
+#include "hash.h"
+#include "image_cache.h"
+#include "cpu.h"
+#include "merge.h"
+#include "inflate.h"
+#include "png_reader.h"
+#include "deflate.h"
+#include "png_writer.h"
 #include "error_codes.h"
 #include "image.h"
 
 struct App
 {
 	MemoryArena memory;
+	MemoryArena jobMemory;					// sized by the plan, used by the calling thread once jobs run
+	MemoryArena *workerMemory = nullptr;	// one per pool thread
+	u64 workerCount = 0;
+	ThreadPool pool;
+	MergeTable merge;
+	ImageCache imageCache;					// only used when several jobs run in one process
 
 } app;
 
+// The arena used by whichever thread is running
+static thread_local MemoryArena *threadMemory = &app.memory;
+
+static MemoryArena create_memory_arena( const char *name );
+
 struct ImageChannel
 {
 	u8 *image = nullptr;
@@ -45,47 +82,92 @@ struct ImageChannel
 	u64 size = 0;
 };
 
+struct MergeJob
+{
+	const char *inputFileR = nullptr;		// nullptr if the channel is unused
+	const char *inputFileG = nullptr;
+	const char *inputFileB = nullptr;
+	const char *inputFileA = nullptr;
+	const char *outputFile = nullptr;
+	u64 number = 0;							// job label in logs, the manifest line with -batch or the scan order with -scan
+	u64 memory = 0;							// transient memory the job needs, from plan_job
+	u64 inputMemory[ 4 ] = {};				// memory each input needs when it's decoded on a thread of its own
+};
+
+#define APP_MEMORY			GB( 64 )	// address space reserved for the manifest, scanned paths and job list, committed as they grow
+#define SCAN_INDEX_MEMORY	GB( 16 )	// address space reserved for each half of the scan index while a tree is walked
+#define PLAN_MEMORY			KB( 256 )	// stb_image reading headers while jobs are planned
+
+struct ScanSet
+{
+	const char *files[ 4 ] = {};	// red, green, blue and alpha inputs found for a stem
+};
+
+using ScanIndex = DynamicMap<const char *, ScanSet>;
+
 struct Options
 {
-	u64 memory = MB( 16 );
+	u64 memory = 0;							// transient memory per job, 0 sizes it from the inputs
 	const char *programName = "grey_merger.exe";
 	const char *workingDirectory = nullptr;
 	bool verbose = false;
+	u32 jobs = 1;
 	char inputFileR[ 4096 ];
 	char inputFileG[ 4096 ];
 	char inputFileB[ 4096 ];
+	char inputFileA[ 4096 ];
 	bool redChannel = false;
 	bool greenChannel = false;
 	bool blueChannel = false;
+	bool alphaChannel = false;
 	char outputFile[ 4096 ];
+	const char *batchFile = nullptr;
+	const char *scanDirectory = nullptr;
+	const char *scanSuffix[ 4 ] = { "_r", "_g", "_b", nullptr };		// nullptr if the channel is unused
+	const char *scanOutputSuffix = "_rgb";
+	const DeflateLevel *compression = &deflateLevels[ DEFLATE_DEFAULT_LEVEL ];
+	PNG_FILTER_MODE pngFilter = PNG_FILTER_MODE_EXHAUSTIVE;
+	MERGE_LAYOUT layout = MERGE_LAYOUT_RGBA;
+	bool stream = false;
+	bool cache = false;
+	u64 imageCache = 0;						// bytes of decoded inputs kept between jobs
+	const char *serveSocket = nullptr;
+	const char *tracePath = nullptr;
+	bool memoryStats = false;
 
 } options;
 
+using CommandFunc = RESULT_CODE (*)( int &index, int argc, const char *argv[] );
+
 static void log( const char *message, ... )
 {
+	// Format first so lines from different threads don't interleave
+	char buffer[ 8192 ];
 	va_list args;
 	va_start( args, message );
-	vfprintf( stdout, message, args );
+	vsnprintf( buffer, sizeof( buffer ), message, args );
 	va_end( args );
-	fprintf( stderr, "\n" );
+	fprintf( stdout, "%s\n", buffer );
 }
 
 static void log_warning( const char *message, ... )
 {
+	char buffer[ 8192 ];
 	va_list args;
 	va_start( args, message );
-	vfprintf( stderr, message, args );
+	vsnprintf( buffer, sizeof( buffer ), message, args );
 	va_end( args );
-	fprintf( stderr, "\n" );
+	fprintf( stderr, "%s\n", buffer );
 }
 
 static void log_error( const char *message, ... )
 {
+	char buffer[ 8192 ];
 	va_list args;
 	va_start( args, message );
-	vfprintf( stderr, message, args );
+	vsnprintf( buffer, sizeof( buffer ), message, args );
 	va_end( args );
-	fprintf( stderr, "\n" );
+	fprintf( stderr, "%s\n", buffer );
 }
 
 static int usage_message( RESULT_CODE code )
@@ -101,8 +183,26 @@ static int usage_message( RESULT_CODE code )
 	log( "[-channel-r] <file>          EG. -channel-r assets\\image\\image_r.png        (input file for red channel)" );
 	log( "[-channel-g] <file>          EG. -channel-g assets\\image\\image_g.png        (input file for green channel)" );
 	log( "[-channel-b] <file>          EG. -channel-b assets\\image\\image_b.png        (input file for blue channel)" );
+	log( "[-channel-a] <file>          EG. -channel-a assets\\image\\image_a.png        (input file for alpha channel, needs the rgba layout)" );
+	log( "[-layout] <layout>           EG. -layout rgb                                    (output channels, rgba, rgb, rg or grey (red input only). Defaults to rgba)" );
 	log( "[-o] <file>                  EG. -o assets\\image\\mergedimg.png                  (override the default output file)" );
-	log( "[-memory] <bytes>            EG. -memory 1024                                   (specify memory allocation))" );
+	log( "[-memory] <bytes>            EG. -memory 512M                                   (memory for each job, K, M or G suffixes. Defaults to what the inputs need)" );
+	log( "[-compression] <level>       EG. -compression fast                              (output compression, 0 to 9, store, fast (runs only), huffman (no matching). Defaults to 5)" );
+	log( "[-png-filter] <mode>         EG. -png-filter sampled                            (row filter choice, exhaustive (best per row), sampled (best over a few rows), none, sub, up, average or paeth. Defaults to exhaustive)" );
+	log( "[-stream]                    EG. -stream                                        (merge and write one row at a time, memory no longer grows with the image height)" );
+	log( "[-image-cache] <bytes>       EG. -image-cache 512M                              (keep decoded inputs between -batch, -scan or -serve jobs, least recently used dropped first)" );
+	log( "[-trace] <file>              EG. -trace merge.json                              (record where the time goes as chrome trace events, open in chrome://tracing or ui.perfetto.dev)" );
+	log( "[-memory-stats]              EG. -memory-stats                                  (report peak use, allocation counts, copies and wasted bytes of every arena once the run ends)" );
+	log( "[-cache]                     EG. -cache                                         (skip jobs whose inputs and output options match the .gmcache file left next to their output)" );
+	log( "[-jobs] <count>              EG. -jobs 8                                        (worker threads, 0 uses every core. -batch and -scan run a job on each with its own -memory, a single merge uses them to compress the output)" );
+	log( "[-scan] <directory>          EG. -scan assets\\textures                          (merge every complete channel set found under a directory)" );
+	log( "[-scan-suffix-r] <suffix>    EG. -scan-suffix-r _r                              (file name suffix of a red input for -scan, - ignores the channel)" );
+	log( "[-scan-suffix-g] <suffix>    EG. -scan-suffix-g _g                              (file name suffix of a green input for -scan, - ignores the channel)" );
+	log( "[-scan-suffix-b] <suffix>    EG. -scan-suffix-b _b                              (file name suffix of a blue input for -scan, - ignores the channel)" );
+	log( "[-scan-suffix-a] <suffix>    EG. -scan-suffix-a _a                              (file name suffix of an alpha input for -scan, unused by default)" );
+	log( "[-scan-output] <suffix>      EG. -scan-output _rgb                              (suffix for the merged file written next to the inputs by -scan)" );
+	log( "[-serve] <socket>            EG. -serve /tmp/grey_merger.sock                   (stay running and merge each line sent to a unix socket, lines take the same commands, fd:<n> names a file descriptor sent with it)" );
+	log( "[-batch] <file>              EG. -batch assets\\merges.txt                        (run every job in a manifest, one \"<r> <g> <b> [<a>] <output>\" per line, - for an unused channel)" );
 
 	return code;
 }
@@ -249,6 +349,7 @@ static u64 string_append( char *destination, u64 destSize, const char *append )
 
 static bool make_directory( const char *directory )
 {
+	TraceScope span( "make directory", directory );
 	char pathMem[ 4096 ];
 	if ( string_copy( pathMem, sizeof( pathMem ), directory ) == 0 )
 		return false;
@@ -280,6 +381,11 @@ static bool make_directory( const char *directory )
 			}
 		}
 	}
+	else if ( *path == '/' || *path == '\\' )
+	{
+		// / (absolute path)
+		string_append( dir, sizeof( dir ), "/" );
+	}
 
 	path = string_tokenise( path, delimiters, &token, &delim );
 
@@ -306,13 +412,22 @@ static bool make_directory( const char *directory )
 	return true;
 }
 
-[[nodiscard]] static u8 *read_image( const char *filename, u32 *width, u32 *height, u32 *channels )
+[[nodiscard]] static u8 *read_image( Allocator *allocator, const char *filename, u32 *width, u32 *height, u32 *channels )
 {
 	assert( *channels <= 4 );
 
+	MemoryScope scope( allocator );
 	int w, h, c;
+	u8 *data;
+	MappedFile file;
+
+	// stb_image takes an int length, bigger files and ones that can't be mapped go through stdio
+	if ( mapped_file_open( &file, filename ) && file.size <= INT32_MAX )
+		data = (u8 *)stbi_load_from_memory( file.data, static_cast<int>( file.size ), &w, &h, &c, *channels );
+	else
+		data = (u8 *)stbi_load( filename, &w, &h, &c, *channels );
 
-	u8 *data = (u8 *)stbi_load( filename, &w, &h, &c, *channels );
+	mapped_file_close( &file );
 
 	if ( !data )
 	{
@@ -331,11 +446,12 @@ static bool make_directory( const char *directory )
 	return data;
 }
 
-static RESULT_CODE read_channel_image( ImageChannel *imgChannel, const char *path, u32 *w, u32 *h )
+static RESULT_CODE read_channel_image( Allocator *allocator, ImageChannel *imgChannel, const char *path, u32 *w, u32 *h )
 {
-	imgChannel->image = read_image( path, &imgChannel->w, &imgChannel->h, &imgChannel->channels );
+	TraceScope span( "decode input", path );
+	imgChannel->image = read_image( allocator, path, &imgChannel->w, &imgChannel->h, &imgChannel->channels );
 
-	imgChannel->size = imgChannel->w * imgChannel->h * imgChannel->channels;
+	imgChannel->size = static_cast<u64>( imgChannel->w ) * imgChannel->h * imgChannel->channels;
 
 	if ( !imgChannel->image )
 	{
@@ -349,7 +465,7 @@ static RESULT_CODE read_channel_image( ImageChannel *imgChannel, const char *pat
 	}
 	else if ( options.verbose )
 	{
-		log( "Read %d bytes for file: %s", imgChannel->size, path );
+		log( "Read %llu bytes for file: %s", imgChannel->size, path );
 	}
 
 	if ( *w == 0 )
@@ -370,296 +486,2237 @@ static bool change_directory( const char *directory )
 	#endif
 }
 
-// -------------------------------------------------------------------------
-// ENTRY
-// -------------------------------------------------------------------------
-int main( int argc, const char *argv[] )
+[[nodiscard]] static bool file_size( const char *filename, u64 *size )
 {
-	options.inputFileR[ 0 ] = '\0';
-	options.inputFileG[ 0 ] = '\0';
-	options.inputFileB[ 0 ] = '\0';
-	options.outputFile[ 0 ] = '\0';
+	FILE *file = fopen( filename, "rb" );
 
-	Map<const char *, RESULT_CODE(*)( int &, int, const char ** ), 256> commands;
+	if ( !file )
+		return false;
 
-	commands.insert( "-v", [] ( int &index, int argc, const char *argv[] )
-		{
-			options.verbose = true;
+	#ifdef PLATFORM_WINDOWS
+		_fseeki64( file, 0, SEEK_END );
+		i64 bytes = _ftelli64( file );
+	#else
+		fseeko( file, 0, SEEK_END );
+		i64 bytes = ftello( file );
+	#endif
 
-			return RESULT_CODE_SUCCESS;
-		} );
+	fclose( file );
 
-	commands.insert( "-ra", [] ( int &index, int argc, const char *argv[] )
-		{
-			log( "Arguments received [#%d]", argc );
-			for ( int i = 0; i < argc; ++i )
-				log( " [%d] = %s", i, argv[ i ] );
+	if ( bytes < 0 )
+		return false;
 
-			return RESULT_CODE_SUCCESS;
-		} );
+	*size = static_cast<u64>( bytes );
 
-	commands.insert( "-wd", [] ( int &index, int argc, const char *argv[] )
-		{
-			options.workingDirectory = argv[ ++index ];
+	return true;
+}
 
-			return RESULT_CODE_SUCCESS;
-		} );
+[[nodiscard]] static bool file_stamp( const char *filename, FileStamp *stamp )
+{
+	#ifdef PLATFORM_WINDOWS
+		struct _stat64 info;
 
-	commands.insert( "-channel-r", [] ( int &index, int argc, const char *argv[] )
-		{
-			options.redChannel = true;
+		if ( _stat64( filename, &info ) != 0 )
+			return false;
 
-			string_copy( options.inputFileR, sizeof( options.inputFileR ), argv[ ++index ] );
+		stamp->time = info.st_mtime;
+		stamp->id = 0;
+	#else
+		struct stat info;
 
-			return RESULT_CODE_SUCCESS;
-		} );
+		// Pipes and devices can't be told apart from their last contents
+		if ( stat( filename, &info ) != 0 || !S_ISREG( info.st_mode ) )
+			return false;
 
-	commands.insert( "-channel-g", [] ( int &index, int argc, const char *argv[] )
-		{
-			options.greenChannel = true;
+		stamp->time = static_cast<i64>( info.st_mtim.tv_sec ) * 1000000000 + info.st_mtim.tv_nsec;
+		stamp->id = static_cast<u64>( info.st_ino );
+	#endif
 
-			string_copy( options.inputFileG, sizeof( options.inputFileG ), argv[ ++index ] );
+	stamp->size = static_cast<u64>( info.st_size );
 
-			return RESULT_CODE_SUCCESS;
-		} );
+	return true;
+}
 
-	commands.insert( "-channel-b", [] ( int &index, int argc, const char *argv[] )
-		{
-			options.blueChannel = true;
+[[nodiscard]] static char *read_text_file( Allocator *allocator, const char *filename, u64 size )
+{
+	TraceScope span( "read text file", filename );
+	FILE *file = fopen( filename, "rb" );
 
-			string_copy( options.inputFileB, sizeof( options.inputFileB ), argv[ ++index ] );
+	if ( !file )
+		return nullptr;
 
-			return RESULT_CODE_SUCCESS;
-		} );
+	char *text = allocator->allocate<char>( size + 1 );
 
-	commands.insert( "-o", [] ( int &index, int argc, const char *argv[] )
-		{
-			string_copy( options.outputFile, sizeof( options.outputFile ), argv[ ++index ] );
+	if ( text && fread( text, 1, size, file ) != size )
+		text = nullptr;
 
-			return RESULT_CODE_SUCCESS;
-		} );
+	fclose( file );
 
-	commands.insert( "-memory", [] ( int &index, int argc, const char *argv[] )
-		{
-			options.memory = atoi( argv[ ++index ] );
+	if ( text )
+		text[ size ] = '\0';
 
-			return RESULT_CODE_SUCCESS;
-		} );
+	return text;
+}
 
-	// Process the option commands
-	for ( int i = 1; i < argc; ++i )
+#define DECODE_BAND_BYTES		KB( 512 )	// rows of one input decoded per task when inputs decode concurrently
+
+// An input channel streams scanlines straight out of the png reader. Formats the reader
+// doesn't handle fall back to a full stb_image decode that rows are read out of.
+struct ChannelInput
+{
+	PngReader png = {};
+	ImageChannel image;
+	bool streaming = false;
+
+	// A lone job decodes its inputs on separate threads, each with an arena of its own.
+	// Streamed inputs are then decoded a band of rows at a time.
+	MemoryArena memory;
+	const char *path = nullptr;
+	RESULT_CODE result = RESULT_CODE_SUCCESS;
+	u8 *band = nullptr;
+	u32 bandRows = 0;
+
+	ImageCacheEntry *cached = nullptr;		// the plane read comes from the image cache
+	u32 bandStart = 0;						// row held at the start of band
+	u32 bandCount = 0;
+};
+
+// Rows of an input that fit in one decode band, at least one
+[[nodiscard]] static u32 decode_band_rows( u32 w, u32 h, u32 stride )
+{
+	u64 rowBytes = static_cast<u64>( w ) * stride;
+	u64 rows = rowBytes ? DECODE_BAND_BYTES / rowBytes : 0;
+
+	rows = rows > h ? h : rows;
+
+	return rows ? static_cast<u32>( rows ) : 1;
+}
+
+static RESULT_CODE decode_channel_input( ChannelInput *input, Allocator *allocator, const char *path )
+{
+	if ( png_reader_open( &input->png, allocator, path ) == PNG_READER_RESULT_OK )
 	{
-		auto f = commands.find( argv[ i ] );
+		input->streaming = true;
+		input->image.w = input->png.width;
+		input->image.h = input->png.height;
+		input->image.channels = input->png.stride;
 
-		if ( f )
-		{
-			RESULT_CODE code = f->value( i, argc, &argv[ 0 ] );
-			if ( code != RESULT_CODE_SUCCESS )
-				return usage_message( code );
-		}
-		else
-		{
-			log_warning( "Unknown command: %s", argv[ i ] );
-			return usage_message( RESULT_CODE_UNKNOWN_OPTIONAL_COMMAND );
-		}
+		if ( options.verbose )
+			log( "Streaming %u x %u image from file: %s", input->image.w, input->image.h, path );
+
+		return RESULT_CODE_SUCCESS;
 	}
 
-	app.memory =
-	{
-		.flags = 0,
-		.memory = nullptr,
-		.permanent =
-		{
-			.capacity = 0,
-			.available = 0,
-			.memory = nullptr,
-			.lastAlloc = nullptr,
-			.allocate_func = memory_bump_allocate,
-			.reallocate_func = memory_bump_reallocate,
-			.shrink_func = memory_bump_shrink,
-			.free_func = memory_bump_free,
-			.attach_func = memory_bump_attach,
-		},
-		.transient =
-		{
-			.capacity = 0,
-			.available = 0,
-			.memory = nullptr,
-			.lastAlloc = nullptr,
-			.allocate_func = memory_bump_allocate,
-			.reallocate_func = memory_bump_reallocate,
-			.shrink_func = memory_bump_shrink,
-			.free_func = memory_bump_free,
-			.attach_func = memory_bump_attach,
-		},
-		.fastBump =
-		{
-			.capacity = 0,
-			.available = 0,
-			.memory = nullptr,
-			.lastAlloc = nullptr,
-			.allocate_func = memory_fast_bump_allocate,
-			.attach_func = nullptr,
-		},
-	};
+	png_reader_close( &input->png );
+
+	u32 w = 0;
+	u32 h = 0;
+
+	return read_channel_image( allocator, &input->image, path, &w, &h );
+}
+
+[[nodiscard]] static const u8 *channel_input_row( ChannelInput *input, u32 y );
+
+// Points the input at a plane in the image cache
+static void use_cached_channel_input( ChannelInput *input, ImageCacheEntry *entry )
+{
+	input->cached = entry;
+	input->streaming = false;
+	input->image.image = entry->plane;
+	input->image.w = entry->w;
+	input->image.h = entry->h;
+	input->image.channels = 1;
+	input->image.size = static_cast<u64>( entry->w ) * entry->h;
+}
+
+// Takes the input's plane from the image cache, or decodes it and packs the first channel into a new
+// plane there for later jobs. Inputs that don't fit in the cache are read as usual.
+static RESULT_CODE open_cached_channel_input( ChannelInput *input, Allocator *allocator, const char *path )
+{
+	FileStamp stamp;
+
+	if ( !file_stamp( path, &stamp ) )
+		return decode_channel_input( input, allocator, path );
+
+	ImageCacheEntry *entry = image_cache_find( &app.imageCache, path, stamp );
 
-	if ( !app.memory.init( 0, options.memory, 0, true ) )
+	if ( entry )
 	{
-		log_error( "Failed to initialise memory app.memory" );
-		return usage_message( RESULT_CODE_FAILED_MEMORY_ARENA_INITIALISATION );
+		if ( options.verbose )
+			log( "Found %u x %u image in the image cache: %s", entry->w, entry->h, path );
 	}
-
-	// Set working directory
-	if ( options.workingDirectory )
+	else
 	{
-		if ( change_directory( options.workingDirectory ) && options.verbose )
-			log( "Working directory changed to: %s", options.workingDirectory );
+		RESULT_CODE code = decode_channel_input( input, allocator, path );
+
+		if ( code != RESULT_CODE_SUCCESS )
+			return code;
+
+		entry = image_cache_reserve( &app.imageCache, create_memory_arena( "image cache" ), path, stamp, input->image.w, input->image.h );
+
+		if ( !entry )
+			return RESULT_CODE_SUCCESS;
+
+		// Kernels read all four sources, the input goes first and the rest stay empty
+		MergeSource sources[ 4 ] = { { .data = nullptr, .stride = input->image.channels } };
+		MergeFunc extract = app.merge.extract[ sources[ 0 ].stride ];
+
+		for ( u32 y = 0; y < entry->h; ++y )
+		{
+			sources[ 0 ].data = channel_input_row( input, y );
+
+			if ( !sources[ 0 ].data )
+			{
+				log_warning( "Failed to decode row %u of file: %s", y, path );
+				image_cache_publish( &app.imageCache, entry, false );
+				return RESULT_CODE_FAILED_TO_DECODE_INPUT_FILE;
+			}
+
+			extract( entry->plane + static_cast<u64>( y ) * entry->w, sources, 255, entry->w );
+		}
+
+		image_cache_publish( &app.imageCache, entry, true );
+		png_reader_close( &input->png );
 	}
 
-	if ( !options.redChannel && !options.greenChannel && !options.blueChannel )
+	use_cached_channel_input( input, entry );
+
+	return RESULT_CODE_SUCCESS;
+}
+
+static RESULT_CODE open_channel_input( ChannelInput *input, Allocator *allocator, const char *path, u32 *w, u32 *h )
+{
+	TraceScope span( "open input", path );
+	RESULT_CODE code = app.imageCache.capacity ? open_cached_channel_input( input, allocator, path ) : decode_channel_input( input, allocator, path );
+
+	if ( code != RESULT_CODE_SUCCESS )
+		return code;
+
+	if ( *w == 0 )
+		*w = input->image.w;
+
+	if ( *h == 0 )
+		*h = input->image.h;
+
+	return RESULT_CODE_SUCCESS;
+}
+
+// Returns the first channel of row y
+[[nodiscard]] static const u8 *channel_input_row( ChannelInput *input, u32 y )
+{
+	if ( input->band )
+		return input->band + static_cast<u64>( y - input->bandStart ) * input->image.w * input->image.channels;
+
+	if ( input->streaming )
+		return png_reader_next_row( &input->png );
+
+	return input->image.image + static_cast<u64>( y ) * input->image.w * input->image.channels;
+}
+
+// Opens, or for stb_image fully decodes, an input into its own arena on whichever thread runs it
+static void open_channel_input_task( void *data )
+{
+	ChannelInput *input = static_cast<ChannelInput *>( data );
+	Allocator *allocator = &input->memory.transient;
+	u32 w = 0;
+	u32 h = 0;
+
+	input->result = open_channel_input( input, allocator, input->path, &w, &h );
+
+	if ( input->result != RESULT_CODE_SUCCESS || !input->streaming )
+		return;
+
+	input->bandRows = decode_band_rows( w, h, input->image.channels );
+	input->band = allocator->allocate<u8>( static_cast<u64>( input->bandRows ) * w * input->image.channels );
+
+	if ( !input->band )
 	{
-		return usage_message( RESULT_CODE_NO_INPUT_FILES );
+		log_warning( "Failed to allocate a decode band for file: %s", input->path );
+		input->result = RESULT_CODE_FAILED_TO_ALLOCATE_MEMORY_FOR_OUTPUT_IMAGE;
 	}
+}
 
-	if ( options.verbose )
+// Decodes the next bandCount rows of a streamed input into its band
+static void decode_band_task( void *data )
+{
+	ChannelInput *input = static_cast<ChannelInput *>( data );
+	u64 rowBytes = static_cast<u64>( input->image.w ) * input->image.channels;
+	TraceScope span( "decode band", input->path );
+
+	for ( u32 r = 0; r < input->bandCount; ++r )
 	{
-		if ( options.redChannel )
-			log( "Channel Red Input file: %s", options.inputFileR );
+		const u8 *row = png_reader_next_row( &input->png );
 
-		if ( options.greenChannel )
-			log( "Channel Green Input file: %s", options.inputFileG );
+		if ( !row )
+		{
+			input->result = RESULT_CODE_FAILED_TO_DECODE_INPUT_FILE;
+			return;
+		}
 
-		if ( options.blueChannel )
-			log( "Channel Blue Input file: %s", options.inputFileB );
+		memcpy( input->band + r * rowBytes, row, rowBytes );
 	}
+}
 
-	// Create an output filename if one was not provided
-	if ( options.outputFile[ 0 ] == '\0' )
+// With a pool, and more than one input, each input missing from the image cache is opened on a thread of its own
+static RESULT_CODE open_channel_inputs( const char *paths[ 4 ], ChannelInput *inputs, u32 *w, u32 *h, ThreadPool *pool, const u64 memory[ 4 ] )
+{
+	u32 inputCount = 0;
+
+	for ( u32 c = 0; c < 4; ++c )
+		inputCount += paths[ c ] ? 1 : 0;
+
+	if ( pool && pool->threadCount > 0 && inputCount > 1 )
 	{
-		string_append( options.outputFile, sizeof( options.outputFile ), "output.png" );
+		TaskGroup group;
+		u32 decodeCount = 0;
 
-		if ( options.verbose )
-			log( "Output file automatically assigned filename: %s", options.outputFile );
-	}
+		for ( u32 c = 0; c < 4; ++c )
+		{
+			if ( !paths[ c ] )
+				continue;
 
-	// -----------------------------------------------------------------------------
-	// Open the input files
+			// Inputs already in the image cache have nothing to decode and aren't worth a task
+			FileStamp stamp;
+			ImageCacheEntry *entry = app.imageCache.capacity && file_stamp( paths[ c ], &stamp ) ? image_cache_find( &app.imageCache, paths[ c ], stamp ) : nullptr;
 
-	ImageChannel red;
-	ImageChannel green;
-	ImageChannel blue;
+			if ( entry )
+			{
+				if ( options.verbose )
+					log( "Found %u x %u image in the image cache: %s", entry->w, entry->h, paths[ c ] );
 
-	u32 w = 0;
-	u32 h = 0;
+				use_cached_channel_input( &inputs[ c ], entry );
+				inputs[ c ].result = RESULT_CODE_SUCCESS;
+				continue;
+			}
+
+			inputs[ c ].memory = create_memory_arena( "input" );
+			inputs[ c ].path = paths[ c ];
+
+			if ( !inputs[ c ].memory.init_virtual( 0, memory[ c ], 0 ) )
+				return RESULT_CODE_FAILED_MEMORY_ARENA_INITIALISATION;
+
+			pool->submit( &group, open_channel_input_task, &inputs[ c ] );
+			decodeCount += 1;
+		}
+
+		pool->wait( &group );
+
+		for ( u32 c = 0; c < 4; ++c )
+		{
+			if ( !paths[ c ] )
+				continue;
+
+			if ( inputs[ c ].result != RESULT_CODE_SUCCESS )
+				return inputs[ c ].result;
+
+			if ( *w == 0 )
+			{
+				*w = inputs[ c ].image.w;
+				*h = inputs[ c ].image.h;
+			}
+		}
 
-	if ( options.redChannel )
+		if ( options.verbose && decodeCount > 1 )
+			log( "Decoding %u inputs concurrently", decodeCount );
+	}
+	else
 	{
-		RESULT_CODE code = read_channel_image( &red, options.inputFileR, &w, &h );
-		if ( code != RESULT_CODE_SUCCESS )
-			return usage_message( code );
+		for ( u32 c = 0; c < 4; ++c )
+		{
+			if ( !paths[ c ] )
+				continue;
+
+			RESULT_CODE code = open_channel_input( &inputs[ c ], &threadMemory->transient, paths[ c ], w, h );
+			if ( code != RESULT_CODE_SUCCESS )
+				return code;
+		}
 	}
 
-	if ( options.greenChannel )
+	// Make sure they are all the same size
+	for ( u32 c = 0; c < 4; ++c )
 	{
-		RESULT_CODE code = read_channel_image( &green, options.inputFileG, &w, &h );
-		if ( code != RESULT_CODE_SUCCESS )
-			return usage_message( code );
+		if ( paths[ c ] && ( inputs[ c ].image.w != *w || inputs[ c ].image.h != *h ) )
+			return RESULT_CODE_INPUT_FILE_SIZES_DONT_MATCH;
 	}
 
-	if ( options.blueChannel )
+	return RESULT_CODE_SUCCESS;
+}
+
+// Merge every row into out. With a stream out only holds one row, which is pushed on
+// to the stream as soon as it is merged.
+static RESULT_CODE merge_channel_rows( const char *paths[ 4 ], ChannelInput *inputs, u32 w, u32 h, u8 *out, PngStream *stream, ThreadPool *pool )
+{
+	u64 rowSize = static_cast<u64>( w ) * app.merge.layout;
+	MergeSource sources[ 4 ];
+
+	for ( u32 c = 0; c < 4; ++c )
 	{
-		RESULT_CODE code = read_channel_image( &blue, options.inputFileB, &w, &h );
-		if ( code != RESULT_CODE_SUCCESS )
-			return usage_message( code );
+		sources[ c ].data = nullptr;
+		sources[ c ].stride = paths[ c ] ? inputs[ c ].image.channels : 0;
 	}
 
-	bool rInvalid = options.redChannel && ( red.w != w || red.h != h );
-	bool gInvalid = options.greenChannel && ( green.w != w || green.h != h );
-	bool bInvalid = options.blueChannel && ( blue.w != w || blue.h != h );
+	// Alpha is packed into a row of its own unless it's already one byte per pixel
+	MergeFunc extractAlpha = nullptr;
+	u8 *alphaRow = nullptr;
 
-	// Make sure they are all the same size
-	if ( rInvalid || gInvalid || bInvalid )
+	if ( sources[ 3 ].stride > 1 )
 	{
-		return usage_message( RESULT_CODE_INPUT_FILE_SIZES_DONT_MATCH );
+		extractAlpha = app.merge.extract[ sources[ 3 ].stride ];
+		alphaRow = threadMemory->transient.allocate<u8>( w );
+
+		if ( !alphaRow )
+		{
+			log_warning( "Failed to allocate %u bytes.", w );
+			return RESULT_CODE_FAILED_TO_ALLOCATE_MEMORY_FOR_OUTPUT_IMAGE;
+		}
 	}
 
-	// Create the output data
-	u32 outWidth = w;
-	u32 outHeight = h;
-	u32 outChannels = 4;
-	u64 outSize = w * h * outChannels;
-	u8 *outImage = app.memory.transient.allocate<u8>( outSize, true );
+	// Strides are fixed per image so the kernel only needs finding once
+	MergeFunc merge = merge_find( app.merge, sources[ 0 ].stride, sources[ 1 ].stride, sources[ 2 ].stride, paths[ 3 ] ? 1 : 0 );
 
-	if ( !outImage )
+	// Inputs decoding concurrently fill their bands together, the rows are merged once they all finish
+	u32 bandRows = h;
+	u32 bandEnd = 0;
+
+	for ( u32 c = 0; c < 4; ++c )
 	{
-		log_warning( "Failed to allocate &d bytes.", outSize );
-		return usage_message( RESULT_CODE_FAILED_TO_ALLOCATE_MEMORY_FOR_OUTPUT_IMAGE );
+		if ( paths[ c ] && inputs[ c ].band && inputs[ c ].bandRows < bandRows )
+			bandRows = inputs[ c ].bandRows;
 	}
 
-	u8 *image = outImage;
-	u8 *rImage = red.image;
-	u8 *gImage = green.image;
-	u8 *bImage = blue.image;
+	TraceRows rowSpans;
+	trace_rows_begin( &rowSpans, "decode rows", "merge rows", "write rows" );
 
-	for ( u64 y = 0; y < outHeight; ++y )
+	// Each scanline is merged into the output as soon as it is decoded
+	for ( u32 y = 0; y < h; ++y )
 	{
-		for ( u64 x = 0; x < outWidth; ++x )
+		if ( y == bandEnd && pool )
 		{
-			if ( options.redChannel )
-			{
-				*image++ = *rImage;
-				rImage += red.channels;
-			}
-			else
-			{
-				*image++ = 0;
-			}
+			TaskGroup group;
+			u32 count = h - y < bandRows ? h - y : bandRows;
+			bandEnd = y + count;
 
-			if ( options.greenChannel )
-			{
-				*image++ = *gImage;
-				gImage += green.channels;
-			}
-			else
+			for ( u32 c = 0; c < 4; ++c )
 			{
-				*image++ = 0;
+				if ( !paths[ c ] || !inputs[ c ].band )
+					continue;
+
+				inputs[ c ].bandStart = y;
+				inputs[ c ].bandCount = count;
+				pool->submit( &group, decode_band_task, &inputs[ c ] );
 			}
 
-			if ( options.blueChannel )
+			pool->wait( &group );
+
+			for ( u32 c = 0; c < 4; ++c )
 			{
-				*image++ = *bImage;
-				bImage += blue.channels;
+				if ( paths[ c ] && inputs[ c ].result != RESULT_CODE_SUCCESS )
+				{
+					log_warning( "Failed to decode rows %u to %u of file: %s", y, bandEnd, paths[ c ] );
+					return inputs[ c ].result;
+				}
 			}
-			else
+		}
+
+		for ( u32 c = 0; c < 4; ++c )
+		{
+			if ( !paths[ c ] )
+				continue;
+
+			sources[ c ].data = channel_input_row( &inputs[ c ], y );
+
+			if ( !sources[ c ].data )
 			{
-				*image++ = 0;
+				log_warning( "Failed to decode row %u of file: %s", y, paths[ c ] );
+				return RESULT_CODE_FAILED_TO_DECODE_INPUT_FILE;
 			}
+		}
+
+		if ( extractAlpha )
+		{
+			// Kernels read all four sources, the alpha input goes first and the rest stay empty
+			MergeSource alphaSources[ 4 ] = { sources[ 3 ] };
+			extractAlpha( alphaRow, alphaSources, 255, w );
+			sources[ 3 ].data = alphaRow;
+		}
 
-			*image++ = 255;
+		trace_rows_mark( &rowSpans, 0 );
+
+		if ( stream )
+		{
+			merge( out, sources, 255, w );
+			trace_rows_mark( &rowSpans, 1 );
+			png_stream_write_row( stream, out );
+			trace_rows_mark( &rowSpans, 2 );
+		}
+		else
+		{
+			merge( out + y * rowSize, sources, 255, w );
+			trace_rows_mark( &rowSpans, 1 );
 		}
+
+		trace_rows_next( &rowSpans );
+	}
+
+	trace_rows_flush( &rowSpans );
+	threadMemory->transient.free( alphaRow );
+
+	return RESULT_CODE_SUCCESS;
+}
+
+// Merge into a whole image, then write it out
+static RESULT_CODE merge_to_image( const char *paths[ 4 ], ChannelInput *inputs, u32 w, u32 h, const char *outputFile, ThreadPool *pool )
+{
+	u32 outChannels = app.merge.layout;
+	u64 outSize = static_cast<u64>( w ) * h * outChannels;
+	u8 *image = threadMemory->transient.allocate<u8>( outSize );
+
+	if ( !image )
+	{
+		log_warning( "Failed to allocate %llu bytes.", outSize );
+		return RESULT_CODE_FAILED_TO_ALLOCATE_MEMORY_FOR_OUTPUT_IMAGE;
 	}
 
+	RESULT_CODE code = merge_channel_rows( paths, inputs, w, h, image, nullptr, pool );
+
+	if ( code != RESULT_CODE_SUCCESS )
+		return code;
+
 	if ( options.verbose )
 		log( "Finished creating image. Preparing to save to disk." );
 
-	make_directory( options.outputFile );
-
-	if ( !stbi_write_png( options.outputFile, outWidth, outHeight, outChannels, outImage, outWidth * outChannels ) )
+	if ( !png_write( pool, &threadMemory->transient, outputFile, image, w, h, outChannels, { options.compression, options.pngFilter } ) )
 	{
-		log_warning( "Failed to create output image: %s", options.outputFile );
-		return usage_message( RESULT_CODE_FAILED_TO_CREATE_OUTPUT_FILE );
+		log_warning( "Failed to create output image: %s", outputFile );
+		return RESULT_CODE_FAILED_TO_CREATE_OUTPUT_FILE;
 	}
-	else if ( options.verbose )
-		log( "Successfully created output image[ %d x %d ]: %s", outWidth, outHeight, options.outputFile );
 
 	return RESULT_CODE_SUCCESS;
 }
 
+// Merge and write one row at a time, only a few slices of the output are ever in memory
+static RESULT_CODE merge_to_stream( const char *paths[ 4 ], ChannelInput *inputs, u32 w, u32 h, const char *outputFile, ThreadPool *pool )
+{
+	u32 outChannels = app.merge.layout;
+	u8 *row = threadMemory->transient.allocate<u8>( static_cast<u64>( w ) * outChannels );
+
+	if ( !row )
+	{
+		log_warning( "Failed to allocate %llu bytes.", static_cast<u64>( w ) * outChannels );
+		return RESULT_CODE_FAILED_TO_ALLOCATE_MEMORY_FOR_OUTPUT_IMAGE;
+	}
+
+	PngStream stream;
+	RESULT_CODE code = RESULT_CODE_FAILED_TO_CREATE_OUTPUT_FILE;
+
+	if ( png_stream_open( &stream, pool, &threadMemory->transient, outputFile, w, h, outChannels, { options.compression, options.pngFilter } ) )
+		code = merge_channel_rows( paths, inputs, w, h, row, &stream, pool );
+
+	if ( !png_stream_close( &stream, &threadMemory->transient ) && code == RESULT_CODE_SUCCESS )
+		code = RESULT_CODE_FAILED_TO_CREATE_OUTPUT_FILE;
+
+	if ( code == RESULT_CODE_FAILED_TO_CREATE_OUTPUT_FILE )
+		log_warning( "Failed to create output image: %s", outputFile );
+
+	return code;
+}
+
+// PLANNING //////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Only the headers are read, so a job's size and memory are known before anything is decoded.
+
+// Parses a byte count with an optional K, M or G suffix, "3G" and "3221225472" are the same size
+[[nodiscard]] static bool parse_memory_size( const char *text, u64 *size )
+{
+	// strtoull accepts a sign and wraps negative values around
+	if ( text[ 0 ] < '0' || text[ 0 ] > '9' )
+		return false;
+
+	char *end;
+	errno = 0;
+	u64 value = strtoull( text, &end, 10 );
+
+	if ( errno == ERANGE )
+		return false;
+
+	u64 scale = 1;
+
+	switch ( *end )
+	{
+	case 'k': case 'K': scale = KB( 1 ); ++end; break;
+	case 'm': case 'M': scale = MB( 1 ); ++end; break;
+	case 'g': case 'G': scale = GB( 1 ); ++end; break;
+	}
+
+	if ( *end != '\0' || value > UINT64_MAX / scale )
+		return false;
+
+	*size = value * scale;
+
+	return true;
+}
+
+// stb_image's own allocations can't be seen from here, this covers its compressed data growing
+// by doubling and a couple of full decodes at up to 16 bits per channel
+[[nodiscard]] static u64 stb_decode_memory( u64 fileBytes, u32 w, u32 h, u32 channels )
+{
+	u64 decoded = static_cast<u64>( w ) * h * channels * 2 + h;
+
+	return fileBytes * 4 + decoded * 3 + MB( 1 );
+}
+
+// Size, stride and memory of one input, using the png header when it will be streamed
+static RESULT_CODE plan_channel_input( const char *path, u32 *w, u32 *h, u32 *stride, u64 *memory )
+{
+	PngReader reader;
+	PNG_READER_RESULT result = png_reader_info( &reader, path );
+
+	if ( result == PNG_READER_RESULT_OK )
+	{
+		*w = reader.width;
+		*h = reader.height;
+		*stride = reader.stride;
+		*memory = png_reader_memory( reader );
+
+		return RESULT_CODE_SUCCESS;
+	}
+
+	MemoryScope scope( &threadMemory->transient );
+	int iw, ih, ic;
+	u64 fileBytes;
+
+	if ( result == PNG_READER_RESULT_FAILED || !stbi_info( path, &iw, &ih, &ic ) || !file_size( path, &fileBytes ) )
+	{
+		log_warning( "Failed to open file: %s", path );
+		return RESULT_CODE_FAILED_TO_OPEN_INPUT_FILE;
+	}
+
+	*w = static_cast<u32>( iw );
+	*h = static_cast<u32>( ih );
+	*stride = static_cast<u32>( ic );
+
+	// The png reader's buffer is already taken by the time it hands over to stb_image
+	*memory = PNG_READER_BUFFER_SIZE + MEMORY_ALLOCATION_OVERHEAD + stb_decode_memory( fileBytes, *w, *h, *stride );
+
+	return RESULT_CODE_SUCCESS;
+}
+
+// Check a job can run and work out the transient memory it takes. Threads is how many threads
+// write its output, the calling thread included.
+static RESULT_CODE plan_job( MergeJob *job, u32 threads )
+{
+	TraceScope span( "plan job", job->outputFile );
+	const char *paths[ 4 ] = { job->inputFileR, job->inputFileG, job->inputFileB, job->inputFileA };
+	u32 outChannels = app.merge.layout;
+
+	if ( !paths[ 0 ] && !paths[ 1 ] && !paths[ 2 ] && !paths[ 3 ] )
+		return RESULT_CODE_NO_INPUT_FILES;
+
+	// Every input needs a channel in the output
+	for ( u32 c = outChannels; c < 4; ++c )
+	{
+		if ( paths[ c ] )
+			return RESULT_CODE_LAYOUT_DROPS_INPUT;
+	}
+
+	u32 w = 0;
+	u32 h = 0;
+	u64 memory = 0;
+
+	for ( u32 c = 0; c < 4; ++c )
+	{
+		if ( !paths[ c ] )
+			continue;
+
+		u32 inputW, inputH, stride;
+		u64 inputMemory;
+
+		RESULT_CODE code = plan_channel_input( paths[ c ], &inputW, &inputH, &stride, &inputMemory );
+
+		// stb_image may have used some memory to read the header
+		threadMemory->update();
+
+		if ( code != RESULT_CODE_SUCCESS )
+			return code;
+
+		if ( w == 0 )
+		{
+			w = inputW;
+			h = inputH;
+		}
+		else if ( inputW != w || inputH != h )
+		{
+			log_warning( "Input is %u x %u, expected %u x %u: %s", inputW, inputH, w, h, paths[ c ] );
+			return RESULT_CODE_INPUT_FILE_SIZES_DONT_MATCH;
+		}
+
+		memory += inputMemory;
+
+		// On a thread of its own an input also holds a band of decoded rows
+		u64 bandBytes = static_cast<u64>( decode_band_rows( inputW, inputH, stride ) ) * inputW * stride;
+		job->inputMemory[ c ] = inputMemory + bandBytes + MEMORY_ALLOCATION_OVERHEAD;
+
+		// An alpha input with more than one channel is packed into a row first
+		if ( c == 3 && stride > 1 )
+			memory += w + MEMORY_ALLOCATION_OVERHEAD;
+	}
+
+	u64 rowBytes = static_cast<u64>( w ) * outChannels;
+
+	if ( options.stream )
+		memory += rowBytes + MEMORY_ALLOCATION_OVERHEAD + png_stream_memory( w, outChannels, threads, options.pngFilter );
+	else
+		memory += rowBytes * h + MEMORY_ALLOCATION_OVERHEAD + png_write_memory( w, h, outChannels, threads );
+
+	job->memory = memory;
+
+	if ( options.memory && memory > options.memory )
+	{
+		log_warning( "Job [%s] needs %llu bytes, more than -memory %llu", job->outputFile, memory, options.memory );
+		return RESULT_CODE_MEMORY_BUDGET_TOO_SMALL;
+	}
+
+	return RESULT_CODE_SUCCESS;
+}
+
+// Plan every job up front. Jobs that can't run, or need more than a -memory budget, are reported
+// and dropped, the rest are packed to the front. Returns the most memory a single job needs.
+static u64 plan_jobs( MergeJob *jobs, u64 *count, u64 *invalidCount, u32 threads )
+{
+	u64 kept = 0;
+	u64 largest = 0;
+
+	for ( u64 i = 0; i < *count; ++i )
+	{
+		MergeJob job = jobs[ i ];
+		RESULT_CODE code = plan_job( &job, threads );
+
+		if ( code != RESULT_CODE_SUCCESS )
+		{
+			*invalidCount += 1;
+			log_warning( "Job %llu [%s]: %s", job.number, job.outputFile, error_code_string( code ) );
+			continue;
+		}
+
+		if ( options.verbose )
+			log( "Job %llu [%s] needs %llu bytes", job.number, job.outputFile, job.memory );
+
+		largest = job.memory > largest ? job.memory : largest;
+		jobs[ kept++ ] = job;
+	}
+
+	*count = kept;
+
+	return largest;
+}
+
+// CACHE /////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// With -cache each output gets a small file next to it, "<output>.gmcache", holding a hash of the
+// job's input files and output options and the size of the output written. A job whose key still
+// matches, and whose output is still there at that size, is skipped before anything is decoded.
+
+#define CACHE_VERSION		1			// bump when the same inputs and options would write different bytes
+#define CACHE_SUFFIX		".gmcache"
+#define CACHE_READ_CHUNK	KB( 64 )	// read size when hashing a file that can't be mapped
+
+// Everything besides the input files that changes the bytes written
+struct CacheKeyOptions
+{
+	u16 version;
+	u16 goodLength;
+	u16 lazyLength;
+	u16 niceLength;
+	u16 maxChain;
+	u8 strategy;
+	u8 hashBits;
+	u8 zlibLevel;
+	u8 filter;
+	u8 layout;
+	u8 inputs;								// which channels have an input
+};
+
+// Chains the file's contents onto hash. Files that can't be mapped (empty files, pipes, /proc
+// entries, or any file on Windows) are read in chunks, both give the same hash.
+[[nodiscard]] static bool cache_hash_file( const char *path, u64 *hash )
+{
+	MappedFile mapped;
+
+	if ( mapped_file_open( &mapped, path ) )
+	{
+		*hash = hash64( mapped.data, mapped.size, *hash );
+		mapped_file_close( &mapped );
+		return true;
+	}
+
+	FILE *file = fopen( path, "rb" );
+
+	if ( !file )
+		return false;
+
+	Hash64State state;
+	hash64_begin( &state, *hash );
+
+	u8 chunk[ CACHE_READ_CHUNK ];
+	u64 read;
+
+	while ( ( read = fread( chunk, 1, sizeof( chunk ), file ) ) > 0 )
+		hash64_update( &state, chunk, read );
+
+	bool failed = ferror( file ) != 0;
+	fclose( file );
+
+	if ( failed )
+		return false;
+
+	*hash = hash64_end( &state );
+
+	return true;
+}
+
+// False if an input can't be hashed, the job then runs uncached
+[[nodiscard]] static bool cache_job_key( const char *paths[ 4 ], u64 *key )
+{
+	TraceScope span( "cache key" );
+	CacheKeyOptions keyOptions = {};
+	keyOptions.version = CACHE_VERSION;
+	keyOptions.goodLength = options.compression->goodLength;
+	keyOptions.lazyLength = options.compression->lazyLength;
+	keyOptions.niceLength = options.compression->niceLength;
+	keyOptions.maxChain = options.compression->maxChain;
+	keyOptions.strategy = options.compression->strategy;
+	keyOptions.hashBits = options.compression->hashBits;
+	keyOptions.zlibLevel = options.compression->zlibLevel;
+	keyOptions.filter = options.pngFilter;
+	keyOptions.layout = static_cast<u8>( options.layout );
+
+	for ( u32 c = 0; c < 4; ++c )
+		keyOptions.inputs |= paths[ c ] ? BIT( c ) : 0;
+
+	u64 hash = hash64( &keyOptions, sizeof( keyOptions ), 0 );
+
+	for ( u32 c = 0; c < 4; ++c )
+	{
+		if ( !paths[ c ] )
+			continue;
+
+		if ( !cache_hash_file( paths[ c ], &hash ) )
+			return false;
+	}
+
+	*key = hash;
+
+	return true;
+}
+
+static void cache_file_path( char *path, u64 size, const char *outputFile )
+{
+	snprintf( path, size, "%s" CACHE_SUFFIX, outputFile );
+}
+
+[[nodiscard]] static bool cache_up_to_date( const char *outputFile, u64 key )
+{
+	char path[ 4096 + sizeof( CACHE_SUFFIX ) ];
+	cache_file_path( path, sizeof( path ), outputFile );
+
+	FILE *file = fopen( path, "rb" );
+
+	if ( !file )
+		return false;
+
+	u32 version;
+	unsigned long long cachedKey;
+	unsigned long long cachedSize;
+	bool read = fscanf( file, "grey_merger-cache %u %llx %llu", &version, &cachedKey, &cachedSize ) == 3;
+	fclose( file );
+
+	u64 outputSize;
+
+	return read && version == CACHE_VERSION && cachedKey == key && file_size( outputFile, &outputSize ) && outputSize == cachedSize;
+}
+
+// Called once the output is written
+static void cache_record( const char *outputFile, u64 key )
+{
+	char path[ 4096 + sizeof( CACHE_SUFFIX ) ];
+	cache_file_path( path, sizeof( path ), outputFile );
+
+	u64 outputSize;
+	FILE *file = file_size( outputFile, &outputSize ) ? fopen( path, "wb" ) : nullptr;
+
+	if ( !file )
+	{
+		log_warning( "Failed to write cache file: %s", path );
+		return;
+	}
+
+	fprintf( file, "grey_merger-cache %u %016llx %llu\n", CACHE_VERSION, static_cast<unsigned long long>( key ), static_cast<unsigned long long>( outputSize ) );
+	fclose( file );
+}
+
+// Called before the output is rewritten, so a failed job never looks up to date
+static void cache_forget( const char *outputFile )
+{
+	char path[ 4096 + sizeof( CACHE_SUFFIX ) ];
+	cache_file_path( path, sizeof( path ), outputFile );
+
+	remove( path );
+}
+
+// The single job the -channel and -o options describe
+static RESULT_CODE options_job( MergeJob *job )
+{
+	if ( !options.redChannel && !options.greenChannel && !options.blueChannel && !options.alphaChannel )
+		return RESULT_CODE_NO_INPUT_FILES;
+
+	// Create an output filename if one was not provided
+	if ( options.outputFile[ 0 ] == '\0' )
+	{
+		string_append( options.outputFile, sizeof( options.outputFile ), "output.png" );
+
+		if ( options.verbose )
+			log( "Output file automatically assigned filename: %s", options.outputFile );
+	}
+
+	*job =
+	{
+		.inputFileR = options.redChannel ? options.inputFileR : nullptr,
+		.inputFileG = options.greenChannel ? options.inputFileG : nullptr,
+		.inputFileB = options.blueChannel ? options.inputFileB : nullptr,
+		.inputFileA = options.alphaChannel ? options.inputFileA : nullptr,
+		.outputFile = options.outputFile,
+	};
+
+	return RESULT_CODE_SUCCESS;
+}
+
+static RESULT_CODE run_job( const MergeJob &job )
+{
+	TraceScope span( "job", job.outputFile );
+
+	if ( !job.inputFileR && !job.inputFileG && !job.inputFileB && !job.inputFileA )
+	{
+		return RESULT_CODE_NO_INPUT_FILES;
+	}
+
+	if ( options.verbose )
+	{
+		if ( job.inputFileR )
+			log( "Channel Red Input file: %s", job.inputFileR );
+
+		if ( job.inputFileG )
+			log( "Channel Green Input file: %s", job.inputFileG );
+
+		if ( job.inputFileB )
+			log( "Channel Blue Input file: %s", job.inputFileB );
+
+		if ( job.inputFileA )
+			log( "Channel Alpha Input file: %s", job.inputFileA );
+	}
+
+	const char *paths[ 4 ] = { job.inputFileR, job.inputFileG, job.inputFileB, job.inputFileA };
+	u64 cacheKey = 0;
+	bool cached = options.cache && cache_job_key( paths, &cacheKey );
+
+	if ( options.cache && !cached )
+		log_warning( "Couldn't hash the inputs, running uncached: %s", job.outputFile );
+
+	if ( cached && cache_up_to_date( job.outputFile, cacheKey ) )
+	{
+		if ( options.verbose )
+			log( "Output is up to date, skipped: %s", job.outputFile );
+
+		return RESULT_CODE_SUCCESS;
+	}
+
+	if ( cached )
+		cache_forget( job.outputFile );
+
+	ChannelInput inputs[ 4 ];
+	u32 w = 0;
+	u32 h = 0;
+
+	// Batch jobs already keep every thread busy, a lone job spreads its decoding and compression over the pool
+	bool multiJob = options.batchFile || options.scanDirectory;
+	ThreadPool *pool = multiJob ? nullptr : &app.pool;
+
+	RESULT_CODE code = open_channel_inputs( paths, inputs, &w, &h, pool, job.inputMemory );
+
+	if ( code == RESULT_CODE_SUCCESS )
+	{
+		make_directory( job.outputFile );
+
+		if ( options.stream )
+			code = merge_to_stream( paths, inputs, w, h, job.outputFile, pool );
+		else
+			code = merge_to_image( paths, inputs, w, h, job.outputFile, pool );
+	}
+
+	for ( u32 c = 0; c < 4; ++c )
+	{
+		png_reader_close( &inputs[ c ].png );
+		inputs[ c ].memory.free();
+
+		if ( inputs[ c ].cached )
+			image_cache_release( &app.imageCache, inputs[ c ].cached );
+	}
+
+	if ( code != RESULT_CODE_SUCCESS )
+		return code;
+
+	if ( cached )
+		cache_record( job.outputFile, cacheKey );
+
+	if ( options.verbose )
+		log( "Successfully created output image[ %d x %d ]: %s", w, h, job.outputFile );
+
+	return RESULT_CODE_SUCCESS;
+}
+
+// Parse a manifest line "<red> <green> <blue> [<alpha>] <output>". A "-" marks an unused channel.
+static RESULT_CODE parse_batch_line( char *line, MergeJob *job )
+{
+	const char *delimiters = " \t";
+	const char *tokens[ 5 ];
+	u64 tokenCount = 0;
+	const char *token;
+
+	line = string_tokenise( line, delimiters, &token, nullptr );
+
+	while ( token )
+	{
+		if ( tokenCount == array_length( tokens ) )
+			return RESULT_CODE_INVALID_BATCH_JOB;
+
+		tokens[ tokenCount++ ] = token;
+
+		line = string_tokenise( line, delimiters, &token, nullptr );
+	}
+
+	if ( tokenCount < 4 || strcmp( tokens[ tokenCount - 1 ], "-" ) == 0 )
+		return RESULT_CODE_INVALID_BATCH_JOB;
+
+	job->inputFileR = strcmp( tokens[ 0 ], "-" ) != 0 ? tokens[ 0 ] : nullptr;
+	job->inputFileG = strcmp( tokens[ 1 ], "-" ) != 0 ? tokens[ 1 ] : nullptr;
+	job->inputFileB = strcmp( tokens[ 2 ], "-" ) != 0 ? tokens[ 2 ] : nullptr;
+	job->inputFileA = tokenCount == 5 && strcmp( tokens[ 3 ], "-" ) != 0 ? tokens[ 3 ] : nullptr;
+	job->outputFile = tokens[ tokenCount - 1 ];
+
+	return RESULT_CODE_SUCCESS;
+}
+
+struct BatchContext
+{
+	MergeJob *jobs = nullptr;
+	u64 count = 0;
+	std::atomic<u64> next = 0;
+	std::atomic<u64> failed = 0;
+};
+
+// Each worker pulls jobs until the batch runs dry
+static void batch_worker( void *data )
+{
+	BatchContext *batch = static_cast<BatchContext *>( data );
+
+	for ( u64 index = batch->next++; index < batch->count; index = batch->next++ )
+	{
+		const MergeJob &job = batch->jobs[ index ];
+
+		RESULT_CODE code = run_job( job );
+
+		// Everything the job allocated is finished with
+		threadMemory->update();
+
+		if ( code != RESULT_CODE_SUCCESS )
+		{
+			batch->failed += 1;
+			log_warning( "Job %llu [%s]: %s", job.number, job.outputFile, error_code_string( code ) );
+		}
+		else
+		{
+			log( "Job %llu [%s]: %s", job.number, job.outputFile, error_code_string( code ) );
+		}
+	}
+}
+
+// Runs every job on the worker pool and reports each result
+static RESULT_CODE run_jobs( MergeJob *jobs, u64 count, u64 invalidCount )
+{
+	BatchContext batch;
+	batch.jobs = jobs;
+	batch.count = count;
+
+	// One puller per job slot, the calling thread runs one of them while it waits
+	TaskGroup group;
+
+	for ( u32 i = 0; i < options.jobs; ++i )
+		app.pool.submit( &group, batch_worker, &batch );
+
+	app.pool.wait( &group );
+
+	u64 failedCount = batch.failed + invalidCount;
+
+	log( "Batch finished: %llu jobs, %llu failed", count + invalidCount, failedCount );
+
+	if ( app.imageCache.capacity )
+		log( "Image cache: %llu hits, %llu misses", app.imageCache.hits, app.imageCache.misses );
+
+	return failedCount == 0 ? RESULT_CODE_SUCCESS : RESULT_CODE_BATCH_JOB_FAILED;
+}
+
+// Adds every valid job in the manifest to jobs. False only if jobs ran out of room.
+[[nodiscard]] static bool parse_batch( char *manifest, DynamicArray<MergeJob> *jobs, u64 *invalidCount )
+{
+	u64 lineNumber = 0;
+
+	// Split on every newline rather than string_tokenise, which skips blank lines and loses the line numbers
+	for ( char *line = manifest, *next; line; line = next )
+	{
+		char *end = line + string_span( line, "\r\n" );
+		next = *end != '\0' ? end + ( end[ 0 ] == '\r' && end[ 1 ] == '\n' ? 2 : 1 ) : nullptr;
+		*end = '\0';
+		lineNumber += 1;
+
+		// Skip blank lines and comments
+		line += string_nspan( line, " \t" );
+
+		if ( line[ 0 ] == '\0' || line[ 0 ] == '#' )
+			continue;
+
+		MergeJob job;
+
+		if ( parse_batch_line( line, &job ) != RESULT_CODE_SUCCESS )
+		{
+			*invalidCount += 1;
+
+			// The line was split into tokens by parse_batch_line, report where it is instead
+			log_warning( "Invalid batch line %llu: %s", lineNumber, error_code_string( RESULT_CODE_INVALID_BATCH_JOB ) );
+			continue;
+		}
+
+		job.number = lineNumber;
+
+		if ( !jobs->add( job ) )
+		{
+			log_error( "Out of memory adding batch line %llu", lineNumber );
+			return false;
+		}
+	}
+
+	return true;
+}
+
+[[nodiscard]] static char *string_join( Allocator *allocator, const char *a, const char *b, u64 bLength, const char *c )
+{
+	u64 aLength = strlen( a );
+	u64 cLength = strlen( c );
+
+	char *str = allocator->allocate<char>( aLength + bLength + cLength + 1 );
+
+	if ( !str )
+		return nullptr;
+
+	memcpy( str, a, aLength );
+	memcpy( str + aLength, b, bLength );
+	memcpy( str + aLength + bLength, c, cLength );
+	str[ aLength + bLength + cLength ] = '\0';
+
+	return str;
+}
+
+[[nodiscard]] static bool string_ends_with( const char *str, u64 length, const char *suffix, bool ignoreCase )
+{
+	u64 suffixLength = strlen( suffix );
+
+	if ( suffixLength > length )
+		return false;
+
+	str += length - suffixLength;
+
+	for ( u64 i = 0; i < suffixLength; ++i )
+	{
+		char a = str[ i ];
+		char b = suffix[ i ];
+
+		if ( ignoreCase )
+		{
+			a = ( a >= 'A' && a <= 'Z' ) ? a - 'A' + 'a' : a;
+			b = ( b >= 'A' && b <= 'Z' ) ? b - 'A' + 'a' : b;
+		}
+
+		if ( a != b )
+			return false;
+	}
+
+	return true;
+}
+
+[[nodiscard]] static bool is_directory( const char *path, const dirent *entry )
+{
+	#ifndef PLATFORM_WINDOWS
+		// Some file systems don't fill in d_type
+		if ( entry->d_type == DT_UNKNOWN )
+		{
+			struct stat info;
+			return stat( path, &info ) == 0 && S_ISDIR( info.st_mode );
+		}
+	#endif
+
+	return entry->d_type == DT_DIR;
+}
+
+// Add a file to the scan index if its name ends in one of the channel suffixes.
+// Path is the last allocation and is given back if the file isn't used. False if out of room.
+[[nodiscard]] static bool scan_add_file( ScanIndex *index, Allocator *allocator, char *path, const char *directory, const char *name )
+{
+	u64 length = strlen( name );
+
+	// Prefer the longest matching suffix, so "_gb" wins over "_b"
+	i32 channel = -1;
+	u64 suffixLength = 0;
+
+	if ( string_ends_with( name, length, ".png", true ) )
+	{
+		length -= 4;
+
+		for ( i32 c = 0; c < 4; ++c )
+		{
+			const char *suffix = options.scanSuffix[ c ];
+
+			if ( suffix && string_ends_with( name, length, suffix, false ) && strlen( suffix ) >= suffixLength )
+			{
+				channel = c;
+				suffixLength = strlen( suffix );
+			}
+		}
+	}
+
+	if ( channel < 0 )
+	{
+		allocator->free( path );
+		return true;
+	}
+
+	char *stem = string_join( allocator, directory, name, length - suffixLength, "" );
+
+	if ( !stem )
+	{
+		log_error( "Out of memory scanning: %s", path );
+		return false;
+	}
+
+	ScanIndex::Entry *entry = index->find( stem );
+
+	if ( entry )
+	{
+		// The stem is already indexed, give back the copy
+		allocator->free( stem );
+	}
+	else
+	{
+		entry = index->push( stem );
+
+		if ( !entry )
+		{
+			log_error( "Out of memory indexing %llu channel sets: %s", index->count(), path );
+			return false;
+		}
+
+		entry->value = {};
+	}
+
+	entry->value.files[ channel ] = path;
+
+	return true;
+}
+
+// Directory must end in a separator. A directory that can't be opened is skipped, running out of
+// room stops the scan and returns false, rather than quietly leaving files out.
+[[nodiscard]] static bool scan_directory( ScanIndex *index, Allocator *allocator, const char *directory )
+{
+	DIR *dir = opendir( directory );
+
+	if ( !dir )
+	{
+		log_warning( "Failed to open directory: %s", directory );
+		return true;
+	}
+
+	bool scanned = true;
+
+	while ( dirent *entry = readdir( dir ) )
+	{
+		if ( strcmp( entry->d_name, "." ) == 0 || strcmp( entry->d_name, ".." ) == 0 )
+			continue;
+
+		char *path = string_join( allocator, directory, entry->d_name, strlen( entry->d_name ), "" );
+
+		if ( !path )
+		{
+			log_error( "Out of memory scanning: %s", directory );
+			scanned = false;
+			break;
+		}
+
+		if ( is_directory( path, entry ) )
+		{
+			allocator->free( path );
+
+			char *subDirectory = string_join( allocator, directory, entry->d_name, strlen( entry->d_name ), "/" );
+
+			if ( !subDirectory )
+				log_error( "Out of memory scanning: %s", directory );
+
+			scanned = subDirectory && scan_directory( index, allocator, subDirectory );
+		}
+		else
+		{
+			scanned = scan_add_file( index, allocator, path, directory, entry->d_name );
+		}
+
+		if ( !scanned )
+			break;
+	}
+
+	closedir( dir );
+
+	return scanned;
+}
+
+[[nodiscard]] static bool scan_set_complete( const ScanSet &set )
+{
+	for ( u32 c = 0; c < 4; ++c )
+		if ( options.scanSuffix[ c ] && !set.files[ c ] )
+			return false;
+
+	return true;
+}
+
+// A job for every complete channel set in the index, numbered in the order the sets were found
+[[nodiscard]] static RESULT_CODE scan_create_jobs( const ScanIndex &index, Allocator *allocator, DynamicArray<MergeJob> *jobs )
+{
+	u64 completeCount = 0;
+
+	for ( u64 i = 0; i < index.count(); ++i )
+		completeCount += scan_set_complete( index.values[ i ].value ) ? 1 : 0;
+
+	// Room for every job up front, so the output names joined after the list never make it move
+	if ( !jobs->init( allocator, completeCount > 0 ? completeCount : 1 ) )
+	{
+		log_error( "Out of memory creating scan jobs" );
+		return RESULT_CODE_FAILED_TO_SCAN_DIRECTORY;
+	}
+
+	for ( u64 i = 0; i < index.count(); ++i )
+	{
+		const ScanIndex::Entry &entry = index.values[ i ];
+
+		if ( !scan_set_complete( entry.value ) )
+		{
+			if ( options.verbose )
+				log( "Skipping incomplete channel set: %s", entry.key );
+			continue;
+		}
+
+		MergeJob job;
+		job.inputFileR = entry.value.files[ 0 ];
+		job.inputFileG = entry.value.files[ 1 ];
+		job.inputFileB = entry.value.files[ 2 ];
+		job.inputFileA = entry.value.files[ 3 ];
+		job.outputFile = string_join( allocator, entry.key, options.scanOutputSuffix, strlen( options.scanOutputSuffix ), ".png" );
+		job.number = jobs->count + 1;
+
+		if ( !job.outputFile )
+		{
+			log_error( "Out of memory creating scan jobs" );
+			return RESULT_CODE_FAILED_TO_SCAN_DIRECTORY;
+		}
+
+		jobs->add_no_bounds_check( job );
+	}
+
+	return RESULT_CODE_SUCCESS;
+}
+
+// Walk the directory tree once and create a job for every complete channel set. Paths and jobs
+// come from allocator, the index lives in an arena of its own that's gone once the jobs exist.
+static RESULT_CODE scan_jobs( const char *directory, Allocator *allocator, DynamicArray<MergeJob> *jobs )
+{
+	TraceScope span( "scan", directory );
+
+	// Keep the paths joinable by making sure the root ends in a separator
+	u64 length = strlen( directory );
+	bool separator = length > 0 && ( directory[ length - 1 ] == '/' || directory[ length - 1 ] == '\\' );
+	char *root = string_join( allocator, directory, "/", separator ? 0 : 1, "" );
+
+	DIR *dir = root ? opendir( root ) : nullptr;
+
+	if ( !dir )
+	{
+		log_warning( "Failed to open directory: %s", directory );
+		return RESULT_CODE_FAILED_TO_SCAN_DIRECTORY;
+	}
+
+	closedir( dir );
+
+	// Entries and buckets in allocators of their own, so both grow in place
+	MemoryArena indexMemory = create_memory_arena( "scan index" );
+	ScanIndex index;
+	RESULT_CODE code = RESULT_CODE_FAILED_TO_SCAN_DIRECTORY;
+
+	if ( !indexMemory.init_virtual( SCAN_INDEX_MEMORY, SCAN_INDEX_MEMORY, 0 ) || !index.init( &indexMemory.permanent, 0, &indexMemory.transient ) )
+		log_error( "Out of memory creating the scan index" );
+	else if ( scan_directory( &index, allocator, root ) )
+		code = scan_create_jobs( index, allocator, jobs );
+
+	indexMemory.free();
+
+	return code;
+}
+
+static void worker_thread_start( u32 index )
+{
+	threadMemory = &app.workerMemory[ index ];
+}
+
+// Every worker owns an arena, the calling thread uses app.jobMemory
+[[nodiscard]] static bool start_workers( u64 workerCount, u64 workerMemory )
+{
+	TraceScope span( "arena init", "workers" );
+
+	if ( workerCount == 0 )
+		return true;
+
+	app.workerMemory = app.memory.permanent.allocate<MemoryArena>( workerCount );
+
+	if ( !app.workerMemory )
+		return false;
+
+	app.workerCount = workerCount;
+
+	for ( u64 i = 0; i < workerCount; ++i )
+	{
+		app.workerMemory[ i ] = create_memory_arena( "worker" );
+
+		if ( !app.workerMemory[ i ].init_virtual( 0, workerMemory, 0 ) )
+		{
+			log_error( "Failed to initialise memory for worker %llu", i );
+			return false;
+		}
+	}
+
+	return app.pool.init( static_cast<u32>( workerCount ), worker_thread_start );
+}
+
+// Name groups the arena's -memory-stats with others of the same name
+static MemoryArena create_memory_arena( const char *name )
+{
+	MemoryArena arena = {};
+
+	Allocator *bumpAllocators[] = { &arena.permanent, &arena.transient };
+
+	for ( Allocator *allocator : bumpAllocators )
+	{
+		allocator->allocate_func = memory_bump_allocate;
+		allocator->reallocate_func = memory_bump_reallocate;
+		allocator->shrink_func = memory_bump_shrink;
+		allocator->free_func = memory_bump_free;
+		allocator->attach_func = memory_bump_attach;
+	}
+
+	arena.fastBump.allocate_func = memory_fast_bump_allocate;
+	arena.name = name;
+
+	return arena;
+}
+
+// Logs -memory-stats for every arena freed so far and every one still in use.
+// Peak is the most an arena of that name ever needed, the figure to size -memory by.
+static void report_memory_stats()
+{
+	if ( !memoryStats.enabled )
+		return;
+
+	MemoryStatsTotals totals;
+
+	{
+		std::lock_guard<std::mutex> lock( memoryStats.mutex );
+		totals = memoryStats.freed;
+	}
+
+	memory_stats_add( &totals, app.memory );
+	memory_stats_add( &totals, app.jobMemory );
+	memory_stats_add( &totals, trace.memory );
+
+	for ( u64 i = 0; i < app.workerCount; ++i )
+		memory_stats_add( &totals, app.workerMemory[ i ] );
+
+	static const char *allocatorNames[ 2 ] = { "permanent", "transient" };
+
+	for ( u32 t = 0; t < totals.count; ++t )
+	{
+		const MemoryStatsTotal &total = totals.totals[ t ];
+
+		for ( u32 a = 0; a < 2; ++a )
+		{
+			const MemoryStats &stats = total.stats[ a ];
+
+			if ( stats.allocations == 0 && stats.failures == 0 )
+				continue;
+
+			log( "Memory stats %s.%s: arenas=%llu capacity=%llu peak=%llu requested=%llu largest=%llu allocations=%llu reallocations=%llu moves=%llu copied=%llu frees=%llu unreclaimed=%llu unreclaimed_bytes=%llu overhead=%llu failures=%llu largest_failure=%llu",
+				total.name, allocatorNames[ a ], total.arenas, total.capacity[ a ], stats.peak, stats.requested, stats.largest, stats.allocations, stats.reallocations,
+				stats.moves, stats.copied, stats.frees, stats.unreclaimed, stats.unreclaimedBytes, stats.overhead, stats.failures, stats.largestFailure );
+		}
+	}
+}
+
+// Rewrites the -trace file with every span recorded so far
+static void write_trace()
+{
+	if ( !trace.enabled )
+		return;
+
+	if ( !trace_write( options.tracePath ) )
+		log_warning( "Failed to write trace file: %s", options.tracePath );
+	else if ( trace.dropped )
+		log_warning( "Trace memory ran out, %llu spans were dropped", trace.dropped );
+}
+
+// -------------------------------------------------------------------------
+// COMMANDS
+// -------------------------------------------------------------------------
+// Built by the compiler, looking a command up is one hash and one compare
+static constexpr auto commands = frozen_map<CommandFunc>( {
+	{ "-v", [] ( int &index, int argc, const char *argv[] )
+		{
+			options.verbose = true;
+
+			return RESULT_CODE_SUCCESS;
+		} },
+
+	{ "-ra", [] ( int &index, int argc, const char *argv[] )
+		{
+			log( "Arguments received [#%d]", argc );
+			for ( int i = 0; i < argc; ++i )
+				log( " [%d] = %s", i, argv[ i ] );
+
+			return RESULT_CODE_SUCCESS;
+		} },
+
+	{ "-wd", [] ( int &index, int argc, const char *argv[] )
+		{
+			options.workingDirectory = argv[ ++index ];
+
+			return RESULT_CODE_SUCCESS;
+		} },
+
+	{ "-channel-r", [] ( int &index, int argc, const char *argv[] )
+		{
+			options.redChannel = true;
+
+			string_copy( options.inputFileR, sizeof( options.inputFileR ), argv[ ++index ] );
+
+			return RESULT_CODE_SUCCESS;
+		} },
+
+	{ "-channel-g", [] ( int &index, int argc, const char *argv[] )
+		{
+			options.greenChannel = true;
+
+			string_copy( options.inputFileG, sizeof( options.inputFileG ), argv[ ++index ] );
+
+			return RESULT_CODE_SUCCESS;
+		} },
+
+	{ "-channel-b", [] ( int &index, int argc, const char *argv[] )
+		{
+			options.blueChannel = true;
+
+			string_copy( options.inputFileB, sizeof( options.inputFileB ), argv[ ++index ] );
+
+			return RESULT_CODE_SUCCESS;
+		} },
+
+	{ "-channel-a", [] ( int &index, int argc, const char *argv[] )
+		{
+			options.alphaChannel = true;
+
+			string_copy( options.inputFileA, sizeof( options.inputFileA ), argv[ ++index ] );
+
+			return RESULT_CODE_SUCCESS;
+		} },
+
+	{ "-layout", [] ( int &index, int argc, const char *argv[] )
+		{
+			static constexpr auto layouts = frozen_map<MERGE_LAYOUT>( {
+				{ "grey", MERGE_LAYOUT_GREY },
+				{ "rg", MERGE_LAYOUT_RG },
+				{ "rgb", MERGE_LAYOUT_RGB },
+				{ "rgba", MERGE_LAYOUT_RGBA },
+			} );
+
+			const MERGE_LAYOUT *layout = layouts.get_value( argv[ ++index ] );
+
+			if ( !layout )
+				return RESULT_CODE_INVALID_LAYOUT;
+
+			options.layout = *layout;
+
+			return RESULT_CODE_SUCCESS;
+		} },
+
+	{ "-o", [] ( int &index, int argc, const char *argv[] )
+		{
+			string_copy( options.outputFile, sizeof( options.outputFile ), argv[ ++index ] );
+
+			return RESULT_CODE_SUCCESS;
+		} },
+
+	{ "-memory", [] ( int &index, int argc, const char *argv[] )
+		{
+			if ( !parse_memory_size( argv[ ++index ], &options.memory ) )
+				return RESULT_CODE_INVALID_MEMORY_SIZE;
+
+			return RESULT_CODE_SUCCESS;
+		} },
+
+	{ "-compression", [] ( int &index, int argc, const char *argv[] )
+		{
+			static constexpr auto levels = frozen_map<const DeflateLevel *>( {
+				{ "store", &deflateLevels[ 0 ] },
+				{ "fast", &deflateRle },
+				{ "huffman", &deflateHuffmanOnly },
+				{ "0", &deflateLevels[ 0 ] },
+				{ "1", &deflateLevels[ 1 ] },
+				{ "2", &deflateLevels[ 2 ] },
+				{ "3", &deflateLevels[ 3 ] },
+				{ "4", &deflateLevels[ 4 ] },
+				{ "5", &deflateLevels[ 5 ] },
+				{ "6", &deflateLevels[ 6 ] },
+				{ "7", &deflateLevels[ 7 ] },
+				{ "8", &deflateLevels[ 8 ] },
+				{ "9", &deflateLevels[ 9 ] },
+			} );
+
+			const DeflateLevel *const *level = levels.get_value( argv[ ++index ] );
+
+			if ( !level )
+				return RESULT_CODE_INVALID_COMPRESSION_LEVEL;
+
+			options.compression = *level;
+
+			return RESULT_CODE_SUCCESS;
+		} },
+
+	{ "-png-filter", [] ( int &index, int argc, const char *argv[] )
+		{
+			static constexpr auto modes = frozen_map<PNG_FILTER_MODE>( {
+				{ "exhaustive", PNG_FILTER_MODE_EXHAUSTIVE },
+				{ "sampled", PNG_FILTER_MODE_SAMPLED },
+				{ "none", PNG_FILTER_MODE_NONE },
+				{ "sub", PNG_FILTER_MODE_SUB },
+				{ "up", PNG_FILTER_MODE_UP },
+				{ "average", PNG_FILTER_MODE_AVERAGE },
+				{ "paeth", PNG_FILTER_MODE_PAETH },
+			} );
+
+			const PNG_FILTER_MODE *mode = modes.get_value( argv[ ++index ] );
+
+			if ( !mode )
+				return RESULT_CODE_INVALID_PNG_FILTER;
+
+			options.pngFilter = *mode;
+
+			return RESULT_CODE_SUCCESS;
+		} },
+
+	{ "-stream", [] ( int &index, int argc, const char *argv[] )
+		{
+			options.stream = true;
+
+			return RESULT_CODE_SUCCESS;
+		} },
+
+	{ "-image-cache", [] ( int &index, int argc, const char *argv[] )
+		{
+			if ( !parse_memory_size( argv[ ++index ], &options.imageCache ) )
+				return RESULT_CODE_INVALID_MEMORY_SIZE;
+
+			return RESULT_CODE_SUCCESS;
+		} },
+
+	{ "-trace", [] ( int &index, int argc, const char *argv[] )
+		{
+			options.tracePath = argv[ ++index ];
+
+			return RESULT_CODE_SUCCESS;
+		} },
+
+	{ "-memory-stats", [] ( int &index, int argc, const char *argv[] )
+		{
+			options.memoryStats = true;
+
+			return RESULT_CODE_SUCCESS;
+		} },
+
+	{ "-cache", [] ( int &index, int argc, const char *argv[] )
+		{
+			options.cache = true;
+
+			return RESULT_CODE_SUCCESS;
+		} },
+
+	{ "-jobs", [] ( int &index, int argc, const char *argv[] )
+		{
+			int jobs = atoi( argv[ ++index ] );
+
+			if ( jobs <= 0 )
+				jobs = static_cast<int>( std::thread::hardware_concurrency() );
+
+			options.jobs = jobs < 1 ? 1 : ( jobs > THREAD_POOL_MAX_THREADS ? THREAD_POOL_MAX_THREADS : jobs );
+
+			return RESULT_CODE_SUCCESS;
+		} },
+
+	{ "-scan", [] ( int &index, int argc, const char *argv[] )
+		{
+			options.scanDirectory = argv[ ++index ];
+
+			return RESULT_CODE_SUCCESS;
+		} },
+
+	{ "-scan-suffix-r", [] ( int &index, int argc, const char *argv[] )
+		{
+			const char *suffix = argv[ ++index ];
+			options.scanSuffix[ 0 ] = strcmp( suffix, "-" ) != 0 ? suffix : nullptr;
+
+			return RESULT_CODE_SUCCESS;
+		} },
+
+	{ "-scan-suffix-g", [] ( int &index, int argc, const char *argv[] )
+		{
+			const char *suffix = argv[ ++index ];
+			options.scanSuffix[ 1 ] = strcmp( suffix, "-" ) != 0 ? suffix : nullptr;
+
+			return RESULT_CODE_SUCCESS;
+		} },
+
+	{ "-scan-suffix-b", [] ( int &index, int argc, const char *argv[] )
+		{
+			const char *suffix = argv[ ++index ];
+			options.scanSuffix[ 2 ] = strcmp( suffix, "-" ) != 0 ? suffix : nullptr;
+
+			return RESULT_CODE_SUCCESS;
+		} },
+
+	{ "-scan-suffix-a", [] ( int &index, int argc, const char *argv[] )
+		{
+			const char *suffix = argv[ ++index ];
+			options.scanSuffix[ 3 ] = strcmp( suffix, "-" ) != 0 ? suffix : nullptr;
+
+			return RESULT_CODE_SUCCESS;
+		} },
+
+	{ "-scan-output", [] ( int &index, int argc, const char *argv[] )
+		{
+			options.scanOutputSuffix = argv[ ++index ];
+
+			return RESULT_CODE_SUCCESS;
+		} },
+
+	{ "-batch", [] ( int &index, int argc, const char *argv[] )
+		{
+			options.batchFile = argv[ ++index ];
+
+			return RESULT_CODE_SUCCESS;
+		} },
+
+	{ "-serve", [] ( int &index, int argc, const char *argv[] )
+		{
+			options.serveSocket = argv[ ++index ];
+
+			return RESULT_CODE_SUCCESS;
+		} },
+} );
+
+// -------------------------------------------------------------------------
+// SERVE
+// -------------------------------------------------------------------------
+// -serve keeps the process, its pool and its arenas warm between merges. Clients connect to a unix
+// socket and send one request per line, made of the same commands as the command line, and get a
+// line back for each: "<result code name> <result code> <milliseconds>". Options given to the
+// server are the defaults for every request. Files can also be passed as descriptors, memfds say,
+// over SCM_RIGHTS with a request and are named fd:0, fd:1... in the order they arrived.
+
+#define SERVE_REQUEST_SIZE		KB( 16 )
+#define SERVE_MAX_ARGUMENTS		64
+#define SERVE_MAX_FDS			8
+#define SERVE_MEMORY			GB( 16 )	// address space reserved for requests when -memory isn't given
+
+#ifndef PLATFORM_WINDOWS
+
+// Options that shape the server itself rather than one merge
+static const char *serveFixedCommands[] = { "-serve", "-batch", "-scan", "-jobs", "-memory", "-image-cache", "-trace", "-memory-stats", "-wd" };
+
+static RESULT_CODE serve_request( char *line, const int *fds, u32 fdCount )
+{
+	TraceScope span( "request" );
+	const char *argv[ SERVE_MAX_ARGUMENTS + 1 ];
+	char fdPaths[ SERVE_MAX_ARGUMENTS ][ 32 ];
+	int argc = 0;
+	const char *token;
+
+	argv[ argc++ ] = options.programName;
+	line = string_tokenise( line, " \t\r", &token, nullptr );
+
+	while ( token )
+	{
+		if ( argc == SERVE_MAX_ARGUMENTS )
+			return RESULT_CODE_INVALID_SERVE_REQUEST;
+
+		if ( strncmp( token, "fd:", 3 ) == 0 )
+		{
+			int fd = atoi( token + 3 );
+
+			if ( fd < 0 || static_cast<u32>( fd ) >= fdCount )
+			{
+				log_warning( "Request names %s but %u descriptors were sent", token, fdCount );
+				return RESULT_CODE_INVALID_SERVE_REQUEST;
+			}
+
+			snprintf( fdPaths[ argc ], sizeof( fdPaths[ argc ] ), "/proc/self/fd/%d", fds[ fd ] );
+			token = fdPaths[ argc ];
+		}
+
+		argv[ argc++ ] = token;
+		line = string_tokenise( line, " \t\r", &token, nullptr );
+	}
+
+	// Commands read their argument unchecked, a missing one reads as empty
+	argv[ argc ] = "";
+
+	for ( int i = 1; i < argc; ++i )
+	{
+		for ( const char *fixed : serveFixedCommands )
+		{
+			if ( strcmp( argv[ i ], fixed ) == 0 )
+			{
+				log_warning( "%s can't be changed by a request", fixed );
+				return RESULT_CODE_INVALID_SERVE_REQUEST;
+			}
+		}
+
+		auto f = commands.find( argv[ i ] );
+
+		if ( !f )
+		{
+			log_warning( "Unknown command: %s", argv[ i ] );
+			return RESULT_CODE_UNKNOWN_OPTIONAL_COMMAND;
+		}
+
+		RESULT_CODE code = f->value( i, argc, argv );
+
+		if ( code != RESULT_CODE_SUCCESS )
+			return code;
+	}
+
+	merge_build_table( &app.merge, cpu_features(), options.layout );
+
+	MergeJob job;
+	RESULT_CODE code = options_job( &job );
+
+	if ( code == RESULT_CODE_SUCCESS )
+		code = plan_job( &job, options.jobs );
+
+	if ( code == RESULT_CODE_SUCCESS && job.memory > app.jobMemory.transient.capacity )
+	{
+		log_warning( "Job [%s] needs %llu bytes, more than the %llu reserved", job.outputFile, job.memory, app.jobMemory.transient.capacity );
+		code = RESULT_CODE_MEMORY_BUDGET_TOO_SMALL;
+	}
+
+	if ( code == RESULT_CODE_SUCCESS )
+		code = run_job( job );
+
+	return code;
+}
+
+// One line per request, "<code name> <code> <milliseconds>"
+static void serve_reply( int client, RESULT_CODE code, f64 ms )
+{
+	char reply[ 128 ];
+	int replyLength = snprintf( reply, sizeof( reply ), "%s %u %.3f\n", error_code_string( code ), code, ms );
+
+	send( client, reply, static_cast<u64>( replyLength ), MSG_NOSIGNAL );
+}
+
+// Answers every request on a connection until the client hangs up
+static void serve_connection( int client )
+{
+	char buffer[ SERVE_REQUEST_SIZE ];
+	u64 length = 0;
+	int fds[ SERVE_MAX_FDS ];
+	u32 fdCount = 0;
+
+	// A request too long for the buffer is refused and drops the connection
+	while ( length < sizeof( buffer ) )
+	{
+		alignas( cmsghdr ) char control[ CMSG_SPACE( sizeof( int ) * SERVE_MAX_FDS ) ];
+		iovec io = { buffer + length, sizeof( buffer ) - length };
+		msghdr message = {};
+		message.msg_iov = &io;
+		message.msg_iovlen = 1;
+		message.msg_control = control;
+		message.msg_controllen = sizeof( control );
+
+		ssize_t received = recvmsg( client, &message, 0 );
+
+		if ( received < 0 && errno == EINTR )
+			continue;
+
+		if ( received <= 0 )
+			break;
+
+		// Descriptors belong to the request being read when they arrive
+		for ( cmsghdr *c = CMSG_FIRSTHDR( &message ); c; c = CMSG_NXTHDR( &message, c ) )
+		{
+			if ( c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS )
+				continue;
+
+			u64 count = ( c->cmsg_len - CMSG_LEN( 0 ) ) / sizeof( int );
+			int *data = reinterpret_cast<int *>( CMSG_DATA( c ) );
+
+			for ( u64 i = 0; i < count; ++i )
+			{
+				if ( fdCount < SERVE_MAX_FDS )
+					fds[ fdCount++ ] = data[ i ];
+				else
+					close( data[ i ] );
+			}
+		}
+
+		length += static_cast<u64>( received );
+
+		char *end;
+
+		while ( ( end = static_cast<char *>( memchr( buffer, '\n', length ) ) ) )
+		{
+			*end = '\0';
+
+			auto start = std::chrono::steady_clock::now();
+
+			// A request only changes the options for itself
+			Options defaults = options;
+			RESULT_CODE code = serve_request( buffer, fds, fdCount );
+			options = defaults;
+
+			threadMemory->update();
+
+			f64 ms = std::chrono::duration<f64, std::milli>( std::chrono::steady_clock::now() - start ).count();
+			serve_reply( client, code, ms );
+
+			if ( options.verbose )
+				log( "Served request in %.3fms: %s", ms, error_code_string( code ) );
+
+			for ( u32 i = 0; i < fdCount; ++i )
+				close( fds[ i ] );
+
+			fdCount = 0;
+
+			u64 used = static_cast<u64>( end + 1 - buffer );
+			memmove( buffer, end + 1, length - used );
+			length -= used;
+		}
+	}
+
+	if ( length == sizeof( buffer ) )
+	{
+		log_warning( "Request is longer than %llu bytes, closing the connection", static_cast<u64>( sizeof( buffer ) ) );
+		serve_reply( client, RESULT_CODE_INVALID_SERVE_REQUEST, 0.0 );
+
+		// Closing with the rest of the request unread would reset the connection and lose the
+		// reply, so the client is told there's nothing more and the rest is read until it hangs up
+		shutdown( client, SHUT_WR );
+
+		ssize_t received;
+
+		while ( ( received = recv( client, buffer, sizeof( buffer ), 0 ) ) > 0 || ( received < 0 && errno == EINTR ) )
+			;
+	}
+
+	for ( u32 i = 0; i < fdCount; ++i )
+		close( fds[ i ] );
+}
+
+#endif
+
+// Only returns if the server can't start or stops accepting connections
+static RESULT_CODE serve( const char *socketPath )
+{
+	#ifdef PLATFORM_WINDOWS
+		log_warning( "-serve needs unix domain sockets" );
+		return RESULT_CODE_FAILED_TO_START_SERVER;
+	#else
+		sockaddr_un address = {};
+		address.sun_family = AF_UNIX;
+
+		if ( strlen( socketPath ) >= sizeof( address.sun_path ) )
+		{
+			log_warning( "Socket path is too long: %s", socketPath );
+			return RESULT_CODE_FAILED_TO_START_SERVER;
+		}
+
+		string_copy( address.sun_path, sizeof( address.sun_path ), socketPath );
+
+		// Requests can't be planned up front, so the arena reserves room for any of them and only
+		// commits what each one uses
+		u64 arenaSize = options.memory ? options.memory : SERVE_MEMORY;
+		app.jobMemory = create_memory_arena( "job" );
+
+		if ( !app.jobMemory.init_virtual( 0, arenaSize, 0 ) )
+		{
+			log_error( "Failed to initialise %llu bytes of job memory", arenaSize );
+			return RESULT_CODE_FAILED_MEMORY_ARENA_INITIALISATION;
+		}
+
+		threadMemory = &app.jobMemory;
+
+		if ( !start_workers( options.jobs - 1, 0 ) )
+			return RESULT_CODE_FAILED_MEMORY_ARENA_INITIALISATION;
+
+		// A socket left behind by an earlier server is replaced, anything else at the path is kept
+		struct stat info;
+
+		if ( stat( socketPath, &info ) == 0 && S_ISSOCK( info.st_mode ) )
+			unlink( socketPath );
+
+		int listener = socket( AF_UNIX, SOCK_STREAM, 0 );
+
+		if ( listener < 0 || bind( listener, reinterpret_cast<sockaddr *>( &address ), sizeof( address ) ) != 0 || listen( listener, 16 ) != 0 )
+		{
+			log_warning( "Failed to listen on socket: %s", socketPath );
+
+			if ( listener >= 0 )
+				close( listener );
+
+			return RESULT_CODE_FAILED_TO_START_SERVER;
+		}
+
+		log( "Serving merges on: %s", socketPath );
+
+		while ( true )
+		{
+			int client = accept( listener, nullptr, nullptr );
+
+			if ( client < 0 )
+			{
+				if ( errno == EINTR || errno == ECONNABORTED )
+					continue;
+
+				break;
+			}
+
+			serve_connection( client );
+			close( client );
+			write_trace();
+			report_memory_stats();
+
+			// A server usually ends with a signal, which would lose whatever stdout still buffers
+			fflush( stdout );
+		}
+
+		log_warning( "Stopped accepting connections on: %s", socketPath );
+		close( listener );
+		unlink( socketPath );
+
+		return RESULT_CODE_FAILED_TO_START_SERVER;
+	#endif
+}
+
+// -------------------------------------------------------------------------
+// ENTRY
+// -------------------------------------------------------------------------
+int main( int argc, const char *argv[] )
+{
+	options.inputFileR[ 0 ] = '\0';
+	options.inputFileG[ 0 ] = '\0';
+	options.inputFileB[ 0 ] = '\0';
+	options.inputFileA[ 0 ] = '\0';
+	options.outputFile[ 0 ] = '\0';
+
+	u64 parseStart = trace_clock();
+
+	// Process the option commands
+	for ( int i = 1; i < argc; ++i )
+	{
+		auto f = commands.find( argv[ i ] );
+
+		if ( f )
+		{
+			RESULT_CODE code = f->value( i, argc, &argv[ 0 ] );
+			if ( code != RESULT_CODE_SUCCESS )
+				return usage_message( code );
+		}
+		else
+		{
+			log_warning( "Unknown command: %s", argv[ i ] );
+			return usage_message( RESULT_CODE_UNKNOWN_OPTIONAL_COMMAND );
+		}
+	}
+
+	// Every arena from here on keeps stats
+	memoryStats.enabled = options.memoryStats;
+
+	// Tracing can only start once the options are known, so parsing is recorded after the fact
+	if ( options.tracePath && !trace_begin( create_memory_arena( "trace" ) ) )
+	{
+		log_error( "Failed to initialise memory for the trace" );
+		return usage_message( RESULT_CODE_FAILED_MEMORY_ARENA_INITIALISATION );
+	}
+
+	trace_record( "parse arguments", nullptr, parseStart, trace_clock() );
+
+	merge_build_table( &app.merge, cpu_features(), options.layout );
+
+	// Set working directory
+	if ( options.workingDirectory )
+	{
+		if ( change_directory( options.workingDirectory ) && options.verbose )
+			log( "Working directory changed to: %s", options.workingDirectory );
+	}
+
+	// The manifest lives in permanent memory for the whole run
+	u64 batchFileSize = 0;
+
+	if ( options.batchFile && !file_size( options.batchFile, &batchFileSize ) )
+	{
+		log_warning( "Failed to open batch file: %s", options.batchFile );
+		return usage_message( RESULT_CODE_FAILED_TO_OPEN_BATCH_FILE );
+	}
+
+	app.memory = create_memory_arena( "app" );
+
+	// The manifest or scanned paths, the job list and the worker arenas live in permanent memory for
+	// the whole run. It's committed as they grow, so however many jobs there are only costs what they use.
+	bool multiJob = options.batchFile || options.scanDirectory;
+	u64 workerCount = options.jobs - 1;
+	u64 arenaStart = trace_clock();
+
+	if ( !app.memory.init_virtual( APP_MEMORY, PLAN_MEMORY, 0 ) )
+	{
+		log_error( "Failed to initialise memory app.memory" );
+		return usage_message( RESULT_CODE_FAILED_MEMORY_ARENA_INITIALISATION );
+	}
+
+	trace_record( "arena init", "app.memory", arenaStart, trace_clock() );
+
+	if ( multiJob || options.serveSocket )
+		app.imageCache.capacity = options.imageCache;
+
+	if ( options.serveSocket )
+	{
+		RESULT_CODE code = serve( options.serveSocket );
+
+		app.pool.free();
+		image_cache_free( &app.imageCache );
+		write_trace();
+		report_memory_stats();
+		trace_end();
+
+		return usage_message( code );
+	}
+
+	DynamicArray<MergeJob> jobs;
+	u64 invalidCount = 0;
+	u64 arenaSize = 0;
+	MergeJob job;
+
+	if ( multiJob )
+	{
+		if ( options.batchFile )
+		{
+			char *manifest = read_text_file( &app.memory.permanent, options.batchFile, batchFileSize );
+
+			if ( !manifest )
+			{
+				log_warning( "Failed to read batch file: %s", options.batchFile );
+				return usage_message( RESULT_CODE_FAILED_TO_OPEN_BATCH_FILE );
+			}
+
+			// The job list is the last allocation, so it grows in place
+			if ( !jobs.init( &app.memory.permanent ) || !parse_batch( manifest, &jobs, &invalidCount ) )
+				return usage_message( RESULT_CODE_FAILED_TO_OPEN_BATCH_FILE );
+		}
+		else
+		{
+			RESULT_CODE code = scan_jobs( options.scanDirectory, &app.memory.permanent, &jobs );
+
+			if ( code != RESULT_CODE_SUCCESS )
+				return usage_message( code );
+
+			if ( options.verbose )
+				log( "Found %llu channel sets in: %s", jobs.count, options.scanDirectory );
+		}
+
+		// Each job runs on one thread
+		arenaSize = plan_jobs( jobs.data, &jobs.count, &invalidCount, 1 );
+	}
+	else
+	{
+		RESULT_CODE code = options_job( &job );
+
+		if ( code != RESULT_CODE_SUCCESS )
+			return usage_message( code );
+
+		// Every pool thread helps write the output
+		code = plan_job( &job, options.jobs );
+
+		if ( code != RESULT_CODE_SUCCESS )
+			return usage_message( code );
+
+		if ( options.verbose )
+			log( "Job [%s] needs %llu bytes", job.outputFile, job.memory );
+
+		arenaSize = job.memory;
+	}
+
+	// A -memory budget is used as given, otherwise the arenas are only as large as the biggest job
+	if ( options.memory )
+		arenaSize = options.memory;
+
+	app.jobMemory = create_memory_arena( "job" );
+	arenaStart = trace_clock();
+
+	if ( !app.jobMemory.init_virtual( 0, arenaSize, 0 ) )
+	{
+		log_error( "Failed to initialise %llu bytes of job memory", arenaSize );
+		return usage_message( RESULT_CODE_FAILED_MEMORY_ARENA_INITIALISATION );
+	}
+
+	trace_record( "arena init", "app.jobMemory", arenaStart, trace_clock() );
+
+	threadMemory = &app.jobMemory;
+
+	// Batch workers run whole jobs in their own arena, a single job's workers only help compress
+	// the output and their tasks allocate from the caller
+	if ( !start_workers( workerCount, multiJob ? arenaSize : 0 ) )
+		return usage_message( RESULT_CODE_FAILED_MEMORY_ARENA_INITIALISATION );
+
+	RESULT_CODE code = multiJob ? run_jobs( jobs.data, jobs.count, invalidCount ) : run_job( job );
+
+	app.pool.free();
+	image_cache_free( &app.imageCache );
+	write_trace();
+	report_memory_stats();
+	trace_end();
+
+	if ( code != RESULT_CODE_SUCCESS && !multiJob )
+		return usage_message( code );
+
+	return code;
+}
+
 // -------------------------------------------------------------------------
 // Unity Build
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
\ No newline at end of file
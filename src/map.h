@@ -533,4 +533,778 @@ struct Map
 	{
 		return values.count == Capacity;
 	}
-};
\ No newline at end of file
+};
+
+// FLAT MAP /////////////////////////////////////////////////////////////////////
+// Open addressing alternative to Map for big indexes, same insert/find/remove/get_value calls.
+// Keys and values sit in the slots themselves, a lookup hashes once and compares a control byte
+// per slot, 16 at a time, before touching any key. Slots are probed linearly so remove shifts the
+// entries after it back rather than leaving tombstones. Entries are in hash order, not insertion
+// order, and any remove can move them. Zeroed memory is an empty map.
+
+#define FLAT_MAP_GROUP			16
+#define FLAT_MAP_EMPTY			0x00		// control byte of a free slot, a used one is 0x80 | 7 bits of its hash
+
+// Map's hashes are weak in their low bits, mix them before the low bits pick a slot or bucket
+[[nodiscard]] static inline u64 map_mix_hash( u64 hash )
+{
+	hash ^= hash >> 29;
+	hash *= 0xBF58476D1CE4E5B9ull;
+	hash ^= hash >> 32;
+	return hash;
+}
+
+// Power of 2 slots that keep a full map at most 3/4 used
+[[nodiscard]] constexpr u64 flat_map_slots( u64 capacity )
+{
+	u64 slots = FLAT_MAP_GROUP;
+
+	while ( slots < capacity + capacity / 3 )
+		slots <<= 1;
+
+	return slots;
+}
+
+// One bit per byte of the 16 at control that equal value
+[[nodiscard]] static inline u32 flat_map_match( const u8 *control, u8 value )
+{
+	#if defined( __x86_64__ ) || defined( _M_X64 )
+		__m128i group = _mm_loadu_si128( reinterpret_cast<const __m128i *>( control ) );
+		return static_cast<u32>( _mm_movemask_epi8( _mm_cmpeq_epi8( group, _mm_set1_epi8( static_cast<char>( value ) ) ) ) );
+	#else
+		u32 mask = 0;
+
+		for ( u32 i = 0; i < FLAT_MAP_GROUP; ++i )
+			mask |= static_cast<u32>( control[ i ] == value ) << i;
+
+		return mask;
+	#endif
+}
+
+[[nodiscard]] static inline u32 flat_map_lowest_bit( u32 mask )
+{
+	#ifdef _MSC_VER
+		unsigned long index;
+		_BitScanForward( &index, mask );
+		return static_cast<u32>( index );
+	#else
+		return static_cast<u32>( __builtin_ctz( mask ) );
+	#endif
+}
+
+template <typename Key, typename Value, u64 Capacity>
+struct FlatMap
+{
+	using KeyType = MapTransformKey<Key>::Type;
+	using KeyHash = MapHash<KeyType>;
+	using KeyCompare = MapKeyCompare<KeyType>;
+	using KeyAssign = MapKeyAssignment<KeyType>;
+
+	static constexpr u64 SlotCount = flat_map_slots( Capacity );
+
+	static_assert( Capacity > 0 && Capacity < SlotCount, "A flat map needs a free slot to end every probe" );
+
+	struct Entry
+	{
+		Key key;				// the key used in hash
+		Value value;			// the actual value
+	};
+
+	u64 used = 0;
+	u8 control[ SlotCount + FLAT_MAP_GROUP - 1 ];	// the first 15 are repeated at the end so a group never wraps
+	Entry slots[ SlotCount ];
+
+	FlatMap()
+	{
+		clear();
+	}
+
+	[[nodiscard]] static inline u64 mix( const KeyType &key )
+	{
+		return map_mix_hash( KeyHash::create( key ) );
+	}
+
+	[[nodiscard]] static inline u64 home( u64 hash )
+	{
+		return hash & ( SlotCount - 1 );
+	}
+
+	[[nodiscard]] static inline u8 tag( u64 hash )
+	{
+		return static_cast<u8>( 0x80 | ( hash >> 57 ) );
+	}
+
+	inline void set_control( u64 slot, u8 value )
+	{
+		control[ slot ] = value;
+
+		if ( slot < FLAT_MAP_GROUP - 1 )
+			control[ SlotCount + slot ] = value;
+	}
+
+	// The slot holding key, or the free slot that ends its probe
+	[[nodiscard]] u64 probe( const KeyType &key, u64 hash, bool *found ) const
+	{
+		u8 keyTag = tag( hash );
+		u64 slot = home( hash );
+
+		while ( true )
+		{
+			const u8 *group = &control[ slot ];
+
+			for ( u32 mask = flat_map_match( group, keyTag ); mask; mask &= mask - 1 )
+			{
+				u64 candidate = ( slot + flat_map_lowest_bit( mask ) ) & ( SlotCount - 1 );
+
+				if ( KeyCompare::compare( slots[ candidate ].key, key ) )
+				{
+					*found = true;
+					return candidate;
+				}
+			}
+
+			// Linear probing never leaves a gap before an entry, so a free slot ends the search
+			u32 empty = flat_map_match( group, FLAT_MAP_EMPTY );
+
+			if ( empty )
+			{
+				*found = false;
+				return ( slot + flat_map_lowest_bit( empty ) ) & ( SlotCount - 1 );
+			}
+
+			slot = ( slot + FLAT_MAP_GROUP ) & ( SlotCount - 1 );
+		}
+	}
+
+	[[nodiscard]] Entry *push( const KeyType &key )
+	{
+		u64 hash = mix( key );
+		bool found;
+		u64 slot = probe( key, hash, &found );
+
+		if ( found )
+			return &slots[ slot ];
+
+		if ( full() )
+			return nullptr;
+
+		Entry *entry = &slots[ slot ];
+		KeyAssign::assign( entry->key, key );
+		set_control( slot, tag( hash ) );
+		used += 1;
+
+		return entry;
+	}
+
+	Value *push_get( const KeyType &key )
+	{
+		Entry *entry = push( key );
+		if ( !entry )
+			return nullptr;
+		return &entry->value;
+	}
+
+	Value *insert_get( const KeyType &key, const Value &value )
+	{
+		Entry *entry = push( key );
+		if ( !entry )
+			return nullptr;
+		entry->value = value;
+		return &entry->value;
+	}
+
+	bool insert( const KeyType &key, const Value &value )
+	{
+		Entry *entry = push( key );
+		if ( !entry )
+			return false;
+		entry->value = value;
+		return true;
+	}
+
+	bool remove( const KeyType &key )
+	{
+		bool found;
+		u64 hole = probe( key, mix( key ), &found );
+
+		if ( !found )
+			return false;
+
+		// Pull back every entry after the hole that can legally sit in it, until a free slot
+		u64 slot = ( hole + 1 ) & ( SlotCount - 1 );
+
+		while ( control[ slot ] != FLAT_MAP_EMPTY )
+		{
+			u64 slotHome = home( mix( slots[ slot ].key ) );
+
+			// Moving is fine unless the entry's home lies after the hole, up to the entry itself
+			bool stays = hole <= slot ? ( hole < slotHome && slotHome <= slot ) : ( hole < slotHome || slotHome <= slot );
+
+			if ( !stays )
+			{
+				slots[ hole ] = slots[ slot ];
+				set_control( hole, control[ slot ] );
+				hole = slot;
+			}
+
+			slot = ( slot + 1 ) & ( SlotCount - 1 );
+		}
+
+		set_control( hole, FLAT_MAP_EMPTY );
+		used -= 1;
+
+		return true;
+	}
+
+	inline void clear()
+	{
+		memset( control, FLAT_MAP_EMPTY, sizeof( control ) );
+		used = 0;
+	}
+
+	[[nodiscard]] Value *get_value( const KeyType &key )
+	{
+		Entry *entry = find( key );
+		return entry ? &entry->value : nullptr;
+	}
+
+	[[nodiscard]] Entry *find( const KeyType &key )
+	{
+		bool found;
+		u64 slot = probe( key, mix( key ), &found );
+		return found ? &slots[ slot ] : nullptr;
+	}
+
+	[[nodiscard]] const Entry *find( const KeyType &key ) const
+	{
+		bool found;
+		u64 slot = probe( key, mix( key ), &found );
+		return found ? &slots[ slot ] : nullptr;
+	}
+
+	// For walking every entry, slot goes from 0 to SlotCount and free ones give nullptr
+	[[nodiscard]] inline const Entry *at( u64 slot ) const
+	{
+		assert( slot < SlotCount );
+		return control[ slot ] != FLAT_MAP_EMPTY ? &slots[ slot ] : nullptr;
+	}
+
+	[[nodiscard]] inline Entry *operator[] ( const KeyType &key )
+	{
+		return find( key );
+	}
+
+	[[nodiscard]] inline const Entry *operator[] ( const KeyType &key ) const
+	{
+		return find( key );
+	}
+
+	[[nodiscard]] inline u64 count() const
+	{
+		return used;
+	}
+
+	[[nodiscard]] inline bool empty() const
+	{
+		return used == 0;
+	}
+
+	[[nodiscard]] inline bool full() const
+	{
+		return used == Capacity;
+	}
+};
+
+
+// FROZEN MAP ///////////////////////////////////////////////////////////////////
+// Read only map of string keys for fixed dictionaries, built by the compiler with frozen_map.
+// Keys are placed with a perfect hash: the key's hash picks a bucket and the bucket's seed, found
+// while building, sends every key in it to a slot of its own. A lookup is one hash over the key
+// and one compare, nothing is built at startup. Lookups of unknown keys land on another key or an
+// empty slot and fail the compare.
+
+#define FROZEN_MAP_MAX_SEED		( 1u << 20 )
+
+[[nodiscard]] constexpr u64 frozen_map_hash( const char *key )
+{
+	// fnv-1a
+	u64 hash = 0xCBF29CE484222325ull;
+
+	while ( *key )
+	{
+		hash ^= static_cast<u8>( *key++ );
+		hash *= 0x100000001B3ull;
+	}
+
+	return hash;
+}
+
+// A key's slot for the seed of its bucket
+[[nodiscard]] constexpr u64 frozen_map_mix( u64 hash, u32 seed )
+{
+	hash ^= seed * 0x9E3779B97F4A7C15ull;
+	hash ^= hash >> 31;
+	hash *= 0xBF58476D1CE4E5B9ull;
+	hash ^= hash >> 29;
+	return hash;
+}
+
+[[nodiscard]] constexpr bool frozen_map_equal( const char *lhs, const char *rhs )
+{
+	while ( *lhs != '\0' )
+		if ( *lhs++ != *rhs++ )
+			return false;
+
+	return *lhs == *rhs;
+}
+
+[[nodiscard]] constexpr u64 frozen_map_power_of_2( u64 atLeast )
+{
+	u64 size = 1;
+
+	while ( size < atLeast )
+		size <<= 1;
+
+	return size;
+}
+
+// Not constexpr, so a frozen map that can't be built, a duplicate or null key say, stops the compile here
+static inline void frozen_map_build_failed()
+{
+	assert( !"Frozen map keys must be unique and not null" );
+}
+
+template <typename Value, u64 Count>
+struct FrozenMap
+{
+	static constexpr u64 SlotCount = frozen_map_power_of_2( Count * 2 );
+	static constexpr u64 BucketCount = frozen_map_power_of_2( Count / 2 + 1 );
+
+	struct Entry
+	{
+		const char *key;		// nullptr in an empty slot
+		Value value;
+	};
+
+	Entry entries[ SlotCount ] = {};
+	u32 seeds[ BucketCount ] = {};
+
+	constexpr FrozenMap( const Pair<const char *, Value> ( &pairs )[ Count ] )
+	{
+		u64 hashes[ Count ] = {};
+		u64 bucketSizes[ BucketCount ] = {};
+		u64 largest = 0;
+
+		for ( u64 i = 0; i < Count; ++i )
+		{
+			if ( !pairs[ i ].first )
+			{
+				frozen_map_build_failed();
+				return;
+			}
+
+			hashes[ i ] = frozen_map_hash( pairs[ i ].first );
+			u64 size = ++bucketSizes[ hashes[ i ] & ( BucketCount - 1 ) ];
+			largest = size > largest ? size : largest;
+		}
+
+		// Fullest buckets first, while most slots are free
+		for ( u64 size = largest; size > 0; --size )
+		{
+			for ( u64 bucket = 0; bucket < BucketCount; ++bucket )
+			{
+				if ( bucketSizes[ bucket ] == size && !place( pairs, hashes, bucket ) )
+				{
+					frozen_map_build_failed();
+					return;
+				}
+			}
+		}
+	}
+
+	// Finds a seed that puts every key of the bucket in a free slot of its own
+	constexpr bool place( const Pair<const char *, Value> ( &pairs )[ Count ], const u64 ( &hashes )[ Count ], u64 bucket )
+	{
+		for ( u32 seed = 1; seed < FROZEN_MAP_MAX_SEED; ++seed )
+		{
+			u64 placed = 0;
+			bool fits = true;
+
+			for ( u64 i = 0; i < Count && fits; ++i )
+			{
+				if ( ( hashes[ i ] & ( BucketCount - 1 ) ) != bucket )
+					continue;
+
+				Entry &entry = entries[ frozen_map_mix( hashes[ i ], seed ) & ( SlotCount - 1 ) ];
+
+				if ( entry.key )
+				{
+					// A duplicate collides with itself for every seed
+					if ( frozen_map_equal( entry.key, pairs[ i ].first ) )
+						return false;
+
+					fits = false;
+					break;
+				}
+
+				entry = { pairs[ i ].first, pairs[ i ].second };
+				placed += 1;
+			}
+
+			if ( fits )
+			{
+				seeds[ bucket ] = seed;
+				return true;
+			}
+
+			// Take back what this seed placed, those slots were all empty
+			for ( u64 i = 0; i < Count && placed > 0; ++i )
+			{
+				if ( ( hashes[ i ] & ( BucketCount - 1 ) ) != bucket )
+					continue;
+
+				entries[ frozen_map_mix( hashes[ i ], seed ) & ( SlotCount - 1 ) ] = {};
+				placed -= 1;
+			}
+		}
+
+		return false;
+	}
+
+	[[nodiscard]] constexpr const Entry *find( const char *key ) const
+	{
+		u64 hash = frozen_map_hash( key );
+		const Entry *entry = &entries[ frozen_map_mix( hash, seeds[ hash & ( BucketCount - 1 ) ] ) & ( SlotCount - 1 ) ];
+
+		return entry->key && frozen_map_equal( entry->key, key ) ? entry : nullptr;
+	}
+
+	[[nodiscard]] constexpr const Value *get_value( const char *key ) const
+	{
+		const Entry *entry = find( key );
+		return entry ? &entry->value : nullptr;
+	}
+
+	[[nodiscard]] constexpr const Entry *operator[] ( const char *key ) const
+	{
+		return find( key );
+	}
+
+	[[nodiscard]] constexpr u64 count() const
+	{
+		return Count;
+	}
+};
+
+// Count comes from the list, eg. frozen_map<u32>( { { "one", 1 }, { "two", 2 } } )
+template <typename Value, u64 Count>
+[[nodiscard]] constexpr FrozenMap<Value, Count> frozen_map( const Pair<const char *, Value> ( &pairs )[ Count ] )
+{
+	return FrozenMap<Value, Count>( pairs );
+}
+
+
+// DYNAMIC MAP //////////////////////////////////////////////////////////////////
+// Map whose entries and buckets grow in an allocator rather than sitting inline with fixed sizes.
+// Entries are kept in insertion order in a DynamicArray, chained per bucket like Map's. Each
+// keeps its full hash, so when the entries outnumber the buckets the buckets double and are
+// relinked without hashing a key again. Growing can move entries, so pointers into the map don't
+// survive a push. Key and Value must be safe to copy with memcpy.
+
+#define DYNAMIC_MAP_MIN_BUCKETS		16
+
+template <typename Key, typename Value>
+struct DynamicMap
+{
+	using KeyType = MapTransformKey<Key>::Type;
+	using KeyHash = MapHash<KeyType>;
+	using KeyCompare = MapKeyCompare<KeyType>;
+	using KeyAssign = MapKeyAssignment<KeyType>;
+
+	struct Entry
+	{
+		Key key;				// the key used in hash
+		Value value;			// the actual value
+		u64 hash;				// mixed hash, its low bits are the bucket
+		u64 prev;				// prev entry in values [same bucket]
+		u64 next;				// next entry in values [same bucket]
+		u64 idx;				// entry in values
+	};
+
+	DynamicArray<Entry> values;
+	DynamicArray<u64> entries;	// first entry of each bucket, a power of 2 of them
+
+	// Capacity entries are allocated up front, 0 leaves it to the first push. Buckets given an
+	// allocator of their own don't sit after the entries, so both can keep growing in place.
+	[[nodiscard]] bool init( Allocator *allocator, u64 capacity = 0, Allocator *bucketAllocator = nullptr )
+	{
+		if ( !values.init( allocator, capacity ) || !entries.init( bucketAllocator ? bucketAllocator : allocator ) )
+			return false;
+
+		return capacity == 0 || rehash( capacity );
+	}
+
+	void free()
+	{
+		entries.free();
+		values.free();
+	}
+
+	[[nodiscard]] inline u64 bucket( u64 hash ) const
+	{
+		return hash & ( entries.count - 1 );
+	}
+
+	inline void link( u64 idx )
+	{
+		Entry *entry = &values[ idx ];
+		u64 &root = entries[ bucket( entry->hash ) ];
+
+		entry->prev = INVALID_MAP_INDEX;
+		entry->next = root;
+		entry->idx = idx;
+
+		if ( root != INVALID_MAP_INDEX )
+			values[ root ].prev = idx;
+
+		root = idx;
+	}
+
+	// At least bucketCount buckets, every entry relinked
+	[[nodiscard]] bool rehash( u64 bucketCount )
+	{
+		u64 buckets = DYNAMIC_MAP_MIN_BUCKETS;
+
+		while ( buckets < bucketCount )
+			buckets <<= 1;
+
+		if ( !entries.resize( buckets ) )
+			return false;
+
+		for ( u64 i = 0; i < buckets; ++i )
+			entries[ i ] = INVALID_MAP_INDEX;
+
+		for ( u64 i = 0; i < values.count; ++i )
+			link( i );
+
+		return true;
+	}
+
+	[[nodiscard]] Entry *push( const KeyType &key )
+	{
+		u64 hash = map_mix_hash( KeyHash::create( key ) );
+
+		if ( entries.count == 0 && !rehash( DYNAMIC_MAP_MIN_BUCKETS ) )
+			return nullptr;
+
+		// Check if this key already exists
+		u64 idx = entries[ bucket( hash ) ];
+		while ( idx != INVALID_MAP_INDEX )
+		{
+			Entry *entry = &values[ idx ];
+			if ( entry->hash == hash && KeyCompare::compare( entry->key, key ) )
+				return entry;
+			idx = entry->next;
+		}
+
+		Entry *entry = values.push();
+
+		if ( !entry )
+			return nullptr;
+
+		KeyAssign::assign( entry->key, key );
+		entry->hash = hash;
+
+		// Past one entry per bucket double them. If there's no room chains just get longer.
+		if ( values.count <= entries.count || !rehash( entries.count * 2 ) )
+			link( values.count - 1 );
+
+		return &values.top();
+	}
+
+	Value *push_get( const KeyType &key )
+	{
+		Entry *entry = push( key );
+		if ( !entry )
+			return nullptr;
+		return &entry->value;
+	}
+
+	Value *insert_get( const KeyType &key, const Value &value )
+	{
+		Entry *entry = push( key );
+		if ( !entry )
+			return nullptr;
+		entry->value = value;
+		return &entry->value;
+	}
+
+	bool insert( const KeyType &key, const Value &value )
+	{
+		Entry *entry = push( key );
+		if ( !entry )
+			return false;
+		entry->value = value;
+		return true;
+	}
+
+	bool change_key( const KeyType &oldKey, const KeyType &newKey )
+	{
+		Entry *entry = find( oldKey );
+
+		if ( !entry )
+			return false;
+
+		Value value = entry->value;
+		remove( oldKey );
+
+		// Removing made room, so only running out of buckets could fail this
+		return insert( newKey, value );
+	}
+
+	// Takes the entry out of its bucket's chain
+	void unlink( Entry *entry )
+	{
+		if ( entry->prev != INVALID_MAP_INDEX )
+			values[ entry->prev ].next = entry->next;
+		else
+			entries[ bucket( entry->hash ) ] = entry->next;
+
+		if ( entry->next != INVALID_MAP_INDEX )
+			values[ entry->next ].prev = entry->prev;
+	}
+
+	bool remove( const KeyType &key )
+	{
+		Entry *entry = find( key );
+
+		if ( !entry )
+			return false;
+
+		u64 idx = entry->idx;
+		unlink( entry );
+
+		Entry *other = &values.top();
+
+		// Don't swap with itself, it can just be popped
+		if ( entry != other )
+		{
+			// Point the chain of the entry filling the gap at its new place
+			if ( other->prev != INVALID_MAP_INDEX )
+				values[ other->prev ].next = idx;
+			else
+				entries[ bucket( other->hash ) ] = idx;
+
+			if ( other->next != INVALID_MAP_INDEX )
+				values[ other->next ].prev = idx;
+
+			other->idx = idx;
+		}
+
+		values.swap_and_remove( idx );
+
+		return true;
+	}
+
+	bool remove_keep_order( const KeyType &key )
+	{
+		Entry *entry = find( key );
+
+		if ( !entry )
+			return false;
+
+		u64 idx = entry->idx;
+
+		// Every later entry moves down one, relinking them all is simpler than patching each chain
+		memmove( &values.data[ idx ], &values.data[ idx + 1 ], ( values.count - idx - 1 ) * sizeof( Entry ) );
+		values.count -= 1;
+
+		for ( u64 i = 0; i < entries.count; ++i )
+			entries[ i ] = INVALID_MAP_INDEX;
+
+		for ( u64 i = 0; i < values.count; ++i )
+			link( i );
+
+		return true;
+	}
+
+	inline void clear()
+	{
+		values.clear();
+
+		for ( u64 i = 0; i < entries.count; ++i )
+			entries[ i ] = INVALID_MAP_INDEX;
+	}
+
+	[[nodiscard]] Value *get_value( const KeyType &key )
+	{
+		Entry *entry = find( key );
+		return entry ? &entry->value : nullptr;
+	}
+
+	[[nodiscard]] Entry *find( const KeyType &key )
+	{
+		if ( entries.count == 0 )
+			return nullptr;
+
+		u64 hash = map_mix_hash( KeyHash::create( key ) );
+		u64 idx = entries[ bucket( hash ) ];
+
+		while ( idx != INVALID_MAP_INDEX )
+		{
+			Entry *entry = &values[ idx ];
+			if ( entry->hash == hash && KeyCompare::compare( entry->key, key ) )
+				return entry;
+			idx = entry->next;
+		}
+
+		return nullptr;
+	}
+
+	[[nodiscard]] Entry *prev( const KeyType &key, bool allowWrap )
+	{
+		Entry *entry = find( key );
+
+		// This key doesn't even exist
+		if ( !entry )
+			return nullptr;
+
+		// On first entry
+		if ( entry->idx == 0 )
+			return allowWrap ? &values[ values.count - 1 ] : nullptr;
+
+		// Prev value
+		return &values[ entry->idx - 1 ];
+	}
+
+	[[nodiscard]] Entry *next( const KeyType &key, bool allowWrap )
+	{
+		Entry *entry = find( key );
+
+		// This key doesn't even exist
+		if ( !entry )
+			return nullptr;
+
+		// On last entry
+		if ( entry->idx >= values.count - 1 )
+			return allowWrap ? &values[ 0 ] : nullptr;
+
+		// Next value
+		return &values[ entry->idx + 1 ];
+	}
+
+	[[nodiscard]] inline Entry *operator[] ( const KeyType &key )
+	{
+		return find( key );
+	}
+
+	[[nodiscard]] inline u64 count() const
+	{
+		return values.count;
+	}
+
+	[[nodiscard]] inline bool empty() const
+	{
+		return values.count == 0;
+	}
+};
@@ -0,0 +1,67 @@
+#pragma once
+
+// Read only view of a whole input file. Regular files are mapped, so decoders read straight out
+// of the page cache with no stdio copy in between and a file used by several jobs is only read
+// from disk once. Pipes, devices and anything else that can't be mapped leave the view empty
+// and the caller falls back to its buffered reads.
+
+struct MappedFile
+{
+	const u8 *data = nullptr;
+	u64 size = 0;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// False if the file couldn't be mapped, which isn't an error, the file may still be readable
+[[nodiscard]] static bool mapped_file_open( MappedFile *file, const char *filename )
+{
+	*file = {};
+
+	#ifdef PLATFORM_WINDOWS
+		// Not mapped yet, stdio is used instead
+		( void )filename;
+		return false;
+	#else
+		int fd = open( filename, O_RDONLY );
+
+		if ( fd < 0 )
+			return false;
+
+		struct stat info;
+
+		if ( fstat( fd, &info ) != 0 || !S_ISREG( info.st_mode ) || info.st_size <= 0 )
+		{
+			close( fd );
+			return false;
+		}
+
+		u64 size = static_cast<u64>( info.st_size );
+		void *data = mmap( nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0 );
+
+		// The mapping holds its own reference to the file
+		close( fd );
+
+		if ( data == MAP_FAILED )
+			return false;
+
+		// Inputs are decoded front to back once, so read well ahead and drop pages behind
+		madvise( data, size, MADV_SEQUENTIAL );
+		madvise( data, size, MADV_WILLNEED );
+
+		file->data = static_cast<const u8 *>( data );
+		file->size = size;
+
+		return true;
+	#endif
+}
+
+static void mapped_file_close( MappedFile *file )
+{
+	#ifndef PLATFORM_WINDOWS
+		if ( file->data )
+			munmap( const_cast<u8 *>( file->data ), file->size );
+	#endif
+
+	*file = {};
+}
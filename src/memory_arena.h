@@ -2,12 +2,16 @@
 #pragma once
 
 #define MEMORY_ALIGNMENT		sizeof( u64 )
+#define MEMORY_PAGE_SIZE		KB( 4 )		// virtual allocators below MEMORY_HUGE_PAGE_THRESHOLD commit in steps of a page
+#define MEMORY_HUGE_PAGE_SIZE	MB( 2 )		// and bigger ones in steps of a huge page
+#define MEMORY_HUGE_PAGE_THRESHOLD	MB( 16 )
 
 using MemoryFlags = u32;
 enum MEMORY_FLAGS : MemoryFlags
 {
 	MEMORY_FLAGS_INITIALISED			= BIT( 0 ),
 	MEMORY_FLAGS_SEPARATE_ALLOCATIONS	= BIT( 1 ),
+	MEMORY_FLAGS_VIRTUAL				= BIT( 2 ),
 };
 
 struct MemoryHeader
@@ -22,12 +26,38 @@ struct MemoryHeader
 
 static_assert( sizeof( MemoryHeader ) % MEMORY_ALIGNMENT == 0 );
 
+// Most an allocation can take beyond its size, for working out how big an allocator needs to be
+#define MEMORY_ALLOCATION_OVERHEAD	( sizeof( MemoryHeader ) + MEMORY_ALIGNMENT )
+
+#define MEMORY_STATS_MAX_NAMES		16
+
+// What an allocator has been through, only kept while memory stats are on
+struct MemoryStats
+{
+	u64 peak;				// most bytes in use at once, headers and padding included
+	u64 requested;			// bytes asked for over every allocation
+	u64 largest;			// biggest single allocation
+	u64 allocations;
+	u64 reallocations;
+	u64 moves;				// reallocations that couldn't grow in place and copied instead
+	u64 copied;				// bytes those moves copied
+	u64 frees;
+	u64 unreclaimed;		// frees of anything but the last allocation, which give nothing back
+	u64 unreclaimedBytes;
+	u64 overhead;			// headers and alignment padding
+	u64 failures;			// allocations and growth that didn't fit
+	u64 largestFailure;		// biggest request that didn't fit
+};
+
 struct Allocator
 {
 	u64 capacity;
 	u64 available;
 	u8 *memory;
 	u8 *lastAlloc;
+	u64 committed;			// virtual arenas only, bytes that can be written
+	u64 touched;			// virtual arenas only, furthest byte ever handed out, everything past it is zero
+	MemoryStats *stats;		// nullptr unless memory stats are on
 
 	u8 *( *allocate_func )( Allocator *allocator, u64 size, bool clearZero, u16 alignment );
 	u8 *( *reallocate_func )( Allocator *allocator, void *p, u64 size );
@@ -50,6 +80,7 @@ struct Allocator
 struct MemoryArena
 {
 	bool init( u64 permanentSize, u64 transientSize, u64 fastBumpSize, bool clearZero = false, u16 alignment = MEMORY_ALIGNMENT );
+	bool init_virtual( u64 permanentSize, u64 transientSize, u64 fastBumpSize );
 	void free();
 	void update();
 
@@ -58,8 +89,38 @@ struct MemoryArena
 	Allocator permanent = {};
 	Allocator transient = {};
 	Allocator fastBump = {};
+	u64 reserved = 0;		// size of the address range a virtual arena holds
+
+	// Once initialised with memory stats on the allocators point in here, so the arena mustn't be copied
+	const char *name = nullptr;
+	MemoryStats permanentStats = {};
+	MemoryStats transientStats = {};
+};
+
+// Arenas of the same name are added up, a freed arena is added in as it goes
+struct MemoryStatsTotal
+{
+	const char *name;
+	u64 arenas;
+	u64 capacity[ 2 ];		// largest permanent and transient capacity
+	MemoryStats stats[ 2 ];	// permanent and transient
+};
+
+struct MemoryStatsTotals
+{
+	u32 count;
+	MemoryStatsTotal totals[ MEMORY_STATS_MAX_NAMES ];
 };
 
+struct MemoryStatsReport
+{
+	bool enabled = false;	// set before any arena is initialised
+	std::mutex mutex;
+	MemoryStatsTotals freed = {};
+};
+
+static MemoryStatsReport memoryStats;
+
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 template <typename T>
@@ -113,6 +174,127 @@ inline void Allocator::attach( void *p, void *to )
 	return attach_func( this, p, to );
 }
 
+// MEMORY STATS //////////////////////////////////////////////////////////////////////////////////////////////////////
+// With memoryStats.enabled every arena initialised afterwards counts what its permanent and transient
+// allocators do. An allocator only ever belongs to one thread, so the counters take no locks, only
+// adding a freed arena to the totals does. Off, each allocator call pays one branch on a null pointer.
+
+static inline void memory_stats_used( Allocator *allocator )
+{
+	u64 used = allocator->capacity - allocator->available;
+
+	if ( used > allocator->stats->peak )
+		allocator->stats->peak = used;
+}
+
+static inline void memory_stats_allocate( Allocator *allocator, u64 size, u64 overhead )
+{
+	MemoryStats *stats = allocator->stats;
+	stats->allocations += 1;
+	stats->requested += size;
+	stats->overhead += overhead;
+	stats->largest = size > stats->largest ? size : stats->largest;
+	memory_stats_used( allocator );
+}
+
+// A reallocation that grew in place
+static inline void memory_stats_grow( Allocator *allocator, u64 extra )
+{
+	allocator->stats->requested += extra;
+	memory_stats_used( allocator );
+}
+
+static inline void memory_stats_failure( Allocator *allocator, u64 size )
+{
+	if ( !allocator->stats )
+		return;
+
+	allocator->stats->failures += 1;
+	allocator->stats->largestFailure = size > allocator->stats->largestFailure ? size : allocator->stats->largestFailure;
+}
+
+// Called before the free, anything but the last allocation stays taken until the allocator is reset
+static inline void memory_stats_free( Allocator *allocator, void *p )
+{
+	MemoryStats *stats = allocator->stats;
+	stats->frees += 1;
+
+	if ( allocator->lastAlloc != p )
+	{
+		stats->unreclaimed += 1;
+		stats->unreclaimedBytes += reinterpret_cast<MemoryHeader *>( static_cast<u8 *>( p ) - sizeof( MemoryHeader ) )->reqSize;
+	}
+}
+
+static void memory_stats_merge( MemoryStats *total, const MemoryStats &stats )
+{
+	total->peak = stats.peak > total->peak ? stats.peak : total->peak;
+	total->requested += stats.requested;
+	total->largest = stats.largest > total->largest ? stats.largest : total->largest;
+	total->allocations += stats.allocations;
+	total->reallocations += stats.reallocations;
+	total->moves += stats.moves;
+	total->copied += stats.copied;
+	total->frees += stats.frees;
+	total->unreclaimed += stats.unreclaimed;
+	total->unreclaimedBytes += stats.unreclaimedBytes;
+	total->overhead += stats.overhead;
+	total->failures += stats.failures;
+	total->largestFailure = stats.largestFailure > total->largestFailure ? stats.largestFailure : total->largestFailure;
+}
+
+// Adds an arena that kept stats to the total of its name. Names past MEMORY_STATS_MAX_NAMES share the last total.
+static void memory_stats_add( MemoryStatsTotals *totals, const MemoryArena &arena )
+{
+	if ( !arena.permanent.stats )
+		return;
+
+	const char *name = arena.name ? arena.name : "unnamed";
+	u32 index = 0;
+
+	while ( index < totals->count && strcmp( totals->totals[ index ].name, name ) != 0 )
+		++index;
+
+	if ( index == MEMORY_STATS_MAX_NAMES )
+	{
+		index = MEMORY_STATS_MAX_NAMES - 1;
+		totals->totals[ index ].name = "other";
+	}
+	else if ( index == totals->count )
+	{
+		totals->count += 1;
+		totals->totals[ index ] = {};
+		totals->totals[ index ].name = name;
+	}
+
+	MemoryStatsTotal *total = &totals->totals[ index ];
+	total->arenas += 1;
+	total->capacity[ 0 ] = arena.permanent.capacity > total->capacity[ 0 ] ? arena.permanent.capacity : total->capacity[ 0 ];
+	total->capacity[ 1 ] = arena.transient.capacity > total->capacity[ 1 ] ? arena.transient.capacity : total->capacity[ 1 ];
+	memory_stats_merge( &total->stats[ 0 ], arena.permanentStats );
+	memory_stats_merge( &total->stats[ 1 ], arena.transientStats );
+}
+
+static void memory_stats_begin( MemoryArena *arena )
+{
+	if ( !memoryStats.enabled )
+		return;
+
+	arena->permanentStats = {};
+	arena->transientStats = {};
+	arena->permanent.stats = &arena->permanentStats;
+	arena->transient.stats = &arena->transientStats;
+}
+
+static void memory_stats_end( MemoryArena *arena )
+{
+	if ( !arena->permanent.stats )
+		return;
+
+	std::lock_guard<std::mutex> lock( memoryStats.mutex );
+	memory_stats_add( &memoryStats.freed, *arena );
+}
+
 //////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 bool MemoryArena::init( u64 permanentSize, u64 transientSize, u64 fastBumpSize, bool clearZero, u16 alignment )
@@ -184,6 +366,8 @@ bool MemoryArena::init( u64 permanentSize, u64 transientSize, u64 fastBumpSize,
 
 	flags |= MEMORY_FLAGS_INITIALISED;
 
+	memory_stats_begin( this );
+
 	return true;
 }
 
@@ -191,8 +375,18 @@ void MemoryArena::free()
 {
 	if ( flags & MEMORY_FLAGS_INITIALISED )
 	{
+		memory_stats_end( this );
+
 		// Check if it was a single allocation or 2 seperate ones
-		if ( flags & MEMORY_FLAGS_SEPARATE_ALLOCATIONS )
+		if ( flags & MEMORY_FLAGS_VIRTUAL )
+		{
+			#ifdef PLATFORM_WINDOWS
+				VirtualFree( memory, 0, MEM_RELEASE );
+			#else
+				munmap( memory, reserved );
+			#endif
+		}
+		else if ( flags & MEMORY_FLAGS_SEPARATE_ALLOCATIONS )
 		{
 			::free( permanent.memory );
 			::free( transient.memory );
@@ -203,7 +397,10 @@ void MemoryArena::free()
 			::free( memory );
 		}
 
+		// The name stays for when the arena is initialised again
+		const char *keepName = name;
 		memset( this, 0, sizeof( *this ) );
+		name = keepName;
 	}
 }
 
@@ -232,6 +429,7 @@ void MemoryArena::update()
 
 	if ( reqSize > allocator->available )
 	{
+		memory_stats_failure( allocator, size );
 		return nullptr;
 	}
 
@@ -246,6 +444,9 @@ void MemoryArena::update()
 	allocator->available -= reqSize;
 	allocator->lastAlloc = p;
 
+	if ( allocator->stats )
+		memory_stats_allocate( allocator, size, reqSize - size );
+
 	if ( clearZero )
 		memset( allocator->lastAlloc, 0, size );
 
@@ -261,6 +462,9 @@ void MemoryArena::update()
 
 	MemoryHeader *header = reinterpret_cast<MemoryHeader*>( static_cast<u8 *>( p ) - sizeof( MemoryHeader ) );
 
+	if ( allocator->stats )
+		allocator->stats->reallocations += 1;
+
 	// Same size
 	if ( size == header->size )
 		return static_cast<u8 *>( p );
@@ -286,6 +490,7 @@ void MemoryArena::update()
 
 		if ( extraReqSizeNeeded > allocator->available )
 		{
+			memory_stats_failure( allocator, size );
 			return nullptr;
 		}
 
@@ -295,19 +500,29 @@ void MemoryArena::update()
 		// Remove the extra space required for this reallocation
 		allocator->available -= extraReqSizeNeeded;
 
+		if ( allocator->stats )
+			memory_stats_grow( allocator, size - oldSize );
+
 		return static_cast<u8 *>( p );
 	}
 
 	// Since it wasn't the last allocation, allocate a new block and copy the data over
 	u8 *newMemory = allocator->allocate<u8>( size, false, header->alignment );
 
+	// Like realloc the old block is left as it was
 	if ( !newMemory )
 	{
-		return static_cast<u8 *>( p );
+		return nullptr;
 	}
 
 	memcpy( newMemory, p, size < oldSize ? size : oldSize );
 
+	if ( allocator->stats )
+	{
+		allocator->stats->moves += 1;
+		allocator->stats->copied += size < oldSize ? size : oldSize;
+	}
+
 	allocator->free( p );
 
 	return newMemory;
@@ -347,6 +562,9 @@ void memory_bump_shrink( Allocator *allocator, void *p, u64 size )
 
 void memory_bump_free( Allocator *allocator, void *p )
 {
+	if ( p && allocator->stats )
+		memory_stats_free( allocator, p );
+
 	if ( !p || allocator->lastAlloc != p )
 		return;
 
@@ -408,4 +626,216 @@ void memory_bump_attach( Allocator *allocator, void *p, void *to )
 		memset( allocator->lastAlloc, 0, size );
 
 	return allocator->lastAlloc;
-}
\ No newline at end of file
+}
+
+// VIRTUAL MEMORY ////////////////////////////////////////////////////////////////////////////////////////////////////
+// An arena from init_virtual reserves address space for its full size but only commits it as the
+// bump pointers move, so it can be sized for the largest job and a small job only pays for what it
+// uses. Fresh pages come from the OS zeroed, clearing memory no allocation has reached yet is skipped.
+
+// Huge pages only pay off for big allocators. A small one, like an image cache plane, would
+// otherwise fault in 2MB for its first byte and the cache limit would no longer bound its memory.
+[[nodiscard]] static inline u64 memory_page_size( u64 capacity )
+{
+	return capacity >= MEMORY_HUGE_PAGE_THRESHOLD ? MEMORY_HUGE_PAGE_SIZE : MEMORY_PAGE_SIZE;
+}
+
+[[nodiscard]] static inline u64 memory_page_round( u64 size, u64 pageSize )
+{
+	return ( size + pageSize - 1 ) & ~( pageSize - 1 );
+}
+
+// Make the first used bytes writable. Allocators start on a page and own whole pages of their
+// size, so committing up to the next page never reaches another allocator.
+[[nodiscard]] static bool memory_virtual_commit( Allocator *allocator, u64 used )
+{
+	used = used < allocator->capacity ? used : allocator->capacity;
+
+	if ( used <= allocator->committed )
+		return true;
+
+	u64 commit = memory_page_round( used, memory_page_size( allocator->capacity ) );
+
+	#ifdef PLATFORM_WINDOWS
+		if ( !VirtualAlloc( allocator->memory + allocator->committed, commit - allocator->committed, MEM_COMMIT, PAGE_READWRITE ) )
+			return false;
+	#else
+		if ( mprotect( allocator->memory + allocator->committed, commit - allocator->committed, PROT_READ | PROT_WRITE ) != 0 )
+			return false;
+	#endif
+
+	allocator->committed = commit;
+
+	return true;
+}
+
+[[nodiscard]] u8 *memory_virtual_allocate( Allocator *allocator, u64 size, bool clearZero, u16 alignment )
+{
+	u64 used = allocator->capacity - allocator->available;
+
+	// The most the allocation can take, the bump allocator checks it actually fits
+	if ( !memory_virtual_commit( allocator, used + sizeof( MemoryHeader ) + alignment + size ) )
+	{
+		memory_stats_failure( allocator, size );
+		return nullptr;
+	}
+
+	u8 *p = memory_bump_allocate( allocator, size, false, alignment );
+
+	if ( !p )
+		return nullptr;
+
+	u64 start = static_cast<u64>( p - allocator->memory );
+	u64 end = start + size;
+
+	if ( clearZero && start < allocator->touched )
+		memset( p, 0, ( end < allocator->touched ? end : allocator->touched ) - start );
+
+	used = allocator->capacity - allocator->available;
+	allocator->touched = used > allocator->touched ? used : allocator->touched;
+
+	return p;
+}
+
+[[nodiscard]] u8 *memory_virtual_reallocate( Allocator *allocator, void *p, u64 size )
+{
+	if ( !p )
+		return allocator->allocate<u8>( size );
+
+	MemoryHeader *header = reinterpret_cast<MemoryHeader*>( static_cast<u8 *>( p ) - sizeof( MemoryHeader ) );
+	u64 used = allocator->capacity - allocator->available;
+
+	// Enough for the block to grow in place, moving it commits through memory_virtual_allocate
+	if ( allocator->lastAlloc == p && size > header->size && !memory_virtual_commit( allocator, used + size - header->size ) )
+	{
+		memory_stats_failure( allocator, size );
+		return nullptr;
+	}
+
+	u8 *newMemory = memory_bump_reallocate( allocator, p, size );
+
+	used = allocator->capacity - allocator->available;
+	allocator->touched = used > allocator->touched ? used : allocator->touched;
+
+	return newMemory;
+}
+
+bool MemoryArena::init_virtual( u64 permanentSize, u64 transientSize, u64 fastBumpSize )
+{
+	constexpr const u64 permanentMinSize = sizeof( Allocator ) + sizeof( MemoryHeader );
+	constexpr const u64 transientMinSize = sizeof( Allocator ) + sizeof( MemoryHeader );
+	constexpr const u64 fastBumpMinSize = sizeof( Allocator );
+	if ( permanentSize < permanentMinSize ) permanentSize = permanentMinSize;
+	if ( transientSize < transientMinSize ) transientSize = transientMinSize;
+	if ( fastBumpSize < fastBumpMinSize ) fastBumpSize = fastBumpMinSize;
+
+	if ( flags & MEMORY_FLAGS_INITIALISED )
+		free();
+
+	u64 permanentPageSize = memory_page_size( permanentSize );
+	u64 transientPageSize = memory_page_size( transientSize );
+	u64 fastBumpPageSize = memory_page_size( fastBumpSize );
+
+	// Every allocator has to start on a page of its own size
+	u64 permanentReqSize = memory_page_round( permanentSize, transientPageSize > permanentPageSize ? transientPageSize : permanentPageSize );
+	u64 transientReqSize = memory_page_round( transientSize, fastBumpPageSize > transientPageSize ? fastBumpPageSize : transientPageSize );
+	u64 fastBumpReqSize = memory_page_round( fastBumpSize, fastBumpPageSize );
+	u64 reqSize = permanentReqSize + transientReqSize + fastBumpReqSize;
+
+	#ifdef PLATFORM_WINDOWS
+		// Huge pages aren't asked for here, so the start only has to be on a page
+		u8 *base = static_cast<u8 *>( VirtualAlloc( nullptr, reqSize, MEM_RESERVE, PAGE_NOACCESS ) );
+
+		if ( !base )
+			return false;
+	#else
+		u64 alignment = permanentPageSize > transientPageSize ? permanentPageSize : transientPageSize;
+		alignment = alignment > fastBumpPageSize ? alignment : fastBumpPageSize;
+
+		// Reserve a page more than needed so the start can be moved up to a huge page boundary
+		void *range = mmap( nullptr, reqSize + alignment, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0 );
+
+		if ( range == MAP_FAILED )
+			return false;
+
+		u8 *start = static_cast<u8 *>( range );
+		u8 *base = reinterpret_cast<u8 *>( memory_page_round( reinterpret_cast<u64>( start ), alignment ) );
+		u64 head = static_cast<u64>( base - start );
+
+		if ( head )
+			munmap( start, head );
+
+		if ( alignment - head )
+			munmap( base + reqSize, alignment - head );
+
+		// Decoded and merged images come from transient memory, huge pages save most of their faults
+		if ( transientPageSize == MEMORY_HUGE_PAGE_SIZE )
+			madvise( base + permanentReqSize, transientReqSize, MADV_HUGEPAGE );
+	#endif
+
+	memory = base;
+	reserved = reqSize;
+
+	permanent.capacity = permanentSize;
+	permanent.available = permanentSize;
+	permanent.memory = base;
+	permanent.lastAlloc = nullptr;
+	permanent.committed = 0;
+	permanent.touched = 0;
+	permanent.allocate_func = memory_virtual_allocate;
+	permanent.reallocate_func = memory_virtual_reallocate;
+
+	transient.capacity = transientSize;
+	transient.available = transientSize;
+	transient.memory = base + permanentReqSize;
+	transient.lastAlloc = nullptr;
+	transient.committed = 0;
+	transient.touched = 0;
+	transient.allocate_func = memory_virtual_allocate;
+	transient.reallocate_func = memory_virtual_reallocate;
+
+	// The fast bump allocator doesn't track its end, it's committed whole
+	fastBump.capacity = fastBumpSize;
+	fastBump.available = fastBumpSize;
+	fastBump.memory = base + permanentReqSize + transientReqSize;
+	fastBump.lastAlloc = nullptr;
+	fastBump.committed = 0;
+	fastBump.touched = 0;
+
+	flags |= MEMORY_FLAGS_INITIALISED | MEMORY_FLAGS_VIRTUAL;
+
+	if ( !memory_virtual_commit( &fastBump, fastBumpSize ) )
+	{
+		free();
+		return false;
+	}
+
+	memory_stats_begin( this );
+
+	return true;
+}
+
+// ALLOCATOR CONTEXT /////////////////////////////////////////////////////////////////////////////////////////////////
+// Code that can't be handed an allocator, stb_image through its STBI_ macros, allocates from the
+// calling thread's current one. A MemoryScope sets it for as long as the scope lives and then puts
+// back whatever was current before, so threads never share a bump allocator by accident.
+
+static thread_local Allocator *memoryContext = nullptr;
+
+struct MemoryScope
+{
+	explicit MemoryScope( Allocator *allocator ) : prev( memoryContext ) { memoryContext = allocator; }
+	~MemoryScope() { memoryContext = prev; }
+
+	MemoryScope( const MemoryScope & ) = delete;
+	MemoryScope &operator=( const MemoryScope & ) = delete;
+
+	Allocator *prev;
+};
+
+[[nodiscard]] static inline Allocator *memory_context()
+{
+	assert( memoryContext && "allocating outside of a MemoryScope" );
+
+	return memoryContext;
+}
@@ -0,0 +1,471 @@
+#pragma once
+
+// Interleaves up to four planar 8-bit sources into packed grey, RG, RGB or RGBA pixels. Without
+// an alpha source RGBA is filled with a constant alpha.
+// A source reads the first byte of every pixel, stride is the source's bytes per pixel.
+
+struct MergeSource
+{
+	const u8 *data = nullptr;		// nullptr writes 0 for the channel
+	u32 stride = 0;					// 1 to 4
+};
+
+using MergeFunc = void (*)( u8 *out, const MergeSource *sources, u8 alpha, u64 count );
+
+// SCALAR ///////////////////////////////////////////////////////////////////////
+// Reference implementation, every other kernel must match it byte for byte. grey_merger_tests
+// checks each table entry against it, the tool itself never calls it.
+[[maybe_unused]] static void merge_rgba_scalar( u8 *out, const MergeSource *sources, u8 alpha, u64 count )
+{
+	const u8 *r = sources[ 0 ].data;
+	const u8 *g = sources[ 1 ].data;
+	const u8 *b = sources[ 2 ].data;
+	const u8 *a = sources[ 3 ].data;
+
+	for ( u64 i = 0; i < count; ++i )
+	{
+		if ( r )
+		{
+			*out++ = *r;
+			r += sources[ 0 ].stride;
+		}
+		else
+		{
+			*out++ = 0;
+		}
+
+		if ( g )
+		{
+			*out++ = *g;
+			g += sources[ 1 ].stride;
+		}
+		else
+		{
+			*out++ = 0;
+		}
+
+		if ( b )
+		{
+			*out++ = *b;
+			b += sources[ 2 ].stride;
+		}
+		else
+		{
+			*out++ = 0;
+		}
+
+		if ( a )
+		{
+			*out++ = *a;
+			a += sources[ 3 ].stride;
+		}
+		else
+		{
+			*out++ = alpha;
+		}
+	}
+}
+
+// Kernels are instantiated per source stride and output layout so the pixel loops carry
+// no branches. A stride of 0 means the channel is absent and written as a constant 0.
+// An alpha source is packed to a stride of 1 before merging, so alpha only needs 0 (the
+// constant) or 1, which keeps the instantiations down.
+
+#define MERGE_MAX_STRIDE		4
+#define MERGE_STRIDES			( MERGE_MAX_STRIDE + 1 )
+#define MERGE_ALPHA_STRIDES		2
+
+// Output channels, each layout keeps the first channels of RGBA
+enum MERGE_LAYOUT : u32
+{
+	MERGE_LAYOUT_GREY = 1,
+	MERGE_LAYOUT_RG,
+	MERGE_LAYOUT_RGB,
+	MERGE_LAYOUT_RGBA,
+};
+
+struct MergeTable
+{
+	MergeFunc funcs[ MERGE_STRIDES ][ MERGE_STRIDES ][ MERGE_STRIDES ][ MERGE_ALPHA_STRIDES ];
+	MergeFunc extract[ MERGE_STRIDES ];			// grey kernels, used to pack an alpha source
+	MERGE_LAYOUT layout;
+};
+
+template <u32 Stride>
+static inline u8 merge_read( const u8 *src, u64 i )
+{
+	if constexpr ( Stride == 0 )
+		return 0;
+	else
+		return src[ i * Stride ];
+}
+
+template <u32 RStride, u32 GStride, u32 BStride, u32 AStride, MERGE_LAYOUT Layout>
+static void merge_scalar( u8 *out, const MergeSource *sources, u8 alpha, u64 count )
+{
+	const u8 *r = sources[ 0 ].data;
+	const u8 *g = sources[ 1 ].data;
+	const u8 *b = sources[ 2 ].data;
+	const u8 *a = sources[ 3 ].data;
+
+	for ( u64 i = 0; i < count; ++i )
+	{
+		out[ 0 ] = merge_read<RStride>( r, i );
+
+		if constexpr ( Layout >= MERGE_LAYOUT_RG )
+			out[ 1 ] = merge_read<GStride>( g, i );
+
+		if constexpr ( Layout >= MERGE_LAYOUT_RGB )
+			out[ 2 ] = merge_read<BStride>( b, i );
+
+		if constexpr ( Layout == MERGE_LAYOUT_RGBA )
+			out[ 3 ] = AStride ? merge_read<AStride>( a, i ) : alpha;
+
+		out += Layout;
+	}
+}
+
+// Finish the pixels a vector kernel couldn't fit in a full block
+template <u32 RStride, u32 GStride, u32 BStride, u32 AStride, MERGE_LAYOUT Layout>
+static void merge_tail( u8 *out, const MergeSource *sources, u8 alpha, u64 done, u64 count )
+{
+	MergeSource tail[ 4 ] =
+	{
+		{ .data = sources[ 0 ].data + done * RStride, .stride = RStride },
+		{ .data = sources[ 1 ].data + done * GStride, .stride = GStride },
+		{ .data = sources[ 2 ].data + done * BStride, .stride = BStride },
+		{ .data = sources[ 3 ].data + done * AStride, .stride = AStride },
+	};
+
+	merge_scalar<RStride, GStride, BStride, AStride, Layout>( out + done * Layout, tail, alpha, count - done );
+}
+
+#ifdef CPU_X64
+
+// SSE2 /////////////////////////////////////////////////////////////////////////
+// Gather the first byte of 16 pixels
+template <u32 Stride>
+static inline __m128i merge_load_sse2( const u8 *src )
+{
+	if constexpr ( Stride == 0 )
+	{
+		return _mm_setzero_si128();
+	}
+	else if constexpr ( Stride == 1 )
+	{
+		return _mm_loadu_si128( reinterpret_cast<const __m128i *>( src ) );
+	}
+	else if constexpr ( Stride == 2 )
+	{
+		__m128i mask = _mm_set1_epi16( 0x00FF );
+		__m128i a = _mm_and_si128( _mm_loadu_si128( reinterpret_cast<const __m128i *>( src ) ), mask );
+		__m128i b = _mm_and_si128( _mm_loadu_si128( reinterpret_cast<const __m128i *>( src + 16 ) ), mask );
+		return _mm_packus_epi16( a, b );
+	}
+	else if constexpr ( Stride == 3 )
+	{
+		// No byte shuffle before SSSE3
+		alignas( 16 ) u8 lane[ 16 ];
+
+		for ( u32 i = 0; i < 16; ++i )
+			lane[ i ] = src[ i * 3 ];
+
+		return _mm_load_si128( reinterpret_cast<const __m128i *>( lane ) );
+	}
+	else
+	{
+		__m128i mask = _mm_set1_epi32( 0x000000FF );
+		__m128i a = _mm_and_si128( _mm_loadu_si128( reinterpret_cast<const __m128i *>( src ) ), mask );
+		__m128i b = _mm_and_si128( _mm_loadu_si128( reinterpret_cast<const __m128i *>( src + 16 ) ), mask );
+		__m128i c = _mm_and_si128( _mm_loadu_si128( reinterpret_cast<const __m128i *>( src + 32 ) ), mask );
+		__m128i d = _mm_and_si128( _mm_loadu_si128( reinterpret_cast<const __m128i *>( src + 48 ) ), mask );
+		return _mm_packus_epi16( _mm_packs_epi32( a, b ), _mm_packs_epi32( c, d ) );
+	}
+}
+
+template <u32 RStride, u32 GStride, u32 BStride, u32 AStride, MERGE_LAYOUT Layout>
+static void merge_sse2( u8 *out, const MergeSource *sources, u8 alpha, u64 count )
+{
+	if constexpr ( Layout == MERGE_LAYOUT_RGB )
+	{
+		// Packing 3 byte pixels needs a byte shuffle, leave it to the scalar loop
+		merge_scalar<RStride, GStride, BStride, AStride, Layout>( out, sources, alpha, count );
+		return;
+	}
+
+	const __m128i constantAlpha = _mm_set1_epi8( static_cast<char>( alpha ) );
+	const u8 *r = sources[ 0 ].data;
+	const u8 *g = sources[ 1 ].data;
+	const u8 *b = sources[ 2 ].data;
+	const u8 *a = sources[ 3 ].data;
+	u64 blocks = count / 16;
+
+	for ( u64 i = 0; i < blocks; ++i )
+	{
+		u64 p = i * 16;
+		__m128i *dst = reinterpret_cast<__m128i *>( out + p * Layout );
+		__m128i rv = merge_load_sse2<RStride>( r + p * RStride );
+
+		if constexpr ( Layout == MERGE_LAYOUT_GREY )
+		{
+			_mm_storeu_si128( dst, rv );
+		}
+		else if constexpr ( Layout == MERGE_LAYOUT_RG )
+		{
+			__m128i gv = merge_load_sse2<GStride>( g + p * GStride );
+			_mm_storeu_si128( dst + 0, _mm_unpacklo_epi8( rv, gv ) );
+			_mm_storeu_si128( dst + 1, _mm_unpackhi_epi8( rv, gv ) );
+		}
+		else
+		{
+			__m128i gv = merge_load_sse2<GStride>( g + p * GStride );
+			__m128i bv = merge_load_sse2<BStride>( b + p * BStride );
+			__m128i av = AStride ? merge_load_sse2<AStride>( a + p * AStride ) : constantAlpha;
+
+			__m128i rgLo = _mm_unpacklo_epi8( rv, gv );
+			__m128i rgHi = _mm_unpackhi_epi8( rv, gv );
+			__m128i baLo = _mm_unpacklo_epi8( bv, av );
+			__m128i baHi = _mm_unpackhi_epi8( bv, av );
+
+			_mm_storeu_si128( dst + 0, _mm_unpacklo_epi16( rgLo, baLo ) );
+			_mm_storeu_si128( dst + 1, _mm_unpackhi_epi16( rgLo, baLo ) );
+			_mm_storeu_si128( dst + 2, _mm_unpacklo_epi16( rgHi, baHi ) );
+			_mm_storeu_si128( dst + 3, _mm_unpackhi_epi16( rgHi, baHi ) );
+		}
+	}
+
+	merge_tail<RStride, GStride, BStride, AStride, Layout>( out, sources, alpha, blocks * 16, count );
+}
+
+// AVX2 /////////////////////////////////////////////////////////////////////////
+// Gather the first byte of 16 pixels 3 bytes apart
+TARGET_AVX2 static inline __m128i merge_load_stride3( const u8 *src )
+{
+	const __m128i m0 = _mm_setr_epi8( 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 );
+	const __m128i m1 = _mm_setr_epi8( -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1 );
+	const __m128i m2 = _mm_setr_epi8( -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13 );
+	__m128i a = _mm_shuffle_epi8( _mm_loadu_si128( reinterpret_cast<const __m128i *>( src ) ), m0 );
+	__m128i b = _mm_shuffle_epi8( _mm_loadu_si128( reinterpret_cast<const __m128i *>( src + 16 ) ), m1 );
+	__m128i c = _mm_shuffle_epi8( _mm_loadu_si128( reinterpret_cast<const __m128i *>( src + 32 ) ), m2 );
+	return _mm_or_si128( _mm_or_si128( a, b ), c );
+}
+
+// Gather the first byte of 32 pixels
+template <u32 Stride>
+TARGET_AVX2 static inline __m256i merge_load_avx2( const u8 *src )
+{
+	if constexpr ( Stride == 0 )
+	{
+		return _mm256_setzero_si256();
+	}
+	else if constexpr ( Stride == 1 )
+	{
+		return _mm256_loadu_si256( reinterpret_cast<const __m256i *>( src ) );
+	}
+	else if constexpr ( Stride == 2 )
+	{
+		__m256i mask = _mm256_set1_epi16( 0x00FF );
+		__m256i a = _mm256_and_si256( _mm256_loadu_si256( reinterpret_cast<const __m256i *>( src ) ), mask );
+		__m256i b = _mm256_and_si256( _mm256_loadu_si256( reinterpret_cast<const __m256i *>( src + 32 ) ), mask );
+
+		// Packing works per 128 bit lane, put the quarters back in pixel order
+		return _mm256_permute4x64_epi64( _mm256_packus_epi16( a, b ), 0xD8 );
+	}
+	else if constexpr ( Stride == 3 )
+	{
+		__m128i lo = merge_load_stride3( src );
+		__m128i hi = merge_load_stride3( src + 48 );
+		return _mm256_inserti128_si256( _mm256_castsi128_si256( lo ), hi, 1 );
+	}
+	else
+	{
+		__m256i mask = _mm256_set1_epi32( 0x000000FF );
+		__m256i a = _mm256_and_si256( _mm256_loadu_si256( reinterpret_cast<const __m256i *>( src ) ), mask );
+		__m256i b = _mm256_and_si256( _mm256_loadu_si256( reinterpret_cast<const __m256i *>( src + 32 ) ), mask );
+		__m256i c = _mm256_and_si256( _mm256_loadu_si256( reinterpret_cast<const __m256i *>( src + 64 ) ), mask );
+		__m256i d = _mm256_and_si256( _mm256_loadu_si256( reinterpret_cast<const __m256i *>( src + 96 ) ), mask );
+		__m256i packed = _mm256_packus_epi16( _mm256_packus_epi32( a, b ), _mm256_packus_epi32( c, d ) );
+
+		// Each dword holds 4 pixels, lane packing leaves them as 0 2 4 6 1 3 5 7
+		return _mm256_permutevar8x32_epi32( packed, _mm256_setr_epi32( 0, 4, 1, 5, 2, 6, 3, 7 ) );
+	}
+}
+
+// Store 4 RGBA pixels as RGB, the store is 16 bytes wide unless it's the last of the block
+template <bool Last>
+TARGET_AVX2 static inline void merge_store_rgb( u8 *dst, __m128i rgba )
+{
+	const __m128i drop = _mm_setr_epi8( 0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1 );
+	__m128i rgb = _mm_shuffle_epi8( rgba, drop );
+
+	if constexpr ( Last )
+	{
+		u32 high = static_cast<u32>( _mm_cvtsi128_si32( _mm_srli_si128( rgb, 8 ) ) );
+		_mm_storel_epi64( reinterpret_cast<__m128i *>( dst ), rgb );
+		memcpy( dst + 8, &high, 4 );
+	}
+	else
+	{
+		_mm_storeu_si128( reinterpret_cast<__m128i *>( dst ), rgb );
+	}
+}
+
+template <u32 RStride, u32 GStride, u32 BStride, u32 AStride, MERGE_LAYOUT Layout>
+TARGET_AVX2 static void merge_avx2( u8 *out, const MergeSource *sources, u8 alpha, u64 count )
+{
+	const __m256i constantAlpha = _mm256_set1_epi8( static_cast<char>( alpha ) );
+	const u8 *r = sources[ 0 ].data;
+	const u8 *g = sources[ 1 ].data;
+	const u8 *b = sources[ 2 ].data;
+	const u8 *a = sources[ 3 ].data;
+	u64 blocks = count / 32;
+
+	for ( u64 i = 0; i < blocks; ++i )
+	{
+		u64 p = i * 32;
+		u8 *dst = out + p * Layout;
+		__m256i rv = merge_load_avx2<RStride>( r + p * RStride );
+
+		if constexpr ( Layout == MERGE_LAYOUT_GREY )
+		{
+			_mm256_storeu_si256( reinterpret_cast<__m256i *>( dst ), rv );
+		}
+		else if constexpr ( Layout == MERGE_LAYOUT_RG )
+		{
+			__m256i gv = merge_load_avx2<GStride>( g + p * GStride );
+			__m256i rgLo = _mm256_unpacklo_epi8( rv, gv );		// 0-7  | 16-23
+			__m256i rgHi = _mm256_unpackhi_epi8( rv, gv );		// 8-15 | 24-31
+
+			_mm256_storeu_si256( reinterpret_cast<__m256i *>( dst ), _mm256_permute2x128_si256( rgLo, rgHi, 0x20 ) );
+			_mm256_storeu_si256( reinterpret_cast<__m256i *>( dst + 32 ), _mm256_permute2x128_si256( rgLo, rgHi, 0x31 ) );
+		}
+		else
+		{
+			__m256i gv = merge_load_avx2<GStride>( g + p * GStride );
+			__m256i bv = merge_load_avx2<BStride>( b + p * BStride );
+			__m256i av = constantAlpha;
+
+			if constexpr ( AStride != 0 )
+				av = merge_load_avx2<AStride>( a + p * AStride );
+
+			// Unpacking also works per 128 bit lane, so lane 0 holds pixels 0-15 and lane 1 pixels 16-31
+			__m256i rgLo = _mm256_unpacklo_epi8( rv, gv );
+			__m256i rgHi = _mm256_unpackhi_epi8( rv, gv );
+			__m256i baLo = _mm256_unpacklo_epi8( bv, av );
+			__m256i baHi = _mm256_unpackhi_epi8( bv, av );
+
+			__m256i p0 = _mm256_unpacklo_epi16( rgLo, baLo );		// 0-3   | 16-19
+			__m256i p1 = _mm256_unpackhi_epi16( rgLo, baLo );		// 4-7   | 20-23
+			__m256i p2 = _mm256_unpacklo_epi16( rgHi, baHi );		// 8-11  | 24-27
+			__m256i p3 = _mm256_unpackhi_epi16( rgHi, baHi );		// 12-15 | 28-31
+
+			if constexpr ( Layout == MERGE_LAYOUT_RGB )
+			{
+				// Each 16 byte store overlaps the next group by 4 bytes, which that group rewrites
+				merge_store_rgb<false>( dst + 0, _mm256_castsi256_si128( p0 ) );
+				merge_store_rgb<false>( dst + 12, _mm256_castsi256_si128( p1 ) );
+				merge_store_rgb<false>( dst + 24, _mm256_castsi256_si128( p2 ) );
+				merge_store_rgb<false>( dst + 36, _mm256_castsi256_si128( p3 ) );
+				merge_store_rgb<false>( dst + 48, _mm256_extracti128_si256( p0, 1 ) );
+				merge_store_rgb<false>( dst + 60, _mm256_extracti128_si256( p1, 1 ) );
+				merge_store_rgb<false>( dst + 72, _mm256_extracti128_si256( p2, 1 ) );
+				merge_store_rgb<true>( dst + 84, _mm256_extracti128_si256( p3, 1 ) );
+			}
+			else
+			{
+				__m256i *dst4 = reinterpret_cast<__m256i *>( dst );
+				_mm256_storeu_si256( dst4 + 0, _mm256_permute2x128_si256( p0, p1, 0x20 ) );
+				_mm256_storeu_si256( dst4 + 1, _mm256_permute2x128_si256( p2, p3, 0x20 ) );
+				_mm256_storeu_si256( dst4 + 2, _mm256_permute2x128_si256( p0, p1, 0x31 ) );
+				_mm256_storeu_si256( dst4 + 3, _mm256_permute2x128_si256( p2, p3, 0x31 ) );
+			}
+		}
+	}
+
+	merge_tail<RStride, GStride, BStride, AStride, Layout>( out, sources, alpha, blocks * 32, count );
+}
+
+#endif // CPU_X64
+
+// DISPATCH /////////////////////////////////////////////////////////////////////
+enum MERGE_ISA : u32
+{
+	MERGE_ISA_SCALAR,
+	MERGE_ISA_SSE2,
+	MERGE_ISA_AVX2,
+};
+
+template <MERGE_ISA Isa, u32 RStride, u32 GStride, u32 BStride, u32 AStride, MERGE_LAYOUT Layout>
+static MergeFunc merge_kernel()
+{
+	#ifdef CPU_X64
+		if constexpr ( Isa == MERGE_ISA_AVX2 )
+			return merge_avx2<RStride, GStride, BStride, AStride, Layout>;
+		else if constexpr ( Isa == MERGE_ISA_SSE2 )
+			return merge_sse2<RStride, GStride, BStride, AStride, Layout>;
+		else
+			return merge_scalar<RStride, GStride, BStride, AStride, Layout>;
+	#else
+		return merge_scalar<RStride, GStride, BStride, AStride, Layout>;
+	#endif
+}
+
+// Channels the layout has no room for are left out of the table
+template <MERGE_ISA Isa, MERGE_LAYOUT Layout, u32 Index = 0>
+static void merge_fill_table( MergeTable *table )
+{
+	if constexpr ( Index < MERGE_STRIDES * MERGE_STRIDES * MERGE_STRIDES * MERGE_ALPHA_STRIDES )
+	{
+		constexpr u32 r = Index / ( MERGE_STRIDES * MERGE_STRIDES * MERGE_ALPHA_STRIDES );
+		constexpr u32 g = ( Index / ( MERGE_STRIDES * MERGE_ALPHA_STRIDES ) ) % MERGE_STRIDES;
+		constexpr u32 b = ( Index / MERGE_ALPHA_STRIDES ) % MERGE_STRIDES;
+		constexpr u32 a = Index % MERGE_ALPHA_STRIDES;
+
+		constexpr bool used = ( g == 0 || Layout >= MERGE_LAYOUT_RG ) && ( b == 0 || Layout >= MERGE_LAYOUT_RGB ) && ( a == 0 || Layout == MERGE_LAYOUT_RGBA );
+
+		if constexpr ( used )
+			table->funcs[ r ][ g ][ b ][ a ] = merge_kernel<Isa, r, g, b, a, Layout>();
+		else
+			table->funcs[ r ][ g ][ b ][ a ] = nullptr;
+
+		if constexpr ( Index < MERGE_STRIDES )
+			table->extract[ Index ] = merge_kernel<Isa, Index, 0, 0, 0, MERGE_LAYOUT_GREY>();
+
+		merge_fill_table<Isa, Layout, Index + 1>( table );
+	}
+}
+
+template <MERGE_ISA Isa>
+static void merge_fill_layout( MergeTable *table, MERGE_LAYOUT layout )
+{
+	switch ( layout )
+	{
+	case MERGE_LAYOUT_GREY: merge_fill_table<Isa, MERGE_LAYOUT_GREY>( table ); break;
+	case MERGE_LAYOUT_RG: merge_fill_table<Isa, MERGE_LAYOUT_RG>( table ); break;
+	case MERGE_LAYOUT_RGB: merge_fill_table<Isa, MERGE_LAYOUT_RGB>( table ); break;
+	case MERGE_LAYOUT_RGBA: merge_fill_table<Isa, MERGE_LAYOUT_RGBA>( table ); break;
+	}
+}
+
+// Fill the table with the kernels for the chosen layout on the best instruction set available
+static void merge_build_table( MergeTable *table, CpuFeatures features, MERGE_LAYOUT layout )
+{
+	table->layout = layout;
+
+	if ( features & CPU_FEATURE_AVX2 )
+		merge_fill_layout<MERGE_ISA_AVX2>( table, layout );
+	else if ( features & CPU_FEATURE_SSE2 )
+		merge_fill_layout<MERGE_ISA_SSE2>( table, layout );
+	else
+		merge_fill_layout<MERGE_ISA_SCALAR>( table, layout );
+}
+
+// Pick the kernel for a set of source strides, an absent source uses stride 0 and an alpha
+// source must already be packed to a stride of 1
+[[nodiscard]] static MergeFunc merge_find( const MergeTable &table, u32 r, u32 g, u32 b, u32 a )
+{
+	assert( r <= MERGE_MAX_STRIDE && g <= MERGE_MAX_STRIDE && b <= MERGE_MAX_STRIDE && a < MERGE_ALPHA_STRIDES );
+	assert( table.funcs[ r ][ g ][ b ][ a ] );
+
+	return table.funcs[ r ][ g ][ b ][ a ];
+}
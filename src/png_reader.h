@@ -0,0 +1,434 @@
+#pragma once
+
+// Row by row PNG decoder. Each call to png_reader_next_row unfilters one scanline and hands
+// back the first byte of the first channel of every pixel, so no decoded image is ever built.
+// Anything other than non-interlaced 8/16 bit grey, grey alpha, rgb, rgba or 8 bit palette
+// images is reported as unsupported and left to stb_image.
+
+#define PNG_READER_BUFFER_SIZE		KB( 64 )
+
+enum PNG_READER_RESULT : u32
+{
+	PNG_READER_RESULT_OK,
+	PNG_READER_RESULT_UNSUPPORTED,
+	PNG_READER_RESULT_FAILED,
+};
+
+enum PNG_COLOUR_TYPE : u8
+{
+	PNG_COLOUR_TYPE_GREY		= 0,
+	PNG_COLOUR_TYPE_RGB			= 2,
+	PNG_COLOUR_TYPE_PALETTE		= 3,
+	PNG_COLOUR_TYPE_GREY_ALPHA	= 4,
+	PNG_COLOUR_TYPE_RGBA		= 6,
+};
+
+struct PngReader
+{
+	MappedFile map;							// the whole file when it could be mapped, buffer then points into it
+	FILE *file;
+	u8 *storage;							// buffered reads otherwise
+	const u8 *buffer;
+	u64 bufferPos;
+	u64 bufferEnd;
+	u32 chunkRemaining;						// bytes of the current IDAT chunk still unread
+
+	u32 width;
+	u32 height;
+	u8 depth;
+	u8 colourType;
+	u32 bytesPerPixel;
+	u64 rowBytes;
+	u32 row;
+
+	u8 palette[ 256 ];						// red component of each palette entry
+	u8 *prevRow;
+	u8 *currRow;
+	u8 *channelRow;							// first channel gathered out when it can't be read in place
+	u32 stride;								// bytes between pixels of the row handed back
+
+	Inflater inflater;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+[[nodiscard]] static inline u32 png_read_u32( const u8 *p )
+{
+	return ( static_cast<u32>( p[ 0 ] ) << 24 ) | ( static_cast<u32>( p[ 1 ] ) << 16 ) | ( static_cast<u32>( p[ 2 ] ) << 8 ) | p[ 3 ];
+}
+
+// Top the buffer back up, keeping any bytes not yet consumed. A mapped file is already all there.
+[[nodiscard]] static bool png_reader_fill( PngReader *reader )
+{
+	if ( !reader->file )
+		return false;
+
+	u64 remaining = reader->bufferEnd - reader->bufferPos;
+	memmove( reader->storage, reader->storage + reader->bufferPos, remaining );
+	reader->bufferPos = 0;
+	reader->bufferEnd = remaining + fread( reader->storage + remaining, 1, PNG_READER_BUFFER_SIZE - remaining, reader->file );
+
+	return reader->bufferEnd > remaining;
+}
+
+[[nodiscard]] static bool png_reader_read( PngReader *reader, u8 *dst, u64 size )
+{
+	while ( size > 0 )
+	{
+		if ( reader->bufferPos == reader->bufferEnd && !png_reader_fill( reader ) )
+			return false;
+
+		u64 count = reader->bufferEnd - reader->bufferPos;
+		count = count < size ? count : size;
+		memcpy( dst, reader->buffer + reader->bufferPos, count );
+		reader->bufferPos += count;
+		dst += count;
+		size -= count;
+	}
+
+	return true;
+}
+
+[[nodiscard]] static bool png_reader_skip( PngReader *reader, u64 size )
+{
+	while ( size > 0 )
+	{
+		if ( reader->bufferPos == reader->bufferEnd && !png_reader_fill( reader ) )
+			return false;
+
+		u64 count = reader->bufferEnd - reader->bufferPos;
+		count = count < size ? count : size;
+		reader->bufferPos += count;
+		size -= count;
+	}
+
+	return true;
+}
+
+// Read a chunk header, returns the chunk length and fills in type
+[[nodiscard]] static bool png_reader_chunk( PngReader *reader, u32 *length, u8 type[ 4 ] )
+{
+	u8 header[ 8 ];
+
+	if ( !png_reader_read( reader, header, sizeof( header ) ) )
+		return false;
+
+	*length = png_read_u32( header );
+	memcpy( type, header + 4, 4 );
+
+	return true;
+}
+
+// Inflater refill, hands over the buffered part of the current IDAT chunk and moves
+// on through any following IDAT chunks
+static bool png_reader_refill( void *user, const u8 **in, const u8 **inEnd )
+{
+	PngReader *reader = static_cast<PngReader *>( user );
+
+	while ( reader->chunkRemaining == 0 )
+	{
+		u32 length;
+		u8 type[ 4 ];
+
+		// Skip the crc of the last chunk
+		if ( !png_reader_skip( reader, 4 ) || !png_reader_chunk( reader, &length, type ) )
+			return false;
+
+		if ( memcmp( type, "IDAT", 4 ) != 0 )
+			return false;
+
+		reader->chunkRemaining = length;
+	}
+
+	if ( reader->bufferPos == reader->bufferEnd && !png_reader_fill( reader ) )
+		return false;
+
+	u64 count = reader->bufferEnd - reader->bufferPos;
+	count = count < reader->chunkRemaining ? count : reader->chunkRemaining;
+
+	*in = reader->buffer + reader->bufferPos;
+	*inEnd = *in + count;
+
+	reader->bufferPos += count;
+	reader->chunkRemaining -= static_cast<u32>( count );
+
+	return true;
+}
+
+// Read the signature and IHDR, which sit at the very start of the file
+[[nodiscard]] static PNG_READER_RESULT png_reader_header( PngReader *reader, const u8 header[ 8 + 8 + 13 ] )
+{
+	static const u8 signature[ 8 ] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+
+	// Not a png (or an apple CgBI one), let stb_image have a go
+	if ( memcmp( header, signature, 8 ) != 0 || memcmp( header + 12, "IHDR", 4 ) != 0 )
+		return PNG_READER_RESULT_UNSUPPORTED;
+
+	reader->width = png_read_u32( header + 16 );
+	reader->height = png_read_u32( header + 20 );
+	reader->depth = header[ 24 ];
+	reader->colourType = header[ 25 ];
+	u8 interlace = header[ 28 ];
+
+	if ( reader->width == 0 || reader->height == 0 || interlace != 0 )
+		return PNG_READER_RESULT_UNSUPPORTED;
+
+	u32 channels;
+
+	switch ( reader->colourType )
+	{
+	case PNG_COLOUR_TYPE_GREY: channels = 1; break;
+	case PNG_COLOUR_TYPE_RGB: channels = 3; break;
+	case PNG_COLOUR_TYPE_PALETTE: channels = 1; break;
+	case PNG_COLOUR_TYPE_GREY_ALPHA: channels = 2; break;
+	case PNG_COLOUR_TYPE_RGBA: channels = 4; break;
+	default: return PNG_READER_RESULT_UNSUPPORTED;
+	}
+
+	bool paletteDepth = reader->colourType == PNG_COLOUR_TYPE_PALETTE && reader->depth == 8;
+	bool directDepth = reader->colourType != PNG_COLOUR_TYPE_PALETTE && ( reader->depth == 8 || reader->depth == 16 );
+
+	if ( !paletteDepth && !directDepth )
+		return PNG_READER_RESULT_UNSUPPORTED;
+
+	reader->bytesPerPixel = channels * reader->depth / 8;
+	reader->rowBytes = static_cast<u64>( reader->width ) * reader->bytesPerPixel;
+
+	// Only 16 bit rgb(a) and palette images need the channel gathering out
+	bool gather = reader->colourType == PNG_COLOUR_TYPE_PALETTE || reader->bytesPerPixel > 4;
+	reader->stride = gather ? 1 : reader->bytesPerPixel;
+
+	return PNG_READER_RESULT_OK;
+}
+
+// Bytes png_reader_open takes from the allocator once the header is read
+[[nodiscard]] static u64 png_reader_memory( const PngReader &reader )
+{
+	// The read buffer goes unused when the file is mapped, but that's only known once it's opened
+	u64 size = PNG_READER_BUFFER_SIZE + MEMORY_ALLOCATION_OVERHEAD;
+	size += ( reader.rowBytes + 8 + MEMORY_ALLOCATION_OVERHEAD ) * 2;
+	size += reader.colourType == PNG_COLOUR_TYPE_PALETTE || reader.bytesPerPixel > 4 ? reader.width + MEMORY_ALLOCATION_OVERHEAD : 0;
+	size += inflate_memory( reader.rowBytes + 1 ) + MEMORY_ALLOCATION_OVERHEAD;
+
+	return size;
+}
+
+// Read just the header. OK means png_reader_open will stream the file, the reader then has its
+// size, stride and everything png_reader_memory needs.
+[[nodiscard]] static PNG_READER_RESULT png_reader_info( PngReader *reader, const char *filename )
+{
+	*reader = {};
+
+	FILE *file = fopen( filename, "rb" );
+
+	if ( !file )
+		return PNG_READER_RESULT_FAILED;
+
+	u8 header[ 8 + 8 + 13 ];
+	bool read = fread( header, sizeof( header ), 1, file ) == 1;
+	fclose( file );
+
+	return read ? png_reader_header( reader, header ) : PNG_READER_RESULT_UNSUPPORTED;
+}
+
+[[nodiscard]] static PNG_READER_RESULT png_reader_open( PngReader *reader, Allocator *allocator, const char *filename )
+{
+	*reader = {};
+
+	if ( mapped_file_open( &reader->map, filename ) )
+	{
+		reader->buffer = reader->map.data;
+		reader->bufferEnd = reader->map.size;
+	}
+	else
+	{
+		reader->file = fopen( filename, "rb" );
+
+		if ( !reader->file )
+			return PNG_READER_RESULT_FAILED;
+
+		reader->storage = allocator->allocate<u8>( PNG_READER_BUFFER_SIZE );
+		reader->buffer = reader->storage;
+
+		if ( !reader->storage )
+			return PNG_READER_RESULT_FAILED;
+	}
+
+	u8 header[ 8 + 8 + 13 ];
+
+	if ( !png_reader_read( reader, header, sizeof( header ) ) )
+		return PNG_READER_RESULT_UNSUPPORTED;
+
+	PNG_READER_RESULT result = png_reader_header( reader, header );
+
+	if ( result != PNG_READER_RESULT_OK )
+		return result;
+
+	// Walk the chunks up to the image data, the crc of IHDR is still unread
+	bool hasPalette = false;
+	u32 length;
+	u8 type[ 4 ];
+
+	if ( !png_reader_skip( reader, 4 ) )
+		return PNG_READER_RESULT_FAILED;
+
+	while ( true )
+	{
+		if ( !png_reader_chunk( reader, &length, type ) )
+			return PNG_READER_RESULT_FAILED;
+
+		if ( memcmp( type, "IDAT", 4 ) == 0 )
+			break;
+
+		if ( memcmp( type, "IEND", 4 ) == 0 )
+			return PNG_READER_RESULT_FAILED;
+
+		if ( memcmp( type, "PLTE", 4 ) == 0 && reader->colourType == PNG_COLOUR_TYPE_PALETTE )
+		{
+			u8 plte[ 256 * 3 ];
+
+			if ( length > sizeof( plte ) || length % 3 != 0 || !png_reader_read( reader, plte, length ) )
+				return PNG_READER_RESULT_FAILED;
+
+			for ( u32 i = 0; i < length / 3; ++i )
+				reader->palette[ i ] = plte[ i * 3 ];
+
+			hasPalette = true;
+
+			if ( !png_reader_skip( reader, 4 ) )
+				return PNG_READER_RESULT_FAILED;
+		}
+		else if ( !png_reader_skip( reader, static_cast<u64>( length ) + 4 ) )
+		{
+			return PNG_READER_RESULT_FAILED;
+		}
+	}
+
+	if ( reader->colourType == PNG_COLOUR_TYPE_PALETTE && !hasPalette )
+		return PNG_READER_RESULT_FAILED;
+
+	reader->chunkRemaining = length;
+
+	// The rows carry a filter byte in front, and a zeroed pixel before it makes the
+	// left neighbour of the first pixel read as 0 without a special case
+	u64 rowAlloc = reader->rowBytes + 8;
+	reader->prevRow = allocator->allocate<u8>( rowAlloc, true );
+	reader->currRow = allocator->allocate<u8>( rowAlloc, true );
+
+	// Only 16 bit rgb(a) and palette images need the channel gathering out
+	bool gather = reader->colourType == PNG_COLOUR_TYPE_PALETTE || reader->bytesPerPixel > 4;
+
+	if ( gather )
+		reader->channelRow = allocator->allocate<u8>( reader->width );
+
+	if ( !reader->prevRow || !reader->currRow || ( gather && !reader->channelRow ) )
+		return PNG_READER_RESULT_FAILED;
+
+	if ( !inflate_init( &reader->inflater, allocator, reader->rowBytes + 1, png_reader_refill, reader ) )
+		return PNG_READER_RESULT_FAILED;
+
+	return PNG_READER_RESULT_OK;
+}
+
+static void png_reader_close( PngReader *reader )
+{
+	if ( reader->file )
+		fclose( reader->file );
+
+	mapped_file_close( &reader->map );
+	reader->file = nullptr;
+}
+
+[[nodiscard]] static inline u8 png_paeth( i32 a, i32 b, i32 c )
+{
+	i32 p = a + b - c;
+	i32 pa = p > a ? p - a : a - p;
+	i32 pb = p > b ? p - b : b - p;
+	i32 pc = p > c ? p - c : c - p;
+
+	if ( pa <= pb && pa <= pc )
+		return static_cast<u8>( a );
+
+	if ( pb <= pc )
+		return static_cast<u8>( b );
+
+	return static_cast<u8>( c );
+}
+
+// Undo the row filter into cur using the previous row prev. Both point at the first pixel
+// and have bpp zeroed bytes in front of them.
+static bool png_unfilter( u8 filter, const u8 *src, u8 *cur, const u8 *prev, u64 rowBytes, u32 bpp )
+{
+	switch ( filter )
+	{
+	case 0:
+		memcpy( cur, src, rowBytes );
+		return true;
+
+	case 1:
+		for ( u64 i = 0; i < rowBytes; ++i )
+			cur[ i ] = static_cast<u8>( src[ i ] + cur[ static_cast<i64>( i ) - bpp ] );
+		return true;
+
+	case 2:
+		for ( u64 i = 0; i < rowBytes; ++i )
+			cur[ i ] = static_cast<u8>( src[ i ] + prev[ i ] );
+		return true;
+
+	case 3:
+		for ( u64 i = 0; i < rowBytes; ++i )
+			cur[ i ] = static_cast<u8>( src[ i ] + ( ( cur[ static_cast<i64>( i ) - bpp ] + prev[ i ] ) >> 1 ) );
+		return true;
+
+	case 4:
+		for ( u64 i = 0; i < rowBytes; ++i )
+			cur[ i ] = static_cast<u8>( src[ i ] + png_paeth( cur[ static_cast<i64>( i ) - bpp ], prev[ i ], prev[ static_cast<i64>( i ) - bpp ] ) );
+		return true;
+	}
+
+	return false;
+}
+
+// Decode the next scanline. Returns the first channel of the first pixel, the next pixel is
+// stride bytes on. 16 bit images read the high byte. nullptr if the data is corrupt.
+[[nodiscard]] static const u8 *png_reader_next_row( PngReader *reader )
+{
+	if ( reader->row >= reader->height )
+		return nullptr;
+
+	const u8 *src = inflate_read( &reader->inflater, reader->rowBytes + 1 );
+
+	if ( !src )
+		return nullptr;
+
+	u8 *tmp = reader->prevRow;
+	reader->prevRow = reader->currRow;
+	reader->currRow = tmp;
+
+	// Pixel data starts after the padding
+	u8 *cur = reader->currRow + 8;
+	const u8 *prev = reader->prevRow + 8;
+
+	if ( !png_unfilter( src[ 0 ], src + 1, cur, prev, reader->rowBytes, reader->bytesPerPixel ) )
+		return nullptr;
+
+	reader->row += 1;
+
+	if ( reader->colourType == PNG_COLOUR_TYPE_PALETTE )
+	{
+		for ( u32 x = 0; x < reader->width; ++x )
+			reader->channelRow[ x ] = reader->palette[ cur[ x ] ];
+
+		return reader->channelRow;
+	}
+
+	if ( reader->bytesPerPixel > 4 )
+	{
+		for ( u32 x = 0; x < reader->width; ++x )
+			reader->channelRow[ x ] = cur[ static_cast<u64>( x ) * reader->bytesPerPixel ];
+
+		return reader->channelRow;
+	}
+
+	return cur;
+}
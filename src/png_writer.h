@@ -0,0 +1,866 @@
+#pragma once
+
+// PNG encoder that spreads the work over the thread pool. The filtered image is cut into slices
+// on row boundaries, each slice is deflated on its own with the 32KB before it as a dictionary
+// and becomes one IDAT chunk. Slices only depend on the image, never on the thread count, so
+// the file is byte identical however many threads wrote it.
+
+#define PNG_WRITER_SLICE_SIZE		KB( 128 )
+
+struct PngWriteSlice
+{
+	u32 row;								// first row of the slice
+	u32 rows;
+	u8 *chunk;								// the whole IDAT chunk, length and crc included
+	u64 chunkSize;
+	u32 adler;								// adler32 of the filtered bytes of the slice
+	u32 crc;								// crc of the chunk so far
+};
+
+struct PngWriter
+{
+	const u8 *image;
+	u32 width;
+	u32 height;
+	u32 channels;
+	u64 rowBytes;
+	u64 filteredRowBytes;					// row plus its filter type byte
+	u8 *filtered;
+	const u8 *zeroRow;						// stands in for the row above the first
+	u32 filter;								// every row uses this filter, PNG_FILTER_COUNT picks per row
+	const DeflateLevel *level;
+
+	PngWriteSlice *slices;
+	u64 sliceCount;
+	std::atomic<u64> nextSlice;
+};
+
+struct PngWriteWorker
+{
+	PngWriter *writer;
+	Deflater *deflater;
+	u8 *scratch;							// two rows for the exhaustive filter search
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct PngCrcTable
+{
+	u32 values[ 256 ];
+
+	constexpr PngCrcTable() : values()
+	{
+		for ( u32 n = 0; n < 256; ++n )
+		{
+			u32 c = n;
+
+			for ( u32 k = 0; k < 8; ++k )
+				c = ( c & 1 ) ? 0xEDB88320u ^ ( c >> 1 ) : c >> 1;
+
+			values[ n ] = c;
+		}
+	}
+};
+
+static constexpr PngCrcTable pngCrcTable;
+
+// Continues a crc, start with 0
+[[nodiscard]] static u32 png_crc32( u32 crc, const u8 *data, u64 size )
+{
+	crc = ~crc;
+
+	for ( u64 i = 0; i < size; ++i )
+		crc = pngCrcTable.values[ ( crc ^ data[ i ] ) & 0xFF ] ^ ( crc >> 8 );
+
+	return ~crc;
+}
+
+static inline void png_write_u32( u8 *p, u32 value )
+{
+	p[ 0 ] = static_cast<u8>( value >> 24 );
+	p[ 1 ] = static_cast<u8>( value >> 16 );
+	p[ 2 ] = static_cast<u8>( value >> 8 );
+	p[ 3 ] = static_cast<u8>( value );
+}
+
+// FILTERING /////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+enum PNG_FILTER : u32
+{
+	PNG_FILTER_NONE,
+	PNG_FILTER_SUB,
+	PNG_FILTER_UP,
+	PNG_FILTER_AVERAGE,
+	PNG_FILTER_PAETH,
+	PNG_FILTER_COUNT,
+};
+
+// How each row's filter is chosen
+enum PNG_FILTER_MODE : u8
+{
+	PNG_FILTER_MODE_EXHAUSTIVE,				// try all five on every row, keep the one that scores best
+	PNG_FILTER_MODE_SAMPLED,				// score all five on a few rows, use the winner everywhere
+	PNG_FILTER_MODE_NONE,					// one filter for every row
+	PNG_FILTER_MODE_SUB,
+	PNG_FILTER_MODE_UP,
+	PNG_FILTER_MODE_AVERAGE,
+	PNG_FILTER_MODE_PAETH,
+};
+
+#define PNG_WRITER_FILTER_SAMPLES	64
+
+// Filters a row into out and returns its score, the sum of the absolute signed bytes, which is
+// the estimate stb uses. The row above is all zero for the first row.
+using PngFilterFunc = u64 ( * )( u8 *out, const u8 *row, const u8 *above, u64 rowBytes, u32 bpp );
+
+[[nodiscard]] static inline u8 png_paeth_predict( i32 a, i32 b, i32 c )
+{
+	i32 p = a + b - c;
+	i32 pa = abs( p - a );
+	i32 pb = abs( p - b );
+	i32 pc = abs( p - c );
+
+	if ( pa <= pb && pa <= pc )
+		return static_cast<u8>( a );
+
+	return static_cast<u8>( pb <= pc ? b : c );
+}
+
+// Filters bytes start to end, bytes before bpp have no left neighbour
+template <u32 Filter>
+[[nodiscard]] static u64 png_filter_range( u8 *out, const u8 *row, const u8 *above, u64 start, u64 end, u32 bpp )
+{
+	u64 score = 0;
+
+	for ( u64 i = start; i < end; ++i )
+	{
+		u8 a = i >= bpp ? row[ i - bpp ] : 0;
+		u8 b = above[ i ];
+		u8 c = i >= bpp ? above[ i - bpp ] : 0;
+		u8 value;
+
+		if constexpr ( Filter == PNG_FILTER_SUB )
+			value = static_cast<u8>( row[ i ] - a );
+		else if constexpr ( Filter == PNG_FILTER_UP )
+			value = static_cast<u8>( row[ i ] - b );
+		else if constexpr ( Filter == PNG_FILTER_AVERAGE )
+			value = static_cast<u8>( row[ i ] - ( ( a + b ) >> 1 ) );
+		else if constexpr ( Filter == PNG_FILTER_PAETH )
+			value = static_cast<u8>( row[ i ] - png_paeth_predict( a, b, c ) );
+		else
+			value = row[ i ];
+
+		out[ i ] = value;
+		score += abs( static_cast<i8>( value ) );
+	}
+
+	return score;
+}
+
+template <u32 Filter>
+[[nodiscard]] static u64 png_filter_scalar( u8 *out, const u8 *row, const u8 *above, u64 rowBytes, u32 bpp )
+{
+	return png_filter_range<Filter>( out, row, above, 0, rowBytes, bpp );
+}
+
+#ifdef CPU_X64
+// Paeth predictor on 8 pixels widened to 16 bits, picks a, then b, then c on ties
+[[nodiscard]] static inline __m128i png_paeth_sse2( __m128i a, __m128i b, __m128i c )
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128i pb = _mm_sub_epi16( a, c );			// p - b
+	__m128i pa = _mm_sub_epi16( b, c );			// p - a
+	__m128i pc = _mm_add_epi16( pa, pb );		// p - c
+
+	pa = _mm_max_epi16( pa, _mm_sub_epi16( zero, pa ) );
+	pb = _mm_max_epi16( pb, _mm_sub_epi16( zero, pb ) );
+	pc = _mm_max_epi16( pc, _mm_sub_epi16( zero, pc ) );
+
+	__m128i notA = _mm_or_si128( _mm_cmpgt_epi16( pa, pb ), _mm_cmpgt_epi16( pa, pc ) );
+	__m128i notB = _mm_cmpgt_epi16( pb, pc );
+	__m128i bc = _mm_or_si128( _mm_andnot_si128( notB, b ), _mm_and_si128( notB, c ) );
+
+	return _mm_or_si128( _mm_andnot_si128( notA, a ), _mm_and_si128( notA, bc ) );
+}
+
+// 16 bytes at a time, the first pixel and the tail go through the scalar filter
+template <u32 Filter>
+[[nodiscard]] static u64 png_filter_sse2( u8 *out, const u8 *row, const u8 *above, u64 rowBytes, u32 bpp )
+{
+	u64 start = bpp < rowBytes ? bpp : rowBytes;
+	u64 score = png_filter_range<Filter>( out, row, above, 0, start, bpp );
+	u64 i = start;
+
+	__m128i zero = _mm_setzero_si128();
+	__m128i one = _mm_set1_epi8( 1 );
+	__m128i sum = zero;
+
+	for ( ; i + 16 <= rowBytes; i += 16 )
+	{
+		__m128i x = _mm_loadu_si128( reinterpret_cast<const __m128i *>( row + i ) );
+		__m128i value;
+
+		if constexpr ( Filter == PNG_FILTER_SUB )
+		{
+			__m128i a = _mm_loadu_si128( reinterpret_cast<const __m128i *>( row + i - bpp ) );
+			value = _mm_sub_epi8( x, a );
+		}
+		else if constexpr ( Filter == PNG_FILTER_UP )
+		{
+			__m128i b = _mm_loadu_si128( reinterpret_cast<const __m128i *>( above + i ) );
+			value = _mm_sub_epi8( x, b );
+		}
+		else if constexpr ( Filter == PNG_FILTER_AVERAGE )
+		{
+			// avg rounds up, take the carried bit back off to get the floor
+			__m128i a = _mm_loadu_si128( reinterpret_cast<const __m128i *>( row + i - bpp ) );
+			__m128i b = _mm_loadu_si128( reinterpret_cast<const __m128i *>( above + i ) );
+			__m128i average = _mm_sub_epi8( _mm_avg_epu8( a, b ), _mm_and_si128( _mm_xor_si128( a, b ), one ) );
+			value = _mm_sub_epi8( x, average );
+		}
+		else if constexpr ( Filter == PNG_FILTER_PAETH )
+		{
+			__m128i a = _mm_loadu_si128( reinterpret_cast<const __m128i *>( row + i - bpp ) );
+			__m128i b = _mm_loadu_si128( reinterpret_cast<const __m128i *>( above + i ) );
+			__m128i c = _mm_loadu_si128( reinterpret_cast<const __m128i *>( above + i - bpp ) );
+
+			__m128i lo = png_paeth_sse2( _mm_unpacklo_epi8( a, zero ), _mm_unpacklo_epi8( b, zero ), _mm_unpacklo_epi8( c, zero ) );
+			__m128i hi = png_paeth_sse2( _mm_unpackhi_epi8( a, zero ), _mm_unpackhi_epi8( b, zero ), _mm_unpackhi_epi8( c, zero ) );
+			value = _mm_sub_epi8( x, _mm_packus_epi16( lo, hi ) );
+		}
+		else
+		{
+			value = x;
+		}
+
+		_mm_storeu_si128( reinterpret_cast<__m128i *>( out + i ), value );
+
+		// |v| of a signed byte read as unsigned is the smaller of v and -v
+		__m128i magnitude = _mm_min_epu8( value, _mm_sub_epi8( zero, value ) );
+		sum = _mm_add_epi64( sum, _mm_sad_epu8( magnitude, zero ) );
+	}
+
+	score += static_cast<u64>( _mm_cvtsi128_si64( sum ) ) + static_cast<u64>( _mm_cvtsi128_si64( _mm_unpackhi_epi64( sum, sum ) ) );
+
+	return score + png_filter_range<Filter>( out, row, above, i, rowBytes, bpp );
+}
+
+static const PngFilterFunc pngFilters[ PNG_FILTER_COUNT ] =
+{
+	png_filter_sse2<PNG_FILTER_NONE>,
+	png_filter_sse2<PNG_FILTER_SUB>,
+	png_filter_sse2<PNG_FILTER_UP>,
+	png_filter_sse2<PNG_FILTER_AVERAGE>,
+	png_filter_sse2<PNG_FILTER_PAETH>,
+};
+#else
+static const PngFilterFunc pngFilters[ PNG_FILTER_COUNT ] =
+{
+	png_filter_scalar<PNG_FILTER_NONE>,
+	png_filter_scalar<PNG_FILTER_SUB>,
+	png_filter_scalar<PNG_FILTER_UP>,
+	png_filter_scalar<PNG_FILTER_AVERAGE>,
+	png_filter_scalar<PNG_FILTER_PAETH>,
+};
+#endif
+
+// Try every filter and keep the best. Candidates alternate between the two scratch rows so the
+// best so far is never overwritten.
+static void png_filter_row_exhaustive( u8 *dst, const u8 *row, const u8 *above, u64 rowBytes, u32 bpp, u8 *scratch )
+{
+	u8 *candidates[ 2 ] = { scratch, scratch + rowBytes };
+	u32 current = 0;
+	u32 bestFilter = 0;
+	u64 bestScore = ~0ull;
+
+	for ( u32 filter = 0; filter < PNG_FILTER_COUNT; ++filter )
+	{
+		u64 score = pngFilters[ filter ]( candidates[ current ], row, above, rowBytes, bpp );
+
+		if ( score < bestScore )
+		{
+			bestScore = score;
+			bestFilter = filter;
+			current ^= 1;
+		}
+	}
+
+	dst[ 0 ] = static_cast<u8>( bestFilter );
+	memcpy( dst + 1, candidates[ current ^ 1 ], rowBytes );
+}
+
+// SLICES ////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+struct PngWriteOptions
+{
+	const DeflateLevel *level;
+	PNG_FILTER_MODE filter;
+};
+
+// Rows that fit a slice, at least one however wide the row is
+[[nodiscard]] static u32 png_rows_per_slice( u64 filteredRowBytes )
+{
+	u64 rows = PNG_WRITER_SLICE_SIZE / filteredRowBytes;
+
+	return rows > 0 ? static_cast<u32>( rows ) : 1;
+}
+
+// Room for the whole IDAT chunk of a slice, the zlib header and adler32 included
+[[nodiscard]] static u64 png_chunk_capacity( u64 sliceBytes )
+{
+	return 8 + 2 + deflate_bound( sliceBytes ) + 4 + 4;
+}
+
+// Deflate the filtered bytes of a slice into its chunk. The dictionary sits right before input.
+static void png_deflate_slice( PngWriteSlice *slice, Deflater *deflater, const DeflateLevel &level, const u8 *input, u64 dictSize, u64 inputSize, bool first, bool last )
+{
+	// Length and type, then the zlib header if this starts the stream
+	u8 *out = slice->chunk;
+	memcpy( out + 4, "IDAT", 4 );
+	u64 size = 8;
+
+	if ( first )
+	{
+		deflate_zlib_header( level, out + size );
+		size += 2;
+	}
+
+	size += deflate_compress( deflater, level, input, dictSize, inputSize, last, out + size, deflate_bound( inputSize ) );
+
+	slice->chunkSize = size;
+	slice->adler = adler32( 1, input, inputSize );
+	slice->crc = png_crc32( 0, out + 4, size - 4 );
+}
+
+// Finish a chunk with its length and crc, the last slice carries the adler32 of the stream first
+static void png_close_slice( PngWriteSlice *slice, const u32 *adler )
+{
+	if ( adler )
+	{
+		png_write_u32( slice->chunk + slice->chunkSize, *adler );
+		slice->crc = png_crc32( slice->crc, slice->chunk + slice->chunkSize, 4 );
+		slice->chunkSize += 4;
+	}
+
+	png_write_u32( slice->chunk, static_cast<u32>( slice->chunkSize - 8 ) );
+	png_write_u32( slice->chunk + slice->chunkSize, slice->crc );
+	slice->chunkSize += 4;
+}
+
+// Signature and IHDR
+static void png_write_header( u8 header[ 8 + 25 ], u32 width, u32 height, u32 channels )
+{
+	static const u8 signature[ 8 ] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	static const u8 colourTypes[ 5 ] = { 0, PNG_COLOUR_TYPE_GREY, PNG_COLOUR_TYPE_GREY_ALPHA, PNG_COLOUR_TYPE_RGB, PNG_COLOUR_TYPE_RGBA };
+
+	memcpy( header, signature, sizeof( signature ) );
+
+	u8 *ihdr = header + 8;
+	png_write_u32( ihdr, 13 );
+	memcpy( ihdr + 4, "IHDR", 4 );
+	png_write_u32( ihdr + 8, width );
+	png_write_u32( ihdr + 12, height );
+	ihdr[ 16 ] = 8;
+	ihdr[ 17 ] = colourTypes[ channels ];
+	ihdr[ 18 ] = 0;
+	ihdr[ 19 ] = 0;
+	ihdr[ 20 ] = 0;
+	png_write_u32( ihdr + 21, png_crc32( 0, ihdr + 4, 17 ) );
+}
+
+static void png_write_end( u8 end[ 12 ] )
+{
+	memset( end, 0, 4 );
+	memcpy( end + 4, "IEND", 4 );
+	png_write_u32( end + 8, png_crc32( 0, end + 4, 4 ) );
+}
+
+// Score every filter over rows spread evenly down the image and return the best overall
+[[nodiscard]] static u32 png_pick_filter( const u8 *image, u32 height, u64 rowBytes, u32 channels, const u8 *zeroRow, u8 *scratch )
+{
+	u64 scores[ PNG_FILTER_COUNT ] = {};
+	u32 samples = height < PNG_WRITER_FILTER_SAMPLES ? height : PNG_WRITER_FILTER_SAMPLES;
+
+	for ( u32 sample = 0; sample < samples; ++sample )
+	{
+		u32 y = static_cast<u32>( static_cast<u64>( sample ) * height / samples );
+		const u8 *row = image + y * rowBytes;
+		const u8 *above = y > 0 ? row - rowBytes : zeroRow;
+
+		for ( u32 filter = 0; filter < PNG_FILTER_COUNT; ++filter )
+			scores[ filter ] += pngFilters[ filter ]( scratch, row, above, rowBytes, channels );
+	}
+
+	u32 best = 0;
+
+	for ( u32 filter = 1; filter < PNG_FILTER_COUNT; ++filter )
+		best = scores[ filter ] < scores[ best ] ? filter : best;
+
+	return best;
+}
+
+// Filter one row into dst, the filter type byte first
+static inline void png_filter_row( u8 *dst, const u8 *row, const u8 *above, u64 rowBytes, u32 bpp, u32 filter, u8 *scratch )
+{
+	if ( filter < PNG_FILTER_COUNT )
+	{
+		dst[ 0 ] = static_cast<u8>( filter );
+		( void )pngFilters[ filter ]( dst + 1, row, above, rowBytes, bpp );
+	}
+	else
+	{
+		png_filter_row_exhaustive( dst, row, above, rowBytes, bpp, scratch );
+	}
+}
+
+// WHOLE IMAGE ///////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void png_writer_filter_task( void *data )
+{
+	TraceScope span( "png filter" );
+	PngWriteWorker *worker = static_cast<PngWriteWorker *>( data );
+	PngWriter *writer = worker->writer;
+
+	for ( u64 index = writer->nextSlice++; index < writer->sliceCount; index = writer->nextSlice++ )
+	{
+		const PngWriteSlice &slice = writer->slices[ index ];
+
+		for ( u32 y = slice.row; y < slice.row + slice.rows; ++y )
+		{
+			const u8 *row = writer->image + y * writer->rowBytes;
+			const u8 *above = y > 0 ? row - writer->rowBytes : writer->zeroRow;
+
+			png_filter_row( writer->filtered + y * writer->filteredRowBytes, row, above, writer->rowBytes, writer->channels, writer->filter, worker->scratch );
+		}
+	}
+}
+
+static void png_writer_compress_task( void *data )
+{
+	TraceScope span( "png deflate" );
+	PngWriteWorker *worker = static_cast<PngWriteWorker *>( data );
+	PngWriter *writer = worker->writer;
+
+	for ( u64 index = writer->nextSlice++; index < writer->sliceCount; index = writer->nextSlice++ )
+	{
+		PngWriteSlice &slice = writer->slices[ index ];
+
+		const u8 *input = writer->filtered + slice.row * writer->filteredRowBytes;
+		u64 inputSize = slice.rows * writer->filteredRowBytes;
+		u64 dictSize = input - writer->filtered;
+		dictSize = dictSize < DEFLATE_WINDOW_SIZE ? dictSize : DEFLATE_WINDOW_SIZE;
+
+		png_deflate_slice( &slice, worker->deflater, *writer->level, input, dictSize, inputSize, index == 0, index == writer->sliceCount - 1 );
+	}
+}
+
+// Runs a slice task with one worker per thread, the calling thread included
+static void png_writer_run( ThreadPool *pool, TaskFunc func, PngWriter *writer, PngWriteWorker *workers, u32 workerCount )
+{
+	writer->nextSlice = 0;
+
+	if ( !pool )
+	{
+		func( &workers[ 0 ] );
+		return;
+	}
+
+	TaskGroup group;
+
+	for ( u32 i = 0; i < workerCount; ++i )
+		pool->submit( &group, func, &workers[ i ] );
+
+	pool->wait( &group );
+}
+
+// One worker per thread, but never more than there are slices
+[[nodiscard]] static u32 png_write_workers( u32 threads, u64 sliceCount )
+{
+	return threads < sliceCount ? threads : static_cast<u32>( sliceCount );
+}
+
+// Bytes png_write takes from the allocator, threads counts the calling thread
+[[nodiscard]] static u64 png_write_memory( u32 width, u32 height, u32 channels, u32 threads )
+{
+	u64 rowBytes = static_cast<u64>( width ) * channels;
+	u32 rowsPerSlice = png_rows_per_slice( rowBytes + 1 );
+	u64 sliceCount = ( static_cast<u64>( height ) + rowsPerSlice - 1 ) / rowsPerSlice;
+	u32 workerCount = png_write_workers( threads, sliceCount );
+
+	u64 size = ( rowBytes + 1 ) * height;
+	size += sliceCount * ( sizeof( PngWriteSlice ) + png_chunk_capacity( rowsPerSlice * ( rowBytes + 1 ) ) );
+	size += workerCount * ( sizeof( PngWriteWorker ) + sizeof( Deflater ) );
+	size += rowBytes * ( 1 + 2 * workerCount );
+
+	return size + 6 * MEMORY_ALLOCATION_OVERHEAD;
+}
+
+// Write an 8 bit image with 1 to 4 channels. Pass a pool to compress on its threads as well.
+[[nodiscard]] static bool png_write( ThreadPool *pool, Allocator *allocator, const char *filename, const u8 *image, u32 width, u32 height, u32 channels, const PngWriteOptions &options )
+{
+	assert( channels >= 1 && channels <= 4 && width > 0 && height > 0 );
+
+	TraceScope span( "png write", filename );
+	PngWriter writer;
+	writer.image = image;
+	writer.width = width;
+	writer.height = height;
+	writer.channels = channels;
+	writer.rowBytes = static_cast<u64>( width ) * channels;
+	writer.filteredRowBytes = writer.rowBytes + 1;
+	writer.level = options.level;
+
+	u32 rowsPerSlice = png_rows_per_slice( writer.filteredRowBytes );
+	writer.sliceCount = ( static_cast<u64>( height ) + rowsPerSlice - 1 ) / rowsPerSlice;
+
+	u64 chunkCapacity = png_chunk_capacity( rowsPerSlice * writer.filteredRowBytes );
+	u32 workerCount = png_write_workers( pool ? pool->threadCount + 1 : 1, writer.sliceCount );
+
+	writer.filtered = allocator->allocate<u8>( writer.filteredRowBytes * height );
+	writer.slices = allocator->allocate<PngWriteSlice>( writer.sliceCount );
+	u8 *chunks = allocator->allocate<u8>( writer.sliceCount * chunkCapacity );
+	PngWriteWorker *workers = allocator->allocate<PngWriteWorker>( workerCount );
+	Deflater *deflaters = allocator->allocate<Deflater>( workerCount );
+	u8 *rows = allocator->allocate<u8>( writer.rowBytes * ( 1 + 2 * workerCount ) );
+
+	bool result = false;
+
+	if ( writer.filtered && writer.slices && chunks && workers && deflaters && rows )
+	{
+		memset( rows, 0, writer.rowBytes );
+		writer.zeroRow = rows;
+
+		if ( options.filter == PNG_FILTER_MODE_EXHAUSTIVE )
+			writer.filter = PNG_FILTER_COUNT;
+		else if ( options.filter == PNG_FILTER_MODE_SAMPLED )
+			writer.filter = png_pick_filter( image, height, writer.rowBytes, channels, writer.zeroRow, rows + writer.rowBytes );
+		else
+			writer.filter = options.filter - PNG_FILTER_MODE_NONE;
+
+		for ( u64 i = 0; i < writer.sliceCount; ++i )
+		{
+			PngWriteSlice &slice = writer.slices[ i ];
+			slice.row = static_cast<u32>( i * rowsPerSlice );
+			slice.rows = height - slice.row < rowsPerSlice ? height - slice.row : rowsPerSlice;
+			slice.chunk = chunks + i * chunkCapacity;
+		}
+
+		for ( u32 i = 0; i < workerCount; ++i )
+			workers[ i ] = { .writer = &writer, .deflater = &deflaters[ i ], .scratch = rows + writer.rowBytes * ( 1 + 2 * i ) };
+
+		// Every slice needs the filtered bytes in front of it, so filter everything first
+		png_writer_run( pool, png_writer_filter_task, &writer, workers, workerCount );
+		png_writer_run( pool, png_writer_compress_task, &writer, workers, workerCount );
+
+		// The stream ends on the adler32 of all the slices
+		u32 adler = writer.slices[ 0 ].adler;
+
+		for ( u64 i = 1; i < writer.sliceCount; ++i )
+			adler = adler32_combine( adler, writer.slices[ i ].adler, writer.slices[ i ].rows * writer.filteredRowBytes );
+
+		for ( u64 i = 0; i < writer.sliceCount; ++i )
+			png_close_slice( &writer.slices[ i ], i == writer.sliceCount - 1 ? &adler : nullptr );
+
+		u8 header[ 8 + 25 ];
+		u8 end[ 12 ];
+		png_write_header( header, width, height, channels );
+		png_write_end( end );
+
+		TraceScope fileSpan( "png write file", filename );
+		FILE *file = fopen( filename, "wb" );
+
+		if ( file )
+		{
+			result = fwrite( header, sizeof( header ), 1, file ) == 1;
+
+			for ( u64 i = 0; i < writer.sliceCount && result; ++i )
+				result = fwrite( writer.slices[ i ].chunk, writer.slices[ i ].chunkSize, 1, file ) == 1;
+
+			result = result && fwrite( end, sizeof( end ), 1, file ) == 1;
+			result = fclose( file ) == 0 && result;
+		}
+	}
+
+	allocator->free( rows );
+	allocator->free( deflaters );
+	allocator->free( workers );
+	allocator->free( chunks );
+	allocator->free( writer.slices );
+	allocator->free( writer.filtered );
+
+	return result;
+}
+
+// STREAMING /////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Rows are pushed one at a time and only a ring of slices is ever held, so memory depends on
+// the width and not the height. Slices are cut exactly as png_write cuts them, so both write
+// the same file, except that sampled filtering can only look at the rows of the first slice.
+// Each slice keeps a copy of the 32KB before it, so its compression doesn't depend on any
+// other slice and the pool can work on several at once.
+
+struct PngStreamSlice
+{
+	PngWriteSlice slice;
+	u8 *data;								// dictionary, then the filtered rows of the slice
+	u64 dictSize;
+	u64 size;								// filtered bytes after the dictionary
+	bool first;
+	bool last;
+	bool pending;							// compressing or waiting to be written
+	const DeflateLevel *level;
+	Deflater *deflater;
+	TaskGroup group;
+};
+
+struct PngStream
+{
+	ThreadPool *pool;
+	FILE *file;
+	bool failed;
+
+	u32 width;
+	u32 height;
+	u32 channels;
+	u64 rowBytes;
+	u64 filteredRowBytes;
+	u32 rowsPerSlice;
+	u32 row;								// rows filtered so far
+
+	u32 filter;
+	bool sampling;							// sampled mode holds the first slice back to pick a filter
+	u8 *staged;
+	u32 stagedRows;
+
+	u8 *above;								// the previous raw row, all zero before the first
+	u8 *scratch;
+
+	PngStreamSlice *ring;
+	u32 ringSize;
+	u64 sliceIndex;							// slice being filled
+	u32 adler;
+
+	// Everything is allocated as one block
+	void *memory;
+};
+
+static void png_stream_compress_task( void *data )
+{
+	TraceScope span( "png deflate" );
+	PngStreamSlice *entry = static_cast<PngStreamSlice *>( data );
+
+	png_deflate_slice( &entry->slice, entry->deflater, *entry->level, entry->data + entry->dictSize, entry->dictSize, entry->size, entry->first, entry->last );
+}
+
+// Wait for a slice to finish compressing and append its chunk to the file
+static void png_stream_retire( PngStream *stream, PngStreamSlice *entry )
+{
+	if ( !entry->pending )
+		return;
+
+	if ( stream->pool )
+		stream->pool->wait( &entry->group );
+
+	entry->pending = false;
+
+	stream->adler = entry->first ? entry->slice.adler : adler32_combine( stream->adler, entry->slice.adler, entry->size );
+	png_close_slice( &entry->slice, entry->last ? &stream->adler : nullptr );
+
+	if ( !stream->failed && fwrite( entry->slice.chunk, entry->slice.chunkSize, 1, stream->file ) != 1 )
+		stream->failed = true;
+}
+
+// Hand the full slice over to be compressed and start the next one
+static void png_stream_flush( PngStream *stream )
+{
+	PngStreamSlice *entry = &stream->ring[ stream->sliceIndex % stream->ringSize ];
+	entry->first = stream->sliceIndex == 0;
+	entry->last = stream->row == stream->height;
+	entry->pending = true;
+
+	if ( stream->pool )
+		stream->pool->submit( &entry->group, png_stream_compress_task, entry );
+	else
+		png_stream_compress_task( entry );
+
+	if ( entry->last )
+		return;
+
+	stream->sliceIndex += 1;
+
+	PngStreamSlice *next = &stream->ring[ stream->sliceIndex % stream->ringSize ];
+	png_stream_retire( stream, next );
+
+	// The dictionary is the tail of everything filtered so far, the slice before holds all of it
+	u64 available = entry->dictSize + entry->size;
+	next->dictSize = available < DEFLATE_WINDOW_SIZE ? available : DEFLATE_WINDOW_SIZE;
+	next->size = 0;
+	memmove( next->data, entry->data + available - next->dictSize, next->dictSize );
+}
+
+static void png_stream_filter_row( PngStream *stream, const u8 *row )
+{
+	PngStreamSlice *entry = &stream->ring[ stream->sliceIndex % stream->ringSize ];
+
+	png_filter_row( entry->data + entry->dictSize + entry->size, row, stream->above, stream->rowBytes, stream->channels, stream->filter, stream->scratch );
+	memcpy( stream->above, row, stream->rowBytes );
+
+	entry->size += stream->filteredRowBytes;
+	stream->row += 1;
+
+	if ( entry->size == stream->rowsPerSlice * stream->filteredRowBytes || stream->row == stream->height )
+		png_stream_flush( stream );
+}
+
+// Pick the filter from the held back rows and let them through
+static void png_stream_release_staged( PngStream *stream )
+{
+	memset( stream->above, 0, stream->rowBytes );
+	stream->filter = png_pick_filter( stream->staged, stream->stagedRows, stream->rowBytes, stream->channels, stream->above, stream->scratch );
+	stream->sampling = false;
+
+	for ( u32 y = 0; y < stream->stagedRows; ++y )
+		png_stream_filter_row( stream, stream->staged + y * stream->rowBytes );
+}
+
+// Size of the one block a stream lives in
+[[nodiscard]] static u64 png_stream_block_size( u32 width, u32 channels, u32 ringSize, PNG_FILTER_MODE filter )
+{
+	u64 rowBytes = static_cast<u64>( width ) * channels;
+	u64 sliceBytes = png_rows_per_slice( rowBytes + 1 ) * ( rowBytes + 1 );
+
+	u64 size = rowBytes * 3;
+	size += filter == PNG_FILTER_MODE_SAMPLED ? sliceBytes : 0;
+	size += ringSize * ( sizeof( PngStreamSlice ) + sizeof( Deflater ) + DEFLATE_WINDOW_SIZE + sliceBytes + png_chunk_capacity( sliceBytes ) );
+
+	// Every piece carved out of the block is rounded up to the alignment
+	return size + MEMORY_ALIGNMENT * ( 4 + ringSize * 3 );
+}
+
+// Bytes png_stream_open takes from the allocator, threads counts the calling thread
+[[nodiscard]] static u64 png_stream_memory( u32 width, u32 channels, u32 threads, PNG_FILTER_MODE filter )
+{
+	return png_stream_block_size( width, channels, threads, filter ) + MEMORY_ALLOCATION_OVERHEAD;
+}
+
+// Start a png of known size, its rows follow with png_stream_write_row. Pass a pool to compress
+// slices on its threads while later rows are still arriving.
+[[nodiscard]] static bool png_stream_open( PngStream *stream, ThreadPool *pool, Allocator *allocator, const char *filename, u32 width, u32 height, u32 channels, const PngWriteOptions &options )
+{
+	assert( channels >= 1 && channels <= 4 && width > 0 && height > 0 );
+
+	*stream = {};
+	stream->pool = pool;
+	stream->width = width;
+	stream->height = height;
+	stream->channels = channels;
+	stream->rowBytes = static_cast<u64>( width ) * channels;
+	stream->filteredRowBytes = stream->rowBytes + 1;
+	stream->rowsPerSlice = png_rows_per_slice( stream->filteredRowBytes );
+	stream->ringSize = pool ? pool->threadCount + 1 : 1;
+
+	u64 sliceBytes = stream->rowsPerSlice * stream->filteredRowBytes;
+	u64 chunkCapacity = png_chunk_capacity( sliceBytes );
+
+	stream->memory = allocator->allocate<u8>( png_stream_block_size( width, channels, stream->ringSize, options.filter ), false, MEMORY_ALIGNMENT );
+
+	if ( !stream->memory )
+		return false;
+
+	// Carve the block up, keeping every piece aligned
+	u8 *p = static_cast<u8 *>( stream->memory );
+	auto carve = [ &p ] ( u64 size )
+	{
+		u8 *piece = p;
+		p += ( size + MEMORY_ALIGNMENT - 1 ) & ~static_cast<u64>( MEMORY_ALIGNMENT - 1 );
+		return piece;
+	};
+
+	stream->above = carve( stream->rowBytes );
+	stream->scratch = carve( stream->rowBytes * 2 );
+	stream->ring = reinterpret_cast<PngStreamSlice *>( carve( stream->ringSize * sizeof( PngStreamSlice ) ) );
+
+	if ( options.filter == PNG_FILTER_MODE_SAMPLED )
+	{
+		stream->staged = carve( sliceBytes );
+		stream->sampling = true;
+	}
+	else
+	{
+		stream->filter = options.filter == PNG_FILTER_MODE_EXHAUSTIVE ? static_cast<u32>( PNG_FILTER_COUNT ) : options.filter - PNG_FILTER_MODE_NONE;
+	}
+
+	for ( u32 i = 0; i < stream->ringSize; ++i )
+	{
+		PngStreamSlice *entry = new ( &stream->ring[ i ] ) PngStreamSlice();
+		entry->level = options.level;
+		entry->deflater = reinterpret_cast<Deflater *>( carve( sizeof( Deflater ) ) );
+		entry->data = carve( DEFLATE_WINDOW_SIZE + sliceBytes );
+		entry->slice.chunk = carve( chunkCapacity );
+	}
+
+	memset( stream->above, 0, stream->rowBytes );
+
+	stream->file = fopen( filename, "wb" );
+
+	if ( !stream->file )
+		return false;
+
+	u8 header[ 8 + 25 ];
+	png_write_header( header, width, height, channels );
+	stream->failed = fwrite( header, sizeof( header ), 1, stream->file ) != 1;
+
+	return !stream->failed;
+}
+
+// Push the next row, rowBytes of packed pixels
+static void png_stream_write_row( PngStream *stream, const u8 *row )
+{
+	if ( !stream->sampling )
+	{
+		png_stream_filter_row( stream, row );
+		return;
+	}
+
+	memcpy( stream->staged + stream->stagedRows * stream->rowBytes, row, stream->rowBytes );
+	stream->stagedRows += 1;
+
+	if ( stream->stagedRows == stream->rowsPerSlice || stream->stagedRows == stream->height )
+		png_stream_release_staged( stream );
+}
+
+// Finish the file once every row is in, otherwise just abandon it. Gives the memory back.
+[[nodiscard]] static bool png_stream_close( PngStream *stream, Allocator *allocator )
+{
+	TraceScope span( "png stream close" );
+
+	bool complete = stream->file && stream->row == stream->height;
+
+	// Let anything still compressing finish before its memory goes
+	for ( u64 i = 0; stream->ring && i < stream->ringSize; ++i )
+	{
+		u64 index = stream->sliceIndex + 1 + i;
+		PngStreamSlice *entry = &stream->ring[ index % stream->ringSize ];
+
+		if ( complete )
+			png_stream_retire( stream, entry );
+		else if ( entry->pending && stream->pool )
+			stream->pool->wait( &entry->group );
+	}
+
+	bool result = complete && !stream->failed;
+
+	if ( result )
+	{
+		u8 end[ 12 ];
+		png_write_end( end );
+		result = fwrite( end, sizeof( end ), 1, stream->file ) == 1;
+	}
+
+	if ( stream->file )
+		result = fclose( stream->file ) == 0 && result;
+
+	allocator->free( stream->memory );
+	*stream = {};
+
+	return result;
+}
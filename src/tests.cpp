@@ -0,0 +1,998 @@
+// Test build of grey_merger. The dispatch has to pick the kernels of the best instruction set a
+// cpu reports, then every merge kernel the dispatch table can hand out, on every instruction set
+// this cpu has, is checked byte for byte against merge_rgba_scalar over odd widths that leave
+// vector tails. Then png_write has to produce the same file whatever number of threads compresses
+// it, and the growable and open addressing maps are run against std::map. Last a -cache job is
+// run twice, the second run has to find its output up to date.
+// Failures are logged to stderr, the exit code is the number of them.
+
+// The tool's own entry point is kept, renamed, so everything it uses is still referenced
+#define main grey_merger_main
+#include "main.cpp"
+#undef main
+
+#include <map>
+
+#define TESTS_ALPHA			0x5A
+
+struct TestOptions
+{
+	const char *directory = "grey_merger_tests/";
+	u32 failures = 0;
+} tests;
+
+static int tests_usage_message( RESULT_CODE code )
+{
+	log( "\nERROR_CODE: %s\n", error_code_string( code ) );
+	log( ":: USAGE ::" );
+	log( "Expects grey_merger_tests <commands>\n" );
+	log( "COMMANDS" );
+	log( "[-dir] <path>                EG. -dir /tmp/tests/                               (where the png files written by the tests go. Defaults to grey_merger_tests/)" );
+
+	return code;
+}
+
+static void tests_fail( const char *message, ... )
+{
+	va_list args;
+	va_start( args, message );
+	fprintf( stderr, "FAIL: " );
+	vfprintf( stderr, message, args );
+	fprintf( stderr, "\n" );
+	va_end( args );
+
+	tests.failures += 1;
+}
+
+// Xorshift, the same numbers on every run
+static inline u32 tests_random( u32 *state )
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+static void tests_fill( u8 *data, u64 size, u32 seed )
+{
+	u32 state = 0x9E3779B9u * ( seed + 1 );
+
+	for ( u64 i = 0; i < size; ++i )
+		data[ i ] = static_cast<u8>( tests_random( &state ) >> 24 );
+}
+
+// MERGE ////////////////////////////////////////////////////////////////////////
+
+static const char *testsIsaNames[] = { "scalar", "sse2", "avx2" };
+
+// Widths around the 16 and 32 pixel blocks of the vector kernels
+static const u32 testsWidths[] = { 1, 2, 3, 7, 15, 16, 17, 31, 32, 33, 47, 63, 64, 65, 97, 301 };
+
+static void tests_fill_layout( MergeTable *table, MERGE_ISA isa, MERGE_LAYOUT layout )
+{
+	table->layout = layout;
+
+	switch ( isa )
+	{
+	case MERGE_ISA_SCALAR: merge_fill_layout<MERGE_ISA_SCALAR>( table, layout ); break;
+	case MERGE_ISA_SSE2: merge_fill_layout<MERGE_ISA_SSE2>( table, layout ); break;
+	case MERGE_ISA_AVX2: merge_fill_layout<MERGE_ISA_AVX2>( table, layout ); break;
+	}
+}
+
+// Runs one kernel over width pixels of sources with the given strides and compares it with the
+// reference. Every buffer is allocated on its own so a sanitizer build catches a kernel reading
+// past a row, and the output has a guard after it for writes.
+static void tests_merge_case( MergeFunc func, const u32 strides[ 4 ], u32 outChannels, u32 width, const char *name )
+{
+	MergeSource sources[ 4 ];
+	u8 *inputs[ 4 ] = {};
+
+	for ( u32 c = 0; c < 4; ++c )
+	{
+		if ( strides[ c ] == 0 )
+			continue;
+
+		inputs[ c ] = static_cast<u8 *>( malloc( static_cast<u64>( width ) * strides[ c ] ) );
+		tests_fill( inputs[ c ], static_cast<u64>( width ) * strides[ c ], width * 4 + c );
+		sources[ c ] = { .data = inputs[ c ], .stride = strides[ c ] };
+	}
+
+	u64 outBytes = static_cast<u64>( width ) * outChannels;
+	u8 *expected = static_cast<u8 *>( malloc( static_cast<u64>( width ) * 4 ) );
+	u8 *out = static_cast<u8 *>( malloc( outBytes + 16 ) );
+	memset( out, 0xCD, outBytes + 16 );
+
+	merge_rgba_scalar( expected, sources, TESTS_ALPHA, width );
+	func( out, sources, TESTS_ALPHA, width );
+
+	for ( u64 i = 0; i < width; ++i )
+	{
+		if ( memcmp( out + i * outChannels, expected + i * 4, outChannels ) != 0 )
+		{
+			tests_fail( "%s strides %u %u %u %u, width %u: pixel %llu differs from merge_rgba_scalar", name, strides[ 0 ], strides[ 1 ], strides[ 2 ], strides[ 3 ], width, i );
+			break;
+		}
+	}
+
+	for ( u32 i = 0; i < 16; ++i )
+	{
+		if ( out[ outBytes + i ] != 0xCD )
+		{
+			tests_fail( "%s strides %u %u %u %u, width %u: wrote past the end of the row", name, strides[ 0 ], strides[ 1 ], strides[ 2 ], strides[ 3 ], width );
+			break;
+		}
+	}
+
+	free( out );
+	free( expected );
+
+	for ( u8 *input : inputs )
+		free( input );
+}
+
+static void tests_merge( CpuFeatures features )
+{
+	const bool supported[] = { true, ( features & CPU_FEATURE_SSE2 ) != 0, ( features & CPU_FEATURE_AVX2 ) != 0 };
+
+	for ( u32 isa = MERGE_ISA_SCALAR; isa <= MERGE_ISA_AVX2; ++isa )
+	{
+		if ( !supported[ isa ] )
+		{
+			log( "merge %s: skipped, not supported by this cpu", testsIsaNames[ isa ] );
+			continue;
+		}
+
+		u32 failures = tests.failures;
+		u32 cases = 0;
+
+		for ( u32 layout = MERGE_LAYOUT_GREY; layout <= MERGE_LAYOUT_RGBA; ++layout )
+		{
+			MergeTable table;
+			tests_fill_layout( &table, static_cast<MERGE_ISA>( isa ), static_cast<MERGE_LAYOUT>( layout ) );
+
+			char name[ 64 ];
+			snprintf( name, sizeof( name ), "merge %s layout %u", testsIsaNames[ isa ], layout );
+
+			for ( u32 r = 0; r <= MERGE_MAX_STRIDE; ++r )
+			for ( u32 g = 0; g <= MERGE_MAX_STRIDE; ++g )
+			for ( u32 b = 0; b <= MERGE_MAX_STRIDE; ++b )
+			for ( u32 a = 0; a < MERGE_ALPHA_STRIDES; ++a )
+			{
+				if ( !table.funcs[ r ][ g ][ b ][ a ] )
+					continue;
+
+				const u32 strides[ 4 ] = { r, g, b, a };
+
+				for ( u32 width : testsWidths )
+				{
+					tests_merge_case( merge_find( table, r, g, b, a ), strides, layout, width, name );
+					cases += 1;
+				}
+			}
+
+			// The grey kernels that pack an alpha source
+			snprintf( name, sizeof( name ), "extract %s", testsIsaNames[ isa ] );
+
+			for ( u32 stride = 0; stride <= MERGE_MAX_STRIDE; ++stride )
+			{
+				const u32 strides[ 4 ] = { stride, 0, 0, 0 };
+
+				for ( u32 width : testsWidths )
+				{
+					tests_merge_case( table.extract[ stride ], strides, 1, width, name );
+					cases += 1;
+				}
+			}
+		}
+
+		log( "merge %s: %u cases, %s", testsIsaNames[ isa ], cases, tests.failures == failures ? "ok" : "FAILED" );
+	}
+}
+
+// The table merge_build_table picks for a set of cpu features has to hold the kernels of the best
+// instruction set among them. Only pointers are compared, so every set is checked on any cpu.
+static void tests_merge_dispatch( CpuFeatures features )
+{
+	struct Dispatch
+	{
+		CpuFeatures features;
+		MERGE_ISA isa;
+	};
+
+	static const Dispatch dispatches[] =
+	{
+		{ 0, MERGE_ISA_SCALAR },
+		{ CPU_FEATURE_SSE2, MERGE_ISA_SSE2 },
+		{ CPU_FEATURE_SSE2 | CPU_FEATURE_SSSE3 | CPU_FEATURE_SSE41, MERGE_ISA_SSE2 },
+		{ CPU_FEATURE_SSE2 | CPU_FEATURE_SSSE3 | CPU_FEATURE_SSE41 | CPU_FEATURE_AVX2, MERGE_ISA_AVX2 },
+	};
+
+	u32 failures = tests.failures;
+
+	// Every x64 cpu has SSE2, and AVX2 is only reported along with it
+	if ( ( features & CPU_FEATURE_AVX2 ) && !( features & CPU_FEATURE_SSE2 ) )
+		tests_fail( "cpu features: AVX2 without SSE2" );
+
+	if ( cpu_features() != features )
+		tests_fail( "cpu features: changed between calls" );
+
+	for ( const Dispatch &dispatch : dispatches )
+	{
+		for ( u32 layout = MERGE_LAYOUT_GREY; layout <= MERGE_LAYOUT_RGBA; ++layout )
+		{
+			MergeTable built;
+			MergeTable expected;
+			merge_build_table( &built, dispatch.features, static_cast<MERGE_LAYOUT>( layout ) );
+			tests_fill_layout( &expected, dispatch.isa, static_cast<MERGE_LAYOUT>( layout ) );
+
+			if ( built.layout != expected.layout || memcmp( built.funcs, expected.funcs, sizeof( built.funcs ) ) != 0 ||
+				memcmp( built.extract, expected.extract, sizeof( built.extract ) ) != 0 )
+			{
+				tests_fail( "merge dispatch: features 0x%x layout %u didn't pick the %s kernels", dispatch.features, layout, testsIsaNames[ dispatch.isa ] );
+			}
+		}
+	}
+
+	log( "merge dispatch: %s", tests.failures == failures ? "ok" : "FAILED" );
+}
+
+// PNG WRITE ////////////////////////////////////////////////////////////////////
+
+[[nodiscard]] static u8 *tests_read_file( const char *filename, u64 *size )
+{
+	FILE *file = fopen( filename, "rb" );
+
+	if ( !file )
+		return nullptr;
+
+	fseek( file, 0, SEEK_END );
+	*size = static_cast<u64>( ftell( file ) );
+	fseek( file, 0, SEEK_SET );
+
+	u8 *data = static_cast<u8 *>( malloc( *size ? *size : 1 ) );
+
+	if ( fread( data, 1, *size, file ) != *size )
+	{
+		free( data );
+		data = nullptr;
+	}
+
+	fclose( file );
+
+	return data;
+}
+
+// Writes the image with 0 to 7 pool threads, every file must match the single threaded one
+static void tests_png_write_case( const u8 *image, u32 width, u32 height, u32 channels, const PngWriteOptions &writeOptions, const char *name )
+{
+	static const u32 threadCounts[] = { 0, 1, 2, 3, 7 };
+
+	u8 *reference = nullptr;
+	u64 referenceSize = 0;
+
+	for ( u32 threads : threadCounts )
+	{
+		char path[ 4096 ];
+		snprintf( path, sizeof( path ), "%s%s_%u.png", tests.directory, name, threads );
+
+		if ( threads > 0 && !app.pool.init( threads ) )
+		{
+			tests_fail( "%s: failed to start %u threads", name, threads );
+			break;
+		}
+
+		MemoryArena memory = create_memory_arena( "png write" );
+		bool written = memory.init_virtual( 0, png_write_memory( width, height, channels, threads + 1 ) + MEMORY_ALLOCATION_OVERHEAD, 0 ) &&
+			png_write( threads > 0 ? &app.pool : nullptr, &memory.transient, path, image, width, height, channels, writeOptions );
+
+		memory.free();
+		app.pool.free();
+
+		u64 size = 0;
+		u8 *data = written ? tests_read_file( path, &size ) : nullptr;
+
+		if ( !data )
+		{
+			tests_fail( "%s: failed to write %s with %u threads", name, path, threads );
+			break;
+		}
+
+		if ( !reference )
+		{
+			reference = data;
+			referenceSize = size;
+			continue;
+		}
+
+		if ( size != referenceSize || memcmp( data, reference, size ) != 0 )
+			tests_fail( "%s: %u threads wrote different bytes to a single thread", name, threads );
+
+		free( data );
+	}
+
+	free( reference );
+}
+
+static void tests_png_write()
+{
+	struct Level
+	{
+		const char *name;
+		const DeflateLevel *level;
+	};
+
+	static const Level levels[] =
+	{
+		{ "store", &deflateLevels[ 0 ] },
+		{ "default", &deflateLevels[ DEFLATE_DEFAULT_LEVEL ] },
+		{ "9", &deflateLevels[ 9 ] },
+		{ "fast", &deflateRle },
+		{ "huffman", &deflateHuffmanOnly },
+	};
+
+	static const PNG_FILTER_MODE filters[] = { PNG_FILTER_MODE_EXHAUSTIVE, PNG_FILTER_MODE_SAMPLED, PNG_FILTER_MODE_PAETH };
+
+	// Tall enough for several slices, half noise and half gradient so every level has matches to find
+	const u32 width = 509;
+	const u32 height = 700;
+	u32 failures = tests.failures;
+	u32 cases = 0;
+
+	for ( u32 channels = 1; channels <= 4; channels += 3 )
+	{
+		u64 rowBytes = static_cast<u64>( width ) * channels;
+		u8 *image = static_cast<u8 *>( malloc( rowBytes * height ) );
+		tests_fill( image, rowBytes * height / 2, channels );
+
+		for ( u64 i = rowBytes * height / 2; i < rowBytes * height; ++i )
+			image[ i ] = static_cast<u8>( ( i % rowBytes ) * 255 / rowBytes );
+
+		for ( const Level &level : levels )
+		{
+			for ( PNG_FILTER_MODE filter : filters )
+			{
+				char name[ 64 ];
+				snprintf( name, sizeof( name ), "png_%u_%s_%u", channels, level.name, filter );
+
+				tests_png_write_case( image, width, height, channels, { level.level, filter }, name );
+				cases += 1;
+			}
+		}
+
+		free( image );
+	}
+
+	log( "png write: %u cases over 0 to 7 threads, %s", cases, tests.failures == failures ? "ok" : "FAILED" );
+}
+
+// DYNAMIC CONTAINERS ///////////////////////////////////////////////////////////
+
+static void tests_dynamic_array()
+{
+	u32 failures = tests.failures;
+	MemoryArena memory = create_memory_arena( "tests" );
+
+	if ( !memory.init( KB( 64 ), KB( 4 ), 0 ) )
+	{
+		tests_fail( "dynamic array: failed to initialise memory" );
+		return;
+	}
+
+	// While the array is the allocator's last allocation every doubling extends it in place
+	DynamicArray<u64> array;
+	bool added = array.init( &memory.permanent );
+	const u64 *first = nullptr;
+	bool moved = false;
+
+	for ( u64 i = 0; i < 1000 && added; ++i )
+	{
+		added = array.add( i * 7 );
+		first = first ? first : array.data;
+		moved = moved || array.data != first;
+	}
+
+	if ( !added || array.count != 1000 || array.capacity() < 1000 || array.capacity() > 2000 )
+		tests_fail( "dynamic array: 1000 adds gave %llu items in room for %llu", array.count, array.capacity() );
+
+	if ( moved )
+		tests_fail( "dynamic array: copied while it was the last allocation" );
+
+	// Once something is allocated after it, growing has to copy
+	[[maybe_unused]] u8 *after = memory.permanent.allocate<u8>( 64u );
+
+	while ( !array.full() )
+		added = array.add( array.count * 7 ) && added;
+
+	const u64 *before = array.data;
+	added = array.add( array.count * 7 ) && added;
+
+	if ( !added || array.data == before )
+		tests_fail( "dynamic array: didn't move to grow behind another allocation" );
+
+	for ( u64 i = 0; i < array.count; ++i )
+	{
+		if ( array[ i ] != i * 7 )
+		{
+			tests_fail( "dynamic array: item %llu is %llu after growing, expected %llu", i, array[ i ], i * 7 );
+			break;
+		}
+	}
+
+	// Filled until the allocator runs out, every failed call has to leave the array as it was
+	DynamicArray<u64> bounded;
+	bool initialised = bounded.init( &memory.transient );
+
+	while ( initialised && bounded.add( bounded.count ) ) {}
+
+	const u64 *data = bounded.data;
+	u64 count = bounded.count;
+	u64 capacity = bounded.capacity();
+	const u64 more[ 2 ] = {};
+
+	if ( !initialised || count == 0 || count * sizeof( u64 ) > KB( 4 ) )
+		tests_fail( "dynamic array: held %llu items in a 4KB allocator", count );
+
+	if ( bounded.add( 0 ) || bounded.reserve( capacity * 4 ) || bounded.append( more, 2 ) || bounded.push() || bounded.resize( capacity + 1 ) )
+		tests_fail( "dynamic array: grew with the allocator out of room" );
+
+	if ( bounded.data != data || bounded.count != count || bounded.capacity() != capacity )
+		tests_fail( "dynamic array: a failed add changed it" );
+
+	for ( u64 i = 0; i < bounded.count; ++i )
+	{
+		if ( bounded[ i ] != i )
+		{
+			tests_fail( "dynamic array: item %llu changed after running out of room", i );
+			break;
+		}
+	}
+
+	memory.free();
+
+	log( "dynamic array: %s", tests.failures == failures ? "ok" : "FAILED" );
+}
+
+// Checks every key in [ 0, keys ) is found, or not, as in reference
+template <typename MapType>
+static bool tests_map_matches( MapType &map, const std::map<u64, u64> &reference, u64 keys, const char *name )
+{
+	if ( map.count() != reference.size() )
+	{
+		tests_fail( "%s: holds %llu entries, expected %llu", name, map.count(), static_cast<u64>( reference.size() ) );
+		return false;
+	}
+
+	for ( u64 key = 0; key < keys; ++key )
+	{
+		auto expected = reference.find( key );
+		u64 *value = map.get_value( key );
+
+		if ( ( expected == reference.end() ) != ( value == nullptr ) || ( value && *value != expected->second ) )
+		{
+			tests_fail( "%s: key %llu is %s, expected %s", name, key, value ? "found" : "missing", expected != reference.end() ? "found" : "missing" );
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void tests_dynamic_map()
+{
+	u32 failures = tests.failures;
+	MemoryArena memory = create_memory_arena( "tests" );
+
+	if ( !memory.init( MB( 4 ), MB( 1 ), 0 ) )
+	{
+		tests_fail( "dynamic map: failed to initialise memory" );
+		return;
+	}
+
+	// Entries and buckets in allocators of their own, so neither moves as they grow
+	DynamicMap<u64, u64> map;
+	bool inserted = map.init( &memory.permanent, 0, &memory.transient );
+	const void *values = nullptr;
+	const void *buckets = nullptr;
+	bool moved = false;
+
+	for ( u64 key = 0; key < 20000 && inserted; ++key )
+	{
+		inserted = map.insert( key, key * 3 );
+		values = values ? values : map.values.data;
+		buckets = buckets ? buckets : map.entries.data;
+		moved = moved || map.values.data != values || map.entries.data != buckets;
+	}
+
+	if ( !inserted || moved )
+		tests_fail( "dynamic map: 20000 inserts %s", inserted ? "copied entries or buckets" : "ran out of room" );
+
+	// Random inserts and both kinds of remove against std::map
+	std::map<u64, u64> reference;
+	u32 state = 1;
+	map.clear();
+
+	for ( u64 key = 0; key < 20000; ++key )
+		reference[ key ] = key * 3;
+
+	for ( u64 key = 0; key < 20000 && inserted; ++key )
+		inserted = map.insert( key, key * 3 );
+
+	for ( u32 step = 0; step < 50000 && inserted; ++step )
+	{
+		u64 key = tests_random( &state ) % 24000;
+		u32 op = tests_random( &state ) % 8;
+
+		if ( op < 4 )
+		{
+			u64 value = tests_random( &state );
+			inserted = map.insert( key, value );
+			reference[ key ] = value;
+		}
+		else if ( op < 7 )
+		{
+			bool removed = map.remove( key );
+
+			if ( removed != ( reference.erase( key ) == 1 ) )
+				tests_fail( "dynamic map: removing %llu returned %d", key, removed );
+		}
+		else
+		{
+			// Shifts every later entry, so only now and then
+			bool removed = ( step % 64 ) == 0 ? map.remove_keep_order( key ) : map.remove( key );
+
+			if ( removed != ( reference.erase( key ) == 1 ) )
+				tests_fail( "dynamic map: removing %llu returned %d", key, removed );
+		}
+	}
+
+	if ( !inserted )
+		tests_fail( "dynamic map: ran out of room with 5MB" );
+
+	tests_map_matches( map, reference, 24000, "dynamic map" );
+
+	// Out of room a push fails and everything already in the map is still there
+	MemoryArena small = create_memory_arena( "tests" );
+
+	if ( !small.init( KB( 8 ), 0, 0 ) )
+	{
+		tests_fail( "dynamic map: failed to initialise memory" );
+		return;
+	}
+
+	DynamicMap<u64, u64> bounded;
+	reference.clear();
+	u64 key = 0;
+
+	for ( inserted = bounded.init( &small.permanent ); inserted; ++key )
+	{
+		inserted = bounded.insert( key, key + 1 );
+
+		if ( inserted )
+			reference[ key ] = key + 1;
+	}
+
+	if ( bounded.count() == 0 || bounded.insert( key, 1 ) || bounded.push( key + 1 ) )
+		tests_fail( "dynamic map: inserted with the allocator out of room" );
+
+	tests_map_matches( bounded, reference, key + 2, "dynamic map out of room" );
+
+	small.free();
+	memory.free();
+
+	log( "dynamic map: %s", tests.failures == failures ? "ok" : "FAILED" );
+}
+
+// FLAT MAP /////////////////////////////////////////////////////////////////////
+// Removing from a linear probed table shifts entries back over the hole, the part most likely to
+// go wrong when a cluster wraps past the last slot or spans more than one 16 slot control group.
+// These keys carry the hash the test picked for them, so clusters can be put exactly there.
+
+struct TestsFlatKey
+{
+	u32 id;
+	u64 hash;
+
+	[[nodiscard]] bool operator == ( const TestsFlatKey &other ) const
+	{
+		return id == other.id;
+	}
+};
+
+template <>
+struct MapHash<TestsFlatKey>
+{
+	static u64 create( const TestsFlatKey &key )
+	{
+		return key.hash;
+	}
+};
+
+#define TESTS_FLAT_KEYS			96
+#define TESTS_FLAT_CAPACITY		48
+
+using TestsFlatMap = FlatMap<TestsFlatKey, u64, TESTS_FLAT_CAPACITY>;
+
+// Every key is found, or not, as in reference, and walking the slots finds the same entries
+static bool tests_flat_map_matches( const TestsFlatMap &map, const TestsFlatKey ( &keys )[ TESTS_FLAT_KEYS ], const std::map<u64, u64> &reference, const char *name )
+{
+	if ( map.count() != reference.size() )
+	{
+		tests_fail( "%s: holds %llu entries, expected %llu", name, map.count(), static_cast<u64>( reference.size() ) );
+		return false;
+	}
+
+	for ( const TestsFlatKey &key : keys )
+	{
+		auto expected = reference.find( key.id );
+		const TestsFlatMap::Entry *entry = map.find( key );
+
+		if ( ( expected == reference.end() ) != ( entry == nullptr ) || ( entry && entry->value != expected->second ) )
+		{
+			tests_fail( "%s: key %u is %s, expected %s", name, key.id, entry ? "found" : "missing", expected != reference.end() ? "found" : "missing" );
+			return false;
+		}
+	}
+
+	u64 walked = 0;
+
+	for ( u64 slot = 0; slot < TestsFlatMap::SlotCount; ++slot )
+		walked += map.at( slot ) ? 1 : 0;
+
+	if ( walked != reference.size() )
+	{
+		tests_fail( "%s: %llu used slots for %llu entries", name, walked, static_cast<u64>( reference.size() ) );
+		return false;
+	}
+
+	return true;
+}
+
+static void tests_flat_map()
+{
+	u32 failures = tests.failures;
+
+	// A few hashes for every home slot, found by trying them
+	u64 homeHashes[ TestsFlatMap::SlotCount ][ 4 ];
+	u32 homeFound[ TestsFlatMap::SlotCount ] = {};
+	u64 remaining = TestsFlatMap::SlotCount * 4;
+
+	for ( u64 hash = 0; remaining > 0; ++hash )
+	{
+		u64 home = TestsFlatMap::home( TestsFlatMap::mix( TestsFlatKey{ 0, hash } ) );
+
+		if ( homeFound[ home ] < 4 )
+		{
+			homeHashes[ home ][ homeFound[ home ]++ ] = hash;
+			remaining -= 1;
+		}
+	}
+
+	// A third of the keys start in the last four or first two slots so clusters wrap, the rest
+	// land in the first two control groups so clusters cross from one group into the next
+	TestsFlatKey keys[ TESTS_FLAT_KEYS ];
+	u32 state = 7;
+
+	for ( u32 id = 0; id < TESTS_FLAT_KEYS; ++id )
+	{
+		u64 home = id % 3 == 0 ? ( TestsFlatMap::SlotCount - 4 + tests_random( &state ) % 6 ) % TestsFlatMap::SlotCount : tests_random( &state ) % 32;
+		keys[ id ] = { id, homeHashes[ home ][ tests_random( &state ) % 4 ] };
+	}
+
+	TestsFlatMap map;
+	std::map<u64, u64> reference;
+
+	for ( u32 step = 0; step < 100000; ++step )
+	{
+		const TestsFlatKey &key = keys[ tests_random( &state ) % TESTS_FLAT_KEYS ];
+		u32 op = tests_random( &state ) % 3;
+
+		if ( op < 2 )
+		{
+			u64 value = tests_random( &state );
+			bool fits = reference.count( key.id ) == 1 || reference.size() < TESTS_FLAT_CAPACITY;
+
+			if ( map.insert( key, value ) != fits )
+				tests_fail( "flat map: inserting %u with %llu entries returned %d", key.id, map.count(), !fits );
+
+			if ( fits )
+				reference[ key.id ] = value;
+		}
+		else
+		{
+			bool removed = map.remove( key );
+
+			if ( removed != ( reference.erase( key.id ) == 1 ) )
+				tests_fail( "flat map: removing %u returned %d", key.id, removed );
+		}
+
+		if ( !tests_flat_map_matches( map, keys, reference, "flat map" ) )
+			break;
+	}
+
+	// Full with every key around the wrap, then emptied again in a random order
+	map.clear();
+	reference.clear();
+
+	for ( const TestsFlatKey &key : keys )
+	{
+		if ( key.id % 3 == 0 && !map.full() && map.insert( key, key.id ) )
+			reference[ key.id ] = key.id;
+	}
+
+	for ( const TestsFlatKey &key : keys )
+	{
+		if ( key.id % 3 != 0 && !map.full() && map.insert( key, key.id ) )
+			reference[ key.id ] = key.id;
+	}
+
+	for ( const TestsFlatKey &key : keys )
+	{
+		if ( reference.count( key.id ) == 0 && map.push( key ) )
+		{
+			tests_fail( "flat map: took key %u past its capacity of %d", key.id, TESTS_FLAT_CAPACITY );
+			break;
+		}
+	}
+
+	tests_flat_map_matches( map, keys, reference, "flat map full" );
+
+	while ( !reference.empty() )
+	{
+		auto it = reference.begin();
+		std::advance( it, tests_random( &state ) % reference.size() );
+
+		if ( !map.remove( keys[ it->first ] ) )
+			tests_fail( "flat map: couldn't remove %llu from a full map", it->first );
+
+		reference.erase( it );
+
+		if ( !tests_flat_map_matches( map, keys, reference, "flat map emptying" ) )
+			break;
+	}
+
+	// Ordinary hashes over a bigger table, too big for the stack
+	static FlatMap<u64, u64, 5000> large;
+	reference.clear();
+
+	for ( u32 step = 0; step < 200000; ++step )
+	{
+		u64 key = tests_random( &state ) % 6000;
+
+		if ( tests_random( &state ) % 2 )
+		{
+			if ( large.insert( key, step ) )
+				reference[ key ] = step;
+			else if ( reference.size() < 5000 )
+				tests_fail( "flat map: inserting %llu with %llu entries failed", key, large.count() );
+		}
+		else if ( large.remove( key ) != ( reference.erase( key ) == 1 ) )
+		{
+			tests_fail( "flat map: removing %llu disagreed with std::map", key );
+		}
+	}
+
+	tests_map_matches( large, reference, 6000, "flat map large" );
+
+	log( "flat map: %s", tests.failures == failures ? "ok" : "FAILED" );
+}
+
+// CACHE ////////////////////////////////////////////////////////////////////////
+// -cache keys a job on a hash of its inputs. Files that can't be mapped are hashed in chunks, which
+// has to give the same key, and a second run of an unchanged job must skip writing the output.
+
+static void tests_cache_hash()
+{
+	u32 failures = tests.failures;
+
+	// Reference value of xxHash64 over no bytes
+	if ( hash64( nullptr, 0, 0 ) != 0xEF46DB3751D8E999ull )
+		tests_fail( "hash64: wrong hash of 0 bytes" );
+
+	// Every split of the data, around the 32 byte stripes, hashes the same as one call
+	u8 data[ 301 ];
+	tests_fill( data, sizeof( data ), 7 );
+
+	static const u64 sizes[] = { 0, 1, 4, 8, 31, 32, 33, 63, 64, 65, 100, 301 };
+	static const u64 chunks[] = { 1, 3, 8, 31, 32, 33, 64, 301 };
+
+	for ( u64 size : sizes )
+	{
+		u64 expected = hash64( data, size, 12345 );
+
+		for ( u64 chunk : chunks )
+		{
+			Hash64State state;
+			hash64_begin( &state, 12345 );
+
+			for ( u64 offset = 0; offset < size; offset += chunk )
+				hash64_update( &state, data + offset, size - offset < chunk ? size - offset : chunk );
+
+			if ( hash64_end( &state ) != expected )
+				tests_fail( "hash64: %llu bytes in %llu byte pieces hash differently", size, chunk );
+		}
+	}
+
+	// An empty file can't be mapped, so it's read instead
+	char path[ 4096 ];
+	snprintf( path, sizeof( path ), "%scache_empty", tests.directory );
+
+	FILE *file = fopen( path, "wb" );
+
+	if ( file )
+		fclose( file );
+
+	u64 hash = 12345;
+
+	if ( !file || !cache_hash_file( path, &hash ) )
+		tests_fail( "cache: failed to hash the empty file %s", path );
+	else if ( hash != hash64( nullptr, 0, 12345 ) )
+		tests_fail( "cache: the empty file %s hashes differently to 0 bytes", path );
+
+	log( "cache hash: %s", tests.failures == failures ? "ok" : "FAILED" );
+}
+
+// Writes a grey input for the job
+[[nodiscard]] static bool tests_cache_input( const char *path, u32 seed )
+{
+	const u32 width = 61;
+	const u32 height = 37;
+	u8 image[ width * height ];
+	tests_fill( image, sizeof( image ), seed );
+
+	MemoryArena memory = create_memory_arena( "cache input" );
+	bool written = memory.init_virtual( 0, png_write_memory( width, height, 1, 1 ) + MEMORY_ALLOCATION_OVERHEAD, 0 ) &&
+		png_write( nullptr, &memory.transient, path, image, width, height, 1, { options.compression, options.pngFilter } );
+
+	memory.free();
+
+	return written;
+}
+
+// Runs the job the way main runs a single job, in an arena sized by its plan
+[[nodiscard]] static bool tests_cache_run( MergeJob job )
+{
+	if ( plan_job( &job, 1 ) != RESULT_CODE_SUCCESS )
+		return false;
+
+	app.jobMemory = create_memory_arena( "job" );
+
+	if ( !app.jobMemory.init_virtual( 0, job.memory, 0 ) )
+		return false;
+
+	threadMemory = &app.jobMemory;
+	RESULT_CODE code = run_job( job );
+	threadMemory = &app.memory;
+	app.jobMemory.free();
+
+	return code == RESULT_CODE_SUCCESS;
+}
+
+// The output is overwritten with bytes of the same size between runs. A run that hits the cache
+// leaves them there, one that misses writes the image again.
+static void tests_cache_run_twice()
+{
+	u32 failures = tests.failures;
+
+	char input[ 4096 ];
+	char output[ 4096 ];
+	snprintf( input, sizeof( input ), "%scache_r.png", tests.directory );
+	snprintf( output, sizeof( output ), "%scache_out.png", tests.directory );
+
+	MergeJob job;
+	job.inputFileR = input;
+	job.outputFile = output;
+
+	app.memory = create_memory_arena( "app" );
+	merge_build_table( &app.merge, cpu_features(), options.layout );
+	options.cache = true;
+
+	u8 *written = nullptr;
+	u64 writtenSize = 0;
+
+	if ( !app.memory.init_virtual( 0, PLAN_MEMORY, 0 ) || !tests_cache_input( input, 1 ) )
+		tests_fail( "cache: failed to write the input %s", input );
+	else if ( !tests_cache_run( job ) || !( written = tests_read_file( output, &writtenSize ) ) )
+		tests_fail( "cache: the first run failed to write %s", output );
+
+	if ( written )
+	{
+		auto overwrite = [ & ]
+		{
+			FILE *file = fopen( output, "wb" );
+			bool ok = file && fwrite( written, 1, writtenSize, file ) == writtenSize;
+
+			if ( file )
+				fclose( file );
+
+			return ok;
+		};
+
+		// Same size, different bytes, so only a rewrite can change them back
+		for ( u64 i = 0; i < writtenSize; ++i )
+			written[ i ] ^= 0xFF;
+
+		u64 size = 0;
+		u8 *data = nullptr;
+
+		if ( !overwrite() || !tests_cache_run( job ) || !( data = tests_read_file( output, &size ) ) )
+			tests_fail( "cache: the second run failed" );
+		else if ( size != writtenSize || memcmp( data, written, size ) != 0 )
+			tests_fail( "cache: the second run of an unchanged job wrote %s again", output );
+
+		free( data );
+		data = nullptr;
+
+		// A changed input has a new key, so the output is written again
+		if ( !tests_cache_input( input, 2 ) || !overwrite() || !tests_cache_run( job ) || !( data = tests_read_file( output, &size ) ) )
+			tests_fail( "cache: the run after changing the input failed" );
+		else if ( size == writtenSize && memcmp( data, written, size ) == 0 )
+			tests_fail( "cache: a changed input didn't rewrite %s", output );
+
+		free( data );
+		free( written );
+	}
+
+	options.cache = false;
+	app.memory.free();
+
+	log( "cache run twice: %s", tests.failures == failures ? "ok" : "FAILED" );
+}
+
+// ENTRY ////////////////////////////////////////////////////////////////////////
+
+static constexpr auto testsCommands = frozen_map<CommandFunc>( {
+	{ "-dir", [] ( int &index, int argc, const char *argv[] )
+		{
+			tests.directory = argv[ ++index ];
+
+			return tests.directory ? RESULT_CODE_SUCCESS : RESULT_CODE_INVALID_TESTS_OPTION;
+		} },
+} );
+
+int main( int argc, const char *argv[] )
+{
+	for ( int i = 1; i < argc; ++i )
+	{
+		auto f = testsCommands.find( argv[ i ] );
+
+		if ( f )
+		{
+			RESULT_CODE code = f->value( i, argc, &argv[ 0 ] );
+			if ( code != RESULT_CODE_SUCCESS )
+				return tests_usage_message( code );
+		}
+		else
+		{
+			log_warning( "Unknown command: %s", argv[ i ] );
+			return tests_usage_message( RESULT_CODE_UNKNOWN_OPTIONAL_COMMAND );
+		}
+	}
+
+	// Test files always go in a directory of their own
+	u64 directoryLength = strlen( tests.directory );
+
+	if ( directoryLength == 0 || ( tests.directory[ directoryLength - 1 ] != '/' && tests.directory[ directoryLength - 1 ] != '\\' ) )
+	{
+		log_warning( "-dir must end in a separator: %s", tests.directory );
+		return tests_usage_message( RESULT_CODE_INVALID_TESTS_OPTION );
+	}
+
+	make_directory( tests.directory );
+
+	tests_merge_dispatch( cpu_features() );
+	tests_merge( cpu_features() );
+	tests_png_write();
+	tests_dynamic_array();
+	tests_dynamic_map();
+	tests_flat_map();
+	tests_cache_hash();
+	tests_cache_run_twice();
+
+	if ( tests.failures )
+		log_error( "%u tests failed", tests.failures );
+	else
+		log( "All tests passed" );
+
+	return static_cast<int>( tests.failures );
+}
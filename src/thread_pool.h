@@ -0,0 +1,165 @@
+#pragma once
+
+#define THREAD_POOL_MAX_THREADS		256
+#define THREAD_POOL_MAX_TASKS		1024
+
+using TaskFunc = void (*)( void *data );
+
+struct TaskGroup
+{
+	std::atomic<u64> pending = 0;
+};
+
+struct Task
+{
+	TaskFunc func;
+	void *data;
+	TaskGroup *group;
+};
+
+struct ThreadPool
+{
+	bool init( u32 count, void ( *threadStart )( u32 index ) = nullptr );
+	void free();
+	void submit( TaskGroup *group, TaskFunc func, void *data );
+	void wait( TaskGroup *group );
+
+	u32 threadCount = 0;
+	bool quit = false;
+	void ( *thread_start )( u32 index ) = nullptr;
+	std::thread threads[ THREAD_POOL_MAX_THREADS ];
+	std::mutex mutex;
+	std::condition_variable taskAdded;
+	std::condition_variable taskFinished;
+	Array<Task, THREAD_POOL_MAX_TASKS> tasks;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// Take the oldest task, optionally only from a specific group. The mutex must be held.
+[[nodiscard]] static bool thread_pool_pop( ThreadPool *pool, TaskGroup *group, Task *task )
+{
+	for ( u64 i = 0; i < pool->tasks.count; ++i )
+	{
+		if ( group && pool->tasks[ i ].group != group )
+			continue;
+
+		*task = pool->tasks[ i ];
+
+		for ( u64 j = i + 1; j < pool->tasks.count; ++j )
+			pool->tasks[ j - 1 ] = pool->tasks[ j ];
+
+		pool->tasks.pop_back();
+
+		return true;
+	}
+
+	return false;
+}
+
+static void thread_pool_run( ThreadPool *pool, const Task &task )
+{
+	task.func( task.data );
+
+	if ( task.group->pending.fetch_sub( 1 ) == 1 )
+	{
+		// Take the lock so a waiter can't miss the notification between its check and its wait
+		std::lock_guard<std::mutex> lock( pool->mutex );
+		pool->taskFinished.notify_all();
+	}
+}
+
+static void thread_pool_worker( ThreadPool *pool, u32 index )
+{
+	if ( pool->thread_start )
+		pool->thread_start( index );
+
+	while ( true )
+	{
+		Task task;
+		{
+			std::unique_lock<std::mutex> lock( pool->mutex );
+
+			pool->taskAdded.wait( lock, [ pool ] { return pool->quit || !pool->tasks.empty(); } );
+
+			if ( !thread_pool_pop( pool, nullptr, &task ) )
+				return;
+		}
+
+		thread_pool_run( pool, task );
+	}
+}
+
+bool ThreadPool::init( u32 count, void ( *threadStart )( u32 index ) )
+{
+	assert( count <= THREAD_POOL_MAX_THREADS );
+
+	quit = false;
+	thread_start = threadStart;
+	threadCount = 0;
+
+	for ( u32 i = 0; i < count; ++i )
+	{
+		threads[ i ] = std::thread( thread_pool_worker, this, i );
+		threadCount += 1;
+	}
+
+	return true;
+}
+
+void ThreadPool::free()
+{
+	{
+		std::lock_guard<std::mutex> lock( mutex );
+		quit = true;
+	}
+
+	taskAdded.notify_all();
+
+	for ( u32 i = 0; i < threadCount; ++i )
+		threads[ i ].join();
+
+	threadCount = 0;
+}
+
+void ThreadPool::submit( TaskGroup *group, TaskFunc func, void *data )
+{
+	Task task = { .func = func, .data = data, .group = group };
+
+	group->pending += 1;
+
+	{
+		std::lock_guard<std::mutex> lock( mutex );
+
+		if ( threadCount > 0 && !tasks.full() )
+		{
+			tasks.add( task );
+			taskAdded.notify_one();
+			return;
+		}
+	}
+
+	// No workers or the queue is full, just run it here
+	thread_pool_run( this, task );
+}
+
+void ThreadPool::wait( TaskGroup *group )
+{
+	// Help with the group's own tasks while waiting. Only tasks from the same
+	// group are taken so an unrelated task never runs nested inside this one.
+	while ( group->pending > 0 )
+	{
+		Task task;
+		{
+			std::unique_lock<std::mutex> lock( mutex );
+
+			if ( !thread_pool_pop( this, group, &task ) )
+			{
+				taskFinished.wait( lock, [ group ] { return group->pending == 0; } );
+				return;
+			}
+		}
+
+		thread_pool_run( this, task );
+	}
+}
@@ -0,0 +1,271 @@
+#pragma once
+
+// Timeline of where a run spends its time, written as Chrome trace events (chrome://tracing or
+// ui.perfetto.dev). Spans are complete events kept in blocks owned by the thread that recorded
+// them, the lock is only taken when a block fills, so a span costs two clock reads and a store
+// and tracing can stay on for whole batches. With tracing off every call is one branch.
+
+#define TRACE_BLOCK_EVENTS		4096
+#define TRACE_MEMORY			MB( 256 )	// about four million spans, reserved and committed as blocks fill
+#define TRACE_DETAIL_SIZE		40
+#define TRACE_ROW_BLOCK			64			// rows of a merge recorded together
+#define TRACE_ROW_PARTS			3
+
+struct TraceEvent
+{
+	const char *name;						// a string literal, it's only read when the trace is written
+	u64 start;								// steady clock nanoseconds
+	u64 duration;
+	char detail[ TRACE_DETAIL_SIZE ];		// the end of a path or similar, may be empty
+};
+
+struct TraceBlock
+{
+	TraceBlock *next;
+	u32 thread;
+	u32 count;
+	TraceEvent events[ TRACE_BLOCK_EVENTS ];
+};
+
+struct Trace
+{
+	bool enabled = false;
+	std::mutex mutex;
+	MemoryArena memory;
+	TraceBlock *blocks = nullptr;			// newest first
+	u32 threads = 0;
+	u64 dropped = 0;						// spans lost once the memory ran out
+};
+
+static Trace trace;
+static thread_local TraceBlock *traceBlock = nullptr;
+
+//////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+[[nodiscard]] static inline u64 trace_clock()
+{
+	return static_cast<u64>( std::chrono::duration_cast<std::chrono::nanoseconds>( std::chrono::steady_clock::now().time_since_epoch() ).count() );
+}
+
+// Arena is a blank one from create_memory_arena for the spans to live in
+[[nodiscard]] static bool trace_begin( MemoryArena arena )
+{
+	trace.memory = arena;
+
+	if ( !trace.memory.init_virtual( 0, TRACE_MEMORY, 0 ) )
+		return false;
+
+	trace.enabled = true;
+
+	return true;
+}
+
+// Every thread gets a block of its own, and a number the first time it records anything
+[[nodiscard]] static TraceBlock *trace_new_block()
+{
+	std::lock_guard<std::mutex> lock( trace.mutex );
+
+	TraceBlock *block = trace.memory.transient.allocate<TraceBlock>();
+
+	if ( !block )
+	{
+		trace.dropped += 1;
+		return nullptr;
+	}
+
+	block->thread = traceBlock ? traceBlock->thread : ++trace.threads;
+	block->count = 0;
+	block->next = trace.blocks;
+	trace.blocks = block;
+
+	return block;
+}
+
+// A span from start to end, times from trace_clock. Only the last TRACE_DETAIL_SIZE - 1 bytes of detail are kept.
+static void trace_record( const char *name, const char *detail, u64 start, u64 end )
+{
+	if ( !trace.enabled )
+		return;
+
+	if ( !traceBlock || traceBlock->count == TRACE_BLOCK_EVENTS )
+	{
+		TraceBlock *block = trace_new_block();
+
+		if ( !block )
+			return;
+
+		traceBlock = block;
+	}
+
+	TraceEvent *event = &traceBlock->events[ traceBlock->count++ ];
+	event->name = name;
+	event->start = start;
+	event->duration = end - start;
+	event->detail[ 0 ] = '\0';
+
+	if ( detail )
+	{
+		u64 length = strlen( detail );
+		u64 kept = length < TRACE_DETAIL_SIZE ? length : TRACE_DETAIL_SIZE - 1;
+
+		// Never start part way through a utf-8 character
+		while ( kept > 0 && ( static_cast<u8>( detail[ length - kept ] ) & 0xC0 ) == 0x80 )
+			kept -= 1;
+
+		memcpy( event->detail, detail + length - kept, kept );
+		event->detail[ kept ] = '\0';
+	}
+}
+
+// Records a span for as long as it lives
+struct TraceScope
+{
+	explicit TraceScope( const char *name, const char *detail = nullptr ) : name( name ), detail( detail ), start( trace.enabled ? trace_clock() : 0 ) {}
+	~TraceScope() { if ( trace.enabled ) trace_record( name, detail, start, trace_clock() ); }
+
+	TraceScope( const TraceScope & ) = delete;
+	TraceScope &operator=( const TraceScope & ) = delete;
+
+	const char *name;
+	const char *detail;
+	u64 start;
+};
+
+// ROWS //////////////////////////////////////////////////////////////////////////////////////////////////////////////
+// A merge interleaves decoding, merging and writing on every row, far too often for a span each.
+// The time each part takes is added up instead and every TRACE_ROW_BLOCK rows each part is recorded
+// as one span, back to back from the start of the block. Totals are exact, the order within a block isn't.
+
+struct TraceRows
+{
+	const char *names[ TRACE_ROW_PARTS ];
+	u64 blockStart;
+	u64 last;
+	u64 spent[ TRACE_ROW_PARTS ];
+	u32 rows;
+};
+
+static void trace_rows_begin( TraceRows *rows, const char *first, const char *second, const char *third )
+{
+	*rows = {};
+	rows->names[ 0 ] = first;
+	rows->names[ 1 ] = second;
+	rows->names[ 2 ] = third;
+
+	if ( trace.enabled )
+		rows->blockStart = rows->last = trace_clock();
+}
+
+// The time since the last mark went on part
+static inline void trace_rows_mark( TraceRows *rows, u32 part )
+{
+	if ( !trace.enabled )
+		return;
+
+	u64 now = trace_clock();
+	rows->spent[ part ] += now - rows->last;
+	rows->last = now;
+}
+
+static void trace_rows_flush( TraceRows *rows )
+{
+	if ( !trace.enabled || rows->rows == 0 )
+		return;
+
+	u64 at = rows->blockStart;
+
+	for ( u32 part = 0; part < TRACE_ROW_PARTS; ++part )
+	{
+		if ( rows->spent[ part ] == 0 )
+			continue;
+
+		trace_record( rows->names[ part ], nullptr, at, at + rows->spent[ part ] );
+		at += rows->spent[ part ];
+		rows->spent[ part ] = 0;
+	}
+
+	rows->blockStart = rows->last;
+	rows->rows = 0;
+}
+
+static inline void trace_rows_next( TraceRows *rows )
+{
+	if ( trace.enabled && ++rows->rows == TRACE_ROW_BLOCK )
+		trace_rows_flush( rows );
+}
+
+// OUTPUT ////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+static void trace_write_string( FILE *file, const char *text )
+{
+	for ( ; *text; ++text )
+	{
+		unsigned char c = static_cast<unsigned char>( *text );
+
+		if ( c == '"' || c == '\\' )
+			fprintf( file, "\\%c", c );
+		else if ( c < 0x20 )
+			fprintf( file, "\\u%04x", c );
+		else
+			fputc( c, file );
+	}
+}
+
+// Writes every span recorded so far, times in microseconds from the first one.
+// Threads still recording must be between spans. Check trace.dropped afterwards.
+[[nodiscard]] static bool trace_write( const char *filename )
+{
+	std::lock_guard<std::mutex> lock( trace.mutex );
+
+	FILE *file = fopen( filename, "wb" );
+
+	if ( !file )
+		return false;
+
+	u64 origin = UINT64_MAX;
+
+	for ( TraceBlock *block = trace.blocks; block; block = block->next )
+	{
+		for ( u32 i = 0; i < block->count; ++i )
+			origin = block->events[ i ].start < origin ? block->events[ i ].start : origin;
+	}
+
+	fprintf( file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n" );
+
+	bool first = true;
+
+	for ( TraceBlock *block = trace.blocks; block; block = block->next )
+	{
+		for ( u32 i = 0; i < block->count; ++i )
+		{
+			const TraceEvent &event = block->events[ i ];
+
+			fprintf( file, "%s{\"name\":\"", first ? "" : ",\n" );
+			trace_write_string( file, event.name );
+			fprintf( file, "\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f", block->thread, ( event.start - origin ) / 1000.0, event.duration / 1000.0 );
+
+			if ( event.detail[ 0 ] )
+			{
+				fprintf( file, ",\"args\":{\"detail\":\"" );
+				trace_write_string( file, event.detail );
+				fprintf( file, "\"}" );
+			}
+
+			fprintf( file, "}" );
+			first = false;
+		}
+	}
+
+	fprintf( file, "\n]}\n" );
+
+	return fclose( file ) == 0;
+}
+
+static void trace_end()
+{
+	std::lock_guard<std::mutex> lock( trace.mutex );
+
+	trace.enabled = false;
+	trace.blocks = nullptr;
+	trace.memory.free();
+}